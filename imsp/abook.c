@@ -46,6 +46,10 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 #include "xmalloc.h"
 #include "util.h"
 #include "syncdb.h"
@@ -55,13 +59,21 @@
 #include "abook_ldap.h"
 #endif
 #include "acl.h"
+#include "charset.h"
+#include "glob.h"
 #include "option.h" /* for option_doquota() */
 
 /* database names */
 static char abooks[] = "abooks";
+static char abooksharddb[] = "abooks.%d";
 static char abooksdb[] = "user/%s/abooks";
 static char abooksudb[] = "user/%.*s/abooks";
 static char abookdb[] = "user/%.*s/abook.%s";
+static char abookidxdb[] = "user/%.*s/abookidx.%s";
+
+/* fields to keep indexes of */
+static char opt_index[] = "imsp.abook.index";
+static char opt_substrindex[] = "imsp.abook.substring.index";
 
 /* generate the database name for an address book
  *  returns -1 for invalid name, otherwise returns length of owner name
@@ -88,6 +100,540 @@ static int abook_dbname(char *dbname, int maxout, const char *name)
     return (ownerlen);
 }
 
+/* find the shard of the global abooks list holding an address book's ACL.
+ * All address books of an owner share a shard.
+ */
+static int abook_shard(const char *name)
+{
+    unsigned long hash = 0;
+
+    for (; *name != '\0' && *name != '.'; ++name) {
+	hash = hash * 31 + TOLOWER(*name);
+    }
+
+    return (hash % SDB_SHARDS);
+}
+
+/* generate the name of the global abooks list shard for an address book
+ */
+static char *abook_acldb(char *acldb, int maxout, const char *name)
+{
+    snprintf(acldb, maxout, abooksharddb, abook_shard(name));
+
+    return (acldb);
+}
+
+/* get a handle on the global abooks list shard for an address book, kept
+ * open for the life of the process
+ */
+static sdb_db *abook_acldbh(const char *name)
+{
+    static sdb_db *shards[SDB_SHARDS];
+    char acldb[32];
+    int shard;
+
+    shard = abook_shard(name);
+    if (shards[shard] == NULL) {
+	snprintf(acldb, sizeof(acldb), abooksharddb, shard);
+	shards[shard] = sdb_open(acldb);
+    }
+
+    return (shards[shard]);
+}
+
+/* generate the database name for the field indexes of an address book
+ */
+static void abook_idxname(char *idxname, int maxout, int ownerlen,
+			  const char *name)
+{
+    snprintf(idxname, maxout, abookidxdb, ownerlen, name, name);
+}
+
+/* NOTES
+ * The "abookidx.<name>" database holds indexes of some fields of an
+ * address book, so that searches on them need not glob every entry.  The
+ * key "<field>" marks a field as indexed, and each entry with a value for
+ * it has the key "<field>"<value>"<alias>".  An index is built the first
+ * time its field is searched if the field is listed in imsp.abook.index,
+ * and from then on is kept up to date by abook_store and abook_deleteent.
+ *
+ * Fields listed in imsp.abook.substring.index also get a trigram index in
+ * the same database, for patterns starting with a wildcard such as
+ * "*smith*".  The key ""<field>" marks it, and each three character
+ * substring of a value has the key ""<field>"<trigram>"<alias>".  The
+ * aliases having all the trigrams of the longest literal part of the
+ * pattern are the only candidates, and only their values are checked.
+ *
+ * Both kinds of index entry are changed after the address book entry
+ * they're for, in one batch.  An index that can't be kept right is not
+ * left marked as built: the whole index database is removed, and the
+ * indexes are built again when next searched.
+ * END NOTES */
+
+/* kinds of field index */
+#define IDX_VALUE	0
+#define IDX_GRAM	1
+#define GRAMLEN		3
+
+/* generate the key marking a field as indexed
+ *  returns NULL on failure, otherwise the key, which the caller must free
+ */
+static char *abook_idxmark(char *field, int kind)
+{
+    char *key;
+    int keylen;
+
+    keylen = strlen(field) + 2;
+    if ((key = malloc(keylen)) != NULL) {
+	snprintf(key, keylen, kind == IDX_GRAM ? "\"%s" : "%s", field);
+    }
+
+    return (key);
+}
+
+/* check if a field of an address book has an index of the given kind
+ */
+static int abook_indexed(char *idxdb, char *field, int kind)
+{
+    char *key, *value;
+    int result;
+
+    if ((key = abook_idxmark(field, kind)) == NULL) return (0);
+    result = sdb_get(idxdb, key, SDB_ICASE, &value) == 0 && value != NULL;
+    free(key);
+
+    return (result);
+}
+
+/* add the index entry for a field of an address book entry to a batch of
+ * index changes, or its removal
+ *  returns -1 on failure, 0 on success
+ */
+static int abook_idxentry(sdb_batch *ib, char *field, char *value,
+			  char *alias, int add)
+{
+    char *key;
+    int keylen, result;
+
+    keylen = strlen(field) + strlen(value) + strlen(alias) + 3;
+    if ((key = malloc(keylen)) == NULL) return (-1);
+    snprintf(key, keylen, "%s\"%s\"%s", field, value, alias);
+    if (add) {
+	result = sdb_batch_set(ib, key, "");
+    } else {
+	result = sdb_batch_remove(ib, key);
+    }
+    free(key);
+
+    return (result);
+}
+
+/* add the trigram entries for a field of an address book entry to a batch
+ * of index changes, or their removal.  A trigram seen twice is changed
+ * twice, the same way.
+ *  returns -1 on failure, 0 on success
+ */
+static int abook_gramentries(sdb_batch *ib, char *field, char *value,
+			     char *alias, int add)
+{
+    char *key, *gram;
+    int i, vlen, keylen, result = 0;
+
+    vlen = strlen(value);
+    if (vlen < GRAMLEN) return (0);
+    keylen = strlen(field) + GRAMLEN + strlen(alias) + 4;
+    if ((key = malloc(keylen)) == NULL) return (-1);
+    snprintf(key, keylen, "\"%s\"%*s\"%s", field, GRAMLEN, "", alias);
+    gram = key + strlen(field) + 2;
+    for (i = 0; i + GRAMLEN <= vlen && result == 0; ++i) {
+	memcpy(gram, value + i, GRAMLEN);
+	result = add ? sdb_batch_set(ib, key, "") : sdb_batch_remove(ib, key);
+    }
+    free(key);
+
+    return (result);
+}
+
+/* add all the index changes for a field of an address book entry to a
+ * batch of index changes
+ *  idxdb must be locked
+ *  returns -1 on failure, 0 on success
+ */
+static int abook_reindex(char *idxdb, sdb_batch *ib, char *field,
+			 char *value, char *alias, int add)
+{
+    if (abook_indexed(idxdb, field, IDX_VALUE)
+	&& abook_idxentry(ib, field, value, alias, add) < 0) {
+	return (-1);
+    }
+    if (abook_indexed(idxdb, field, IDX_GRAM)
+	&& abook_gramentries(ib, field, value, alias, add) < 0) {
+	return (-1);
+    }
+
+    return (0);
+}
+
+/* apply a batch of index changes once the entry they are for has been
+ * changed.  If they can't be applied, the index database is removed
+ * instead, so the indexes are built again when next used.
+ *  idxdb must be locked, and is unlocked
+ *  returns -1 if the indexes may be stale, 0 on success
+ */
+static int abook_idxapply(char *idxdb, sdb_batch *ib)
+{
+    int result;
+
+    result = sdb_batch_apply(idxdb, ib, SDB_ICASE);
+    if (sdb_unlock(idxdb, NULL, SDB_ICASE) < 0) result = -1;
+    if (result < 0 && sdb_delete(idxdb) == 0) result = 0;
+
+    return (result);
+}
+
+/* build an index of a field of an address book
+ *  returns -1 on failure, 0 on success
+ */
+static int abook_buildindex(char *dbname, char *idxdb, char *field, int kind)
+{
+    sdb_keyvalue *kv;
+    sdb_batch *ib;
+    char *pat, *sep, *mark;
+    int i, kvcount, patlen, result;
+
+    if (sdb_check(idxdb) < 0 && sdb_create(idxdb) < 0) return (-1);
+
+    /* lock the address book, then the index, the same as abook_store */
+    if (sdb_writelock(dbname, NULL, SDB_ICASE) < 0) return (-1);
+    if (sdb_writelock(idxdb, NULL, SDB_ICASE) < 0) {
+	sdb_unlock(dbname, NULL, SDB_ICASE);
+	return (-1);
+    }
+
+    /* another server may have built it while we waited for the locks */
+    result = 0;
+    if (!abook_indexed(idxdb, field, kind)) {
+	ib = sdb_batch_open();
+	patlen = strlen(field) + 3;
+	if ((pat = malloc(patlen)) == NULL) {
+	    result = -1;
+	} else {
+	    snprintf(pat, patlen, "*\"%s", field);
+	    result = sdb_match(dbname, pat, SDB_ICASE, NULL, 1, &kv, &kvcount);
+	    free(pat);
+	}
+	if (result >= 0) {
+	    for (i = 0; i < kvcount && result >= 0; ++i) {
+		sep = strchr(kv[i].key, '"');
+		*sep = '\0';
+		if (kind == IDX_GRAM) {
+		    result = abook_gramentries(ib, field, kv[i].value,
+					       kv[i].key, 1);
+		} else {
+		    result = abook_idxentry(ib, field, kv[i].value,
+					    kv[i].key, 1);
+		}
+	    }
+	    if (kvcount) sdb_freematch(kv, kvcount, 1);
+	    if (result >= 0) {
+		if ((mark = abook_idxmark(field, kind)) == NULL) {
+		    result = -1;
+		} else {
+		    result = sdb_batch_set(ib, mark, "");
+		    free(mark);
+		}
+	    }
+	    if (result >= 0) result = sdb_batch_apply(idxdb, ib, SDB_ICASE);
+	}
+	sdb_batch_close(ib);
+    }
+    if (sdb_unlock(idxdb, NULL, SDB_ICASE) < 0) result = -1;
+    sdb_unlock(dbname, NULL, SDB_ICASE);
+
+    return (result);
+}
+
+/* make sure a field of an address book has an index of the given kind,
+ * building it if the field is listed in the option for that kind
+ *  returns 1 if the field is indexed, 0 otherwise
+ */
+static int abook_useindex(char *dbname, char *idxdb, char *field, int kind)
+{
+    if (abook_indexed(idxdb, field, kind)) return (1);
+    if (option_lookup("", kind == IDX_GRAM ? opt_substrindex : opt_index,
+		      1, field) != 1) {
+	return (0);
+    }
+
+    return (abook_buildindex(dbname, idxdb, field, kind) == 0);
+}
+
+/* compare two keys of a match list
+ */
+static int abook_keycmp(const void *kv1, const void *kv2)
+{
+    return (strcasecmp(((sdb_keyvalue *) kv1)->key,
+		       ((sdb_keyvalue *) kv2)->key));
+}
+
+/* find the value of a key in a list of keys & values sorted by
+ * abook_keycmp
+ *  returns NULL if the key isn't there
+ */
+static char *abook_oldvalue(sdb_keyvalue *kv, int count, char *key)
+{
+    sdb_keyvalue find, *found;
+
+    if (count == 0) return (NULL);
+    find.key = key;
+    found = (sdb_keyvalue *) bsearch(&find, kv, count, sizeof (sdb_keyvalue),
+				     abook_keycmp);
+
+    return (found != NULL ? found->value : NULL);
+}
+
+/* add an entry to a copied match list
+ *  returns -1 on failure, 0 on success
+ */
+static int abook_addmatch(sdb_keyvalue *kv, char *alias, char *field,
+			  char *value)
+{
+    int keylen;
+
+    keylen = strlen(alias) + strlen(field) + 2;
+    kv->key = malloc(keylen);
+    kv->value = strdup(value);
+    if (kv->key == NULL || kv->value == NULL) {
+	if (kv->key) free(kv->key);
+	if (kv->value) free(kv->value);
+	return (-1);
+    }
+    snprintf(kv->key, keylen, "%s\"%s", alias, field);
+
+    return (0);
+}
+
+/* find the aliases having every trigram of a string in a field's trigram
+ * index.  The result is a copied match list of trigram index entries,
+ * one per alias, in alias order.
+ *  returns -1 on failure, 0 on success
+ */
+static int abook_gramprobe(char *idxdb, char *field, char *str, int len,
+			   sdb_keyvalue **pkv, int *count)
+{
+    sdb_keyvalue *gkv;
+    char *pat;
+    int i, j, k, n, gcount, patlen, cmp, result = 0;
+
+    *pkv = NULL;
+    *count = 0;
+    patlen = strlen(field) + GRAMLEN + 5;
+    if ((pat = malloc(patlen)) == NULL) return (-1);
+    for (i = 0; i + GRAMLEN <= len; ++i) {
+	snprintf(pat, patlen, "\"%s\"%.*s\"*", field, GRAMLEN, str + i);
+	if (sdb_match(idxdb, pat, SDB_ICASE, NULL, 1, &gkv, &gcount) < 0) {
+	    result = -1;
+	    break;
+	}
+
+	/* the first trigram gives the candidates, the rest narrow them */
+	if (i == 0) {
+	    *pkv = gkv;
+	    *count = gcount;
+	} else {
+	    for (j = k = n = 0; j < *count; ++j) {
+		cmp = 1;
+		while (k < gcount
+		       && (cmp = strcasecmp(strrchr((*pkv)[j].key, '"'),
+					    strrchr(gkv[k].key, '"'))) > 0) {
+		    ++k;
+		}
+		if (cmp) {
+		    free((*pkv)[j].key);
+		    free((*pkv)[j].value);
+		} else {
+		    (*pkv)[n++] = (*pkv)[j];
+		}
+	    }
+	    *count = n;
+	    sdb_freematch(gkv, gcount, 1);
+	}
+	if (!*count) break;
+    }
+    free(pat);
+    if (result < 0 || !*count) {
+	sdb_freematch(*pkv, *count, 1);
+	*pkv = NULL;
+	*count = 0;
+    }
+
+    return (result);
+}
+
+/* match entries of an address book on a field using the field's trigram
+ * index, for patterns starting with a wildcard.  The result is copied, and
+ * is what sdb_match would return for the key pattern *"<field>.
+ *  returns -1 on failure, 0 on success, 1 if the index can't be used
+ */
+static int abook_grammatch(char *dbname, char *idxdb, char *field,
+			   char *vpat, sdb_keyvalue **pkv, int *count)
+{
+    sdb_keyvalue *ckv, *kv;
+    comp_pat *cpat;
+    glob *g;
+    char *scan, *lit, *sub, *key, *value, *lvalue, *alias;
+    int i, ccount, len, litlen, keylen, result;
+
+    /* find the longest literal part of the pattern */
+    lit = NULL;
+    litlen = 0;
+    for (scan = vpat; *scan; scan += len) {
+	for (len = 0; scan[len] && scan[len] != '*' && scan[len] != '%'
+		 && scan[len] != '?'; ++len);
+	if (len > litlen) {
+	    lit = scan;
+	    litlen = len;
+	}
+	if (!len) len = 1;
+    }
+    if (litlen < GRAMLEN
+	|| !abook_useindex(dbname, idxdb, field, IDX_GRAM)) {
+	return (1);
+    }
+
+    /* narrow down the candidates */
+    if (abook_gramprobe(idxdb, field, lit, litlen, &ckv, &ccount) < 0) {
+	return (-1);
+    }
+    if (!ccount) return (0);
+
+    /* check the candidates' values, first for the literal part with a
+     * Boyer-Moore search, then against the whole pattern
+     */
+    result = -1;
+    sub = NULL;
+    cpat = NULL;
+    g = NULL;
+    key = NULL;
+    kv = *pkv = (sdb_keyvalue *) malloc(sizeof (sdb_keyvalue) * ccount);
+    if (kv == NULL || (sub = malloc(litlen + 1)) == NULL
+	|| (g = glob_init(vpat, GLOB_ICASE)) == NULL) {
+	goto done;
+    }
+    memcpy(sub, lit, litlen);
+    sub[litlen] = '\0';
+    lcase(sub);
+    cpat = charset_compilepat(sub);
+    for (i = 0; i < ccount; ++i) {
+	alias = strrchr(ckv[i].key, '"') + 1;
+	keylen = strlen(alias) + strlen(field) + 2;
+	if (key) free(key);
+	if ((key = malloc(keylen)) == NULL) goto done;
+	snprintf(key, keylen, "%s\"%s", alias, field);
+	if (sdb_get(dbname, key, SDB_ICASE, &value) < 0 || value == NULL) {
+	    continue;
+	}
+	if ((lvalue = strdup(value)) == NULL) goto done;
+	lcase(lvalue);
+	if (charset_searchstring(sub, cpat, lvalue, strlen(lvalue))
+	    && GLOB_TEST(g, value) >= 0) {
+	    if (abook_addmatch(kv, alias, field, value) < 0) {
+		free(lvalue);
+		goto done;
+	    }
+	    ++kv;
+	}
+	free(lvalue);
+    }
+    result = 0;
+
+ done:
+    if (kv != NULL) *count = kv - *pkv;
+    if (result < 0 || !*count) {
+	sdb_freematch(*pkv, *count, 1);
+	*pkv = NULL;
+	*count = 0;
+    } else {
+	qsort(*pkv, *count, sizeof (sdb_keyvalue), abook_keycmp);
+    }
+    if (key) free(key);
+    if (g) glob_free(&g);
+    if (cpat) charset_freepat(cpat);
+    if (sub) free(sub);
+    sdb_freematch(ckv, ccount, 1);
+
+    return (result);
+}
+
+/* match entries of an address book on a field using the field's indexes.
+ *  The result is copied, and is what sdb_match would return for the key
+ *  pattern *"<field>.
+ *  returns -1 on failure, 0 on success, 1 if the field isn't indexed
+ */
+static int abook_idxmatch(char *dbname, char *idxdb, char *field,
+			  char *vpat, sdb_keyvalue **pkv, int *count)
+{
+    sdb_keyvalue *ikv, *kv;
+    glob *g;
+    char *pat, *value, *alias;
+    int i, icount, flen, patlen, result;
+
+    *pkv = NULL;
+    *count = 0;
+
+    /* see if the field is or should be indexed */
+    if (strchr(field, '"')) return (1);
+    if (*vpat == '*' || *vpat == '%' || *vpat == '?') {
+	result = abook_grammatch(dbname, idxdb, field, vpat, pkv, count);
+	if (result <= 0) return (result);
+    }
+    if (!abook_useindex(dbname, idxdb, field, IDX_VALUE)) return (1);
+
+    /* probe the index for the range of the field's values */
+    flen = strlen(field);
+    patlen = flen + strlen(vpat) + 4;
+    if ((pat = malloc(patlen)) == NULL) return (-1);
+    snprintf(pat, patlen, "%s\"%s\"*", field, vpat);
+    result = sdb_match(idxdb, pat, SDB_ICASE, NULL, 1, &ikv, &icount);
+    free(pat);
+    if (result < 0) return (-1);
+    if (!icount) return (0);
+    if ((g = glob_init(vpat, GLOB_ICASE)) == NULL
+	|| (kv = *pkv = (sdb_keyvalue *)
+	    malloc(sizeof (sdb_keyvalue) * icount)) == NULL) {
+	if (g) glob_free(&g);
+	sdb_freematch(ikv, icount, 1);
+	return (-1);
+    }
+
+    /* turn "<field>"<value>"<alias>" into "<alias>"<field>" and <value>,
+     * rechecking the value in case it contains a '"'
+     */
+    for (i = 0; i < icount; ++i) {
+	value = ikv[i].key + flen + 1;
+	alias = strrchr(value, '"');
+	*alias++ = '\0';
+	if (GLOB_TEST(g, value) < 0) continue;
+	if (abook_addmatch(kv, alias, field, value) < 0) {
+	    result = -1;
+	    break;
+	}
+	++kv;
+    }
+    glob_free(&g);
+    sdb_freematch(ikv, icount, 1);
+    *count = kv - *pkv;
+    if (result < 0 || !*count) {
+	sdb_freematch(*pkv, *count, 1);
+	*pkv = NULL;
+	*count = 0;
+	return (result);
+    }
+    qsort(*pkv, *count, sizeof (sdb_keyvalue), abook_keycmp);
+
+    return (0);
+}
+
 /* check an access control list on an address book
  *  returns masked acl bits
  */
@@ -105,7 +651,9 @@ static long abook_rights(id, name, acl)
     if (len < 0) return (0);
     
     /* get the ACL */
-    if (!acl && sdb_get(abooks, name, SDB_ICASE, &acl) < 0) return (0);
+    if (!acl && sdb_dbget(abook_acldbh(name), name, SDB_ICASE, &acl) < 0) {
+	return (0);
+    }
     if (acl) mask = acl_myrights(auth_get_state(id), acl);
 
     /* check for administrator */
@@ -157,7 +705,7 @@ static long abook_parentacl(id, name, pacl)
     while (dot >= cname && exists < 0) {
 	while (dot >= cname && *dot != '.') --dot;
 	if (dot >= cname) *dot = '\0';
-	sdb_get(abooks, cname, SDB_ICASE, pacl);
+	sdb_dbget(abook_acldbh(cname), cname, SDB_ICASE, pacl);
 	abook_dbname(dbname, sizeof(dbname), cname);
 	exists = sdb_check(dbname);
 	if (exists == 0) mask = abook_rights(id, cname, *pacl);
@@ -176,6 +724,44 @@ static int abook_usesldap(id, name)
 }
 #endif
 
+/* create the shards of the global abooks list, and move the ACLs of an
+ * unsharded list left by an older server into them
+ *  returns: AB_SUCCESS, AB_FAIL
+ */
+int abook_init()
+{
+    char shard[32];
+    char *key, *value;
+    sdb_iter *iter;
+    int i, result = AB_SUCCESS;
+
+    for (i = 0; i < SDB_SHARDS; ++i) {
+	snprintf(shard, sizeof(shard), abooksharddb, i);
+	if (sdb_check(shard) < 0 && sdb_create(shard) < 0) result = AB_FAIL;
+    }
+    if (result < 0 || sdb_check(abooks) < 0) return (result);
+
+    /* the old list is only removed once every entry has moved */
+    if ((iter = sdb_iter_open(abooks, "*", SDB_ICASE, NULL)) == NULL) {
+	return (AB_FAIL);
+    }
+    while ((i = sdb_iter_next(iter, &key, &value)) > 0) {
+	if (value == NULL) continue;
+	abook_acldb(shard, sizeof(shard), key);
+	if (sdb_writelock(shard, key, SDB_ICASE) < 0) {
+	    result = AB_FAIL;
+	    continue;
+	}
+	if (sdb_set(shard, key, SDB_ICASE, value) < 0) result = AB_FAIL;
+	if (sdb_unlock(shard, key, SDB_ICASE) < 0) result = AB_FAIL;
+    }
+    sdb_iter_close(iter);
+    if (i < 0) result = AB_FAIL;
+    if (result == AB_SUCCESS) sdb_delete(abooks);
+
+    return (result);
+}
+
 /* fetch an address book entry
  *
  * Look up an entry in an address book, returning all of its contents.
@@ -306,12 +892,18 @@ int abook_searchstart(state, ldap_state, id, name, flist, fcount)
     abook_fielddata *flist;
     int fcount;
 {
-    char dbname[256];
-    char *pat, *key;
-    sdb_keyvalue *nkv;
-    int i, j, result, ncount, cmp, len, kcount;
+    char idxdb[256];
+    char *pat, *dbname = state->dbname;
+    int i, drive, result, patlen, ownerlen;
 
     *ldap_state = NULL;
+    state->kv = NULL;
+    state->kvcount = 0;
+    state->iter = NULL;
+    state->glist = NULL;
+    state->fcount = 0;
+    state->kvlast = NULL;
+    state->lastsize = 0;
 
     /* check permissions */
     if (!(abook_rights(id, name, NULL) & ACL_READ)) {
@@ -333,7 +925,6 @@ int abook_searchstart(state, ldap_state, id, name, flist, fcount)
 
 #ifdef HAVE_LDAP
     if (abook_usesldap(id, name)) {
-	state->kv = NULL;
 	/* Compiler warning here because
 	 * ldap_state is void **, not the private type used internally by the 
 	 * abook_ldap module 
@@ -345,112 +936,138 @@ int abook_searchstart(state, ldap_state, id, name, flist, fcount)
     }
 #endif
 
-    if (abook_dbname(dbname, sizeof(dbname), name) < 0) return (AB_FAIL);
+    if ((ownerlen = abook_dbname(dbname, sizeof(state->dbname), name)) < 0) {
+	return (AB_FAIL);
+    }
+    abook_idxname(idxdb, sizeof(idxdb), ownerlen, name);
 
-    /* start match */
+    /* : the "name" field drives the search if present, otherwise the
+     *   first field does; the other fields are checked entry by entry
+     */
+    for (drive = 0; drive < fcount; ++drive) {
+	if (!strcasecmp(flist[drive].field, "name")) break;
+    }
+    if (drive == fcount) drive = 0;
+    result = 1;
     if (!fcount) {
-	if (sdb_match(dbname, "*", SDB_ICASE, NULL, 1,
-		      &state->kv, &state->kvcount) < 0) {
-	    return (AB_FAIL);
+	pat = strdup("*");
+    } else if (!strcasecmp(flist[drive].field, "name")) {
+	patlen = strlen(flist[drive].data) + 3;
+	if ((pat = malloc(patlen)) != NULL) {
+	    snprintf(pat, patlen, "%s\"*", flist[drive].data);
 	}
     } else {
-	state->kv = nkv = NULL;
-	/* first look for the "name" field */
-	for (i = 0; i < fcount; ++i) {
-	    if (!strcasecmp(flist[i].field, "name")) {
-	        int patlen = strlen(flist[i].data) + 3;
-		pat = malloc(patlen);
-		if (!pat) return (AB_FAIL);
-		snprintf(pat, patlen, "%s\"*", flist[i].data);
-		result = sdb_match(dbname, pat, SDB_ICASE, NULL, 1,
-				   &state->kv, &state->kvcount);
-		free(pat);
-		if (result < 0) return (AB_FAIL);
-		if (!state->kvcount) return (AB_SUCCESS);
+	/* use the field's index if it has one */
+	result = abook_idxmatch(dbname, idxdb, flist[drive].field,
+				flist[drive].data, &state->kv,
+				&state->kvcount);
+	if (result < 0) return (AB_FAIL);
+	patlen = strlen(flist[drive].field) + 3;
+	if (result > 0 && (pat = malloc(patlen)) != NULL) {
+	    snprintf(pat, patlen, "*\"%s", flist[drive].field);
+	}
+    }
+    if (result > 0) {
+	if (!pat) return (AB_FAIL);
+	state->iter = sdb_iter_open(dbname, pat, SDB_ICASE,
+				    fcount && strcasecmp(flist[drive].field,
+							 "name")
+				    ? flist[drive].data : NULL);
+	free(pat);
+	if (!state->iter) return (AB_FAIL);
+    }
+
+    /* : compile the patterns for the remaining fields */
+    state->flist = flist;
+    state->fcount = fcount;
+    if (fcount > 1) {
+	state->glist = (glob **) calloc(fcount, sizeof (glob *));
+	for (i = 0; state->glist && i < fcount; ++i) {
+	    if (i != drive && strcasecmp(flist[i].field, "name")
+		&& (state->glist[i] = glob_init(flist[i].data,
+						GLOB_ICASE)) == NULL) {
 		break;
 	    }
 	}
-	/* then do other fields */
-	while (fcount) {
-	    if (strcasecmp(flist->field, "name")) {
-	        int patlen = strlen(flist->field) + 3;
-		pat = malloc(patlen);
-		if (!pat) {
-		    if (state->kv) sdb_freematch(state->kv, state->kvcount, 1);
-		    state->kv = NULL;
-		    return (AB_FAIL);
-		}
-		snprintf(pat, patlen, "*\"%s", flist->field);
-		if (!state->kv) {
-		    result = sdb_match(dbname, pat, SDB_ICASE, flist->data, 1,
-				       &state->kv, &state->kvcount);
-		} else {
-		    result = sdb_match(dbname, pat, SDB_ICASE, flist->data, 0,
-				       &nkv, &ncount);
-		}
-		free(pat);
-		if (result < 0) {
-		    if (state->kv) sdb_freematch(state->kv, state->kvcount, 1);
-		    state->kv = NULL;
-		    return (AB_FAIL);
-		}
-		if (!state->kvcount) break;
-		if (nkv) {
-		    j = 0;
-		    kcount = 0;
-		    for (i = 0; i < state->kvcount; ++i) {
-			if (j == ncount) {
-			    *state->kv[i].key = '\0';
-			} else if (*(key = state->kv[i].key)) {
-			    len = strchr(key, '"') - key + 1;
-			    cmp = strncasecmp(key, nkv[j].key, len);
-			    while (cmp > 0 && ++j < ncount) {
-				cmp = strncasecmp(key, nkv[j].key, len);
-			    }
-			    if (cmp) *state->kv[i].key = '\0';
-			    else ++kcount;
-			}
-		    }
-		    sdb_freematch(nkv, ncount, 0);
-		    if (!kcount) break;
-		}
-	    }
-	    --fcount;
-	    ++flist;
+	if (!state->glist || i < fcount) {
+	    abook_searchdone(state, NULL);
+	    return (AB_FAIL);
 	}
     }
     state->kvpos = state->kv;
-    state->kvlast = NULL;
 
     return (AB_SUCCESS);
 }    
 
+/* check the non-driving search fields of an entry
+ *  returns 1 if they all match, 0 otherwise
+ */
+static int abook_checkentry(state, alias)
+    abook_state *state;
+    char *alias;
+{
+    char *key, *value;
+    int i, keylen, result;
+
+    if (!state->glist) return (1);
+    for (result = 1, i = 0; result && i < state->fcount; ++i) {
+	if (!state->glist[i]) continue;
+	keylen = strlen(alias) + strlen(state->flist[i].field) + 2;
+	if ((key = malloc(keylen)) == NULL) return (0);
+	snprintf(key, keylen, "%s\"%s", alias, state->flist[i].field);
+	if (sdb_get(state->dbname, key, SDB_ICASE, &value) < 0
+	    || value == NULL || GLOB_TEST(state->glist[i], value) < 0) {
+	    result = 0;
+	}
+	free(key);
+    }
+
+    return (result);
+}
+
 /* get next search element, or NULL
  */
 char *abook_search(state, ldap_state)
     abook_state *state;
     void *ldap_state;
 {
+    char *key, *value, *end;
+    int len;
+
 #ifdef HAVE_LDAP
     if (ldap_state) {
 	return (abook_ldap_search(ldap_state));
-
-    } else 
+    }
 #endif
-	if (state->kvcount) {
-	while (state->kvpos - state->kv < state->kvcount) {
-	    if (*state->kvpos->key) {
-		*strchr(state->kvpos->key, '"') = '\0';
-		if (!state->kvlast
-		    || strcasecmp(state->kvpos->key, state->kvlast)) {
-		    return (state->kvlast = state->kvpos++->key);
-		}
+    for (;;) {
+	/* : next key from the cursor or the index match */
+	if (state->iter) {
+	    if (sdb_iter_next(state->iter, &key, &value) <= 0) return (NULL);
+	} else if (state->kvpos && state->kvpos < state->kv + state->kvcount) {
+	    key = state->kvpos++->key;
+	} else {
+	    return (NULL);
+	}
+	if ((end = strchr(key, '"')) == NULL) continue;
+
+	/* : skip the other fields of the last entry seen */
+	len = end - key;
+	if (state->kvlast && strlen(state->kvlast) == len
+	    && !strncasecmp(state->kvlast, key, len)) {
+	    continue;
+	}
+	if (len + 1 > state->lastsize) {
+	    if (state->kvlast) free(state->kvlast);
+	    state->lastsize = len + 64;
+	    if ((state->kvlast = malloc(state->lastsize)) == NULL) {
+		state->lastsize = 0;
+		return (NULL);
 	    }
-	    ++state->kvpos;
 	}
+	memcpy(state->kvlast, key, len);
+	state->kvlast[len] = '\0';
+	if (abook_checkentry(state, state->kvlast)) return (state->kvlast);
     }
-
-    return (NULL);
 }
 
 /* finish search: free storage used
@@ -459,12 +1076,25 @@ void abook_searchdone(state, ldap_state)
     abook_state *state;
     void *ldap_state;
 {
+    int i;
+
+    if (state->iter) sdb_iter_close(state->iter);
     if (state->kv) sdb_freematch(state->kv, state->kvcount, 1);
+    if (state->glist) {
+	for (i = 0; i < state->fcount; ++i) {
+	    if (state->glist[i]) glob_free(&state->glist[i]);
+	}
+	free(state->glist);
+    }
+    if (state->kvlast) free(state->kvlast);
 #ifdef HAVE_LDAP
     if (ldap_state)
 	abook_ldap_searchdone(ldap_state);
 #endif
+    state->iter = NULL;
     state->kv = NULL;
+    state->glist = NULL;
+    state->kvlast = NULL;
 }
 
 
@@ -475,7 +1105,7 @@ int abook_create(id, name)
     auth_id *id;
     char *name;
 {
-    char dbname[256], acldb[256];
+    char dbname[256], acldb[256], shard[32];
     char *acl = NULL;
     int ownerlen, result = 0;
 
@@ -518,9 +1148,10 @@ skip_acl_check:
 	return (AB_FAIL);
     }
     /* add addressbook to global abooks list, if appropriate */
-    if (acl && (result = sdb_writelock(abooks, name, SDB_ICASE)) >= 0) {
-	result = sdb_set(abooks, name, SDB_ICASE, acl);
-	if (sdb_unlock(abooks, name, SDB_ICASE) < 0) result = AB_FAIL;
+    abook_acldb(shard, sizeof(shard), name);
+    if (acl && (result = sdb_writelock(shard, name, SDB_ICASE)) >= 0) {
+	result = sdb_set(shard, name, SDB_ICASE, acl);
+	if (sdb_unlock(shard, name, SDB_ICASE) < 0) result = AB_FAIL;
     }
 
     /* add addressbook name to personal abooks list */
@@ -586,10 +1217,12 @@ int abook_delete(id, name)
 	snprintf(uname, sizeof(uname), "%.*s", ownerlen, name);
     }
 
-    /* remove address book database */
+    /* remove address book database and its indexes */
     result = sdb_delete(dbname);
     if (result == AB_SUCCESS) {
 	if (delta) option_doquota(uname, -delta);
+	abook_idxname(dbname, sizeof(dbname), ownerlen, name);
+	if (sdb_check(dbname) == 0) sdb_delete(dbname);
 	    
 	/* remove database name from abooks list */
 	snprintf(dbname, sizeof(dbname), abooksudb, ownerlen, name);
@@ -602,10 +1235,11 @@ int abook_delete(id, name)
 	}
 
 	/* if set, remove name from global abooks list */
-	if (sdb_get(abooks, name, SDB_ICASE, &value) >= 0 && value != NULL) {
-	    if (sdb_writelock(abooks, name, SDB_ICASE) >= 0) {
-		sdb_remove(abooks, name, SDB_ICASE);
-		sdb_unlock(abooks, name, SDB_ICASE);
+	abook_acldb(dbname, sizeof(dbname), name);
+	if (sdb_get(dbname, name, SDB_ICASE, &value) >= 0 && value != NULL) {
+	    if (sdb_writelock(dbname, name, SDB_ICASE) >= 0) {
+		sdb_remove(dbname, name, SDB_ICASE);
+		sdb_unlock(dbname, name, SDB_ICASE);
 	    }
 	}
     }
@@ -673,6 +1307,16 @@ int abook_rename(id, name, newname)
     }
     if (default_abook) sdb_create(dbsrc);
 
+    /* move the field indexes.  If that fails, they're rebuilt when next
+     * searched
+     */
+    abook_idxname(dbsrc, sizeof(dbsrc), osrclen, name);
+    if (sdb_check(dbsrc) == 0) {
+	abook_idxname(dbdst, sizeof(dbdst), odstlen, newname);
+	sdb_copy(dbsrc, dbdst, SDB_ICASE);
+	sdb_delete(dbsrc);
+    }
+
     /* update user abooks file */
     if (!default_abook) {
 	snprintf(dbsrc, sizeof(dbsrc), abooksudb, osrclen, name);
@@ -689,9 +1333,13 @@ int abook_rename(id, name, newname)
 	}
     }
 
-    /* update global abooks file (ACL) */
-    if (sdb_writelock(abooks, newname, SDB_ICASE) >= 0) {
-	if (sdb_get(abooks, name, SDB_ICASE, &value) >= 0) {
+    /* update global abooks file (ACL).  The names may be in different
+     * shards
+     */
+    abook_acldb(dbsrc, sizeof(dbsrc), name);
+    abook_acldb(dbdst, sizeof(dbdst), newname);
+    if (sdb_writelock(dbdst, newname, SDB_ICASE) >= 0) {
+	if (sdb_get(dbsrc, name, SDB_ICASE, &value) >= 0) {
 	    if (value == NULL && new_name) {
 		tmpacl = malloc(2);
 		if (tmpacl) {
@@ -704,16 +1352,47 @@ int abook_rename(id, name, newname)
 		value = tmpacl;
 	    }
 	    if (value) {
-		sdb_set(abooks, newname, SDB_ICASE, value);
+		sdb_set(dbdst, newname, SDB_ICASE, value);
 		if (!default_abook
-		    && sdb_writelock(abooks, name, SDB_ICASE) >= 0) {
-		    sdb_remove(abooks, name, SDB_ICASE);
-		    sdb_unlock(abooks, name, SDB_ICASE);
+		    && sdb_writelock(dbsrc, name, SDB_ICASE) >= 0) {
+		    sdb_remove(dbsrc, name, SDB_ICASE);
+		    sdb_unlock(dbsrc, name, SDB_ICASE);
 		}
 	    }
 	    if (tmpacl) free(tmpacl);
 	}
-	sdb_unlock(abooks, newname, SDB_ICASE);
+	sdb_unlock(dbdst, newname, SDB_ICASE);
+    }
+
+    return (AB_SUCCESS);
+}
+
+/* make sure an address book being stored to exists, creating a user's
+ * primary address book the first time it's used
+ *  returns: AB_SUCCESS, AB_FAIL, AB_NOEXIST
+ */
+static int abook_mustexist(char *dbname, char *name, int ownerlen)
+{
+    char acldb[256];
+    int result;
+
+    if (sdb_check(dbname) == 0) return (AB_SUCCESS);
+    if (ownerlen != strlen(name)) return (AB_NOEXIST);
+
+    /* create primary address book */
+    if (sdb_create(dbname) < 0) return (AB_FAIL);
+
+    /* add addressbook name to personal abooks list */
+    snprintf(acldb, sizeof(acldb), abooksudb, ownerlen, name);
+    if (sdb_check(acldb) < 0 && sdb_create(acldb) < 0) {
+	result = AB_FAIL;
+    } else if (!(result = sdb_writelock(acldb, name, SDB_ICASE))) {
+	result = sdb_set(acldb, name, SDB_ICASE, "");
+	if (sdb_unlock(acldb, name, SDB_ICASE) < 0) result = AB_FAIL;
+    }
+    if (result < 0) {
+	sdb_delete(dbname);
+	return (AB_FAIL);
     }
 
     return (AB_SUCCESS);
@@ -728,10 +1407,13 @@ int abook_store(id, name, alias, flist, fcount)
     abook_fielddata *flist;
     int fcount;
 {
-    char dbname[256], acldb[256], uname[256];
+    char dbname[256], uname[256], idxdb[256];
     char *key, *scan, *value;
-    int i, result, ownerlen, maxfieldlen, len, keylen;
+    int i, result, ownerlen, maxfieldlen, len, keylen, indexing, oldcount;
+    int written;
     long delta;
+    sdb_keyvalue *old;
+    sdb_batch *batch, *ibatch;
 
     if ((ownerlen = abook_dbname(dbname, sizeof(dbname), name)) < 0) return (AB_FAIL);
     snprintf(uname, sizeof(uname), "%.*s", ownerlen, name);
@@ -747,25 +1429,8 @@ int abook_store(id, name, alias, flist, fcount)
     }
 
     /* make sure database exists */
-    if (sdb_check(dbname) < 0) {
-	if (ownerlen == strlen(name)) {
-	    /* create primary address book */
-	    if (sdb_create(dbname) < 0) return (AB_FAIL);
-	} else {
-	    return (AB_NOEXIST);
-	}
-	/* add addressbook name to personal abooks list */
-	snprintf(acldb, sizeof(acldb), abooksudb, ownerlen, name);
-	if (sdb_check(acldb) < 0 && sdb_create(acldb) < 0) {
-	    result = AB_FAIL;
-	} else if (!(result = sdb_writelock(acldb, name, SDB_ICASE))) {
-	    result = sdb_set(acldb, name, SDB_ICASE, "");
-	    if (sdb_unlock(acldb, name, SDB_ICASE) < 0) result = AB_FAIL;
-	}
-	if (result < 0) {
-	    sdb_delete(dbname);
-	    return (AB_FAIL);
-	}
+    if ((result = abook_mustexist(dbname, name, ownerlen)) != AB_SUCCESS) {
+	return (result);
     }
 
     /* check permissions */
@@ -773,58 +1438,109 @@ int abook_store(id, name, alias, flist, fcount)
 	return (AB_PERM);
     }
 
-    /* lock database */
-    if (sdb_writelock(dbname, NULL, SDB_ICASE) < 0) return (AB_FAIL);
+    /* lock the entry: stores to other entries go ahead meanwhile */
+    if (sdb_writelock(dbname, alias, SDB_ICASE) < 0) return (AB_FAIL);
 
-    /* quota & max field length calculation */
-    delta = 0;
+    /* read the entry's fields once, for the quota and the indexes */
     maxfieldlen = 0;
     for (i = 0; i < fcount; ++i) {
 	if ((len = strlen(flist[i].field)) > maxfieldlen) {
 	    maxfieldlen = len;
 	}
-	if (*flist[i].data) {
-	    delta += len + strlen(flist[i].data);
-	}
     }
-    keylen = maxfieldlen + strlen(alias) + 2;
+    keylen = maxfieldlen + strlen(alias) + 3;
     if ((key = malloc(keylen)) == NULL) {
-	sdb_unlock(dbname, NULL, SDB_ICASE);
+	sdb_unlock(dbname, alias, SDB_ICASE);
 	return (AB_FAIL);
     }
+    snprintf(key, keylen, "%s\"*", alias);
+    if (sdb_match(dbname, key, SDB_ICASE, NULL, 1, &old, &oldcount) < 0) {
+	free(key);
+	sdb_unlock(dbname, alias, SDB_ICASE);
+	return (AB_FAIL);
+    }
+    if (oldcount > 1) {
+	qsort(old, oldcount, sizeof (sdb_keyvalue), abook_keycmp);
+    }
+
+    /* quota calculation */
+    delta = 0;
     for (i = 0; i < fcount; ++i) {
+	if (*flist[i].data) {
+	    delta += strlen(flist[i].field) + strlen(flist[i].data);
+	}
 	snprintf(key, keylen, "%s\"%s", alias, flist[i].field);
-	if (sdb_get(dbname, key, SDB_ICASE, &value) == 0 && value != NULL) {
+	if ((value = abook_oldvalue(old, oldcount, key)) != NULL) {
 	    delta -= strlen(value) + strlen(flist[i].field);
 	}
     }
     if ((result = option_doquota(uname, delta)) < 0) {
-        free(key);
-	sdb_unlock(dbname, NULL, SDB_ICASE);
+	free(key);
+	sdb_freematch(old, oldcount, 1);
+	sdb_unlock(dbname, alias, SDB_ICASE);
 	return (result);
     }
     
-    /* make changes to database */
+    /* lock the field indexes, if there are any */
+    abook_idxname(idxdb, sizeof(idxdb), ownerlen, name);
+    indexing = sdb_check(idxdb) == 0;
+    if (indexing && sdb_writelock(idxdb, NULL, SDB_ICASE) < 0) {
+	free(key);
+	sdb_freematch(old, oldcount, 1);
+	sdb_unlock(dbname, alias, SDB_ICASE);
+	option_doquota(uname, -delta);
+	return (AB_FAIL);
+    }
+
+    /* gather the changes to the entry and to its index entries */
+    batch = sdb_batch_open();
+    ibatch = indexing ? sdb_batch_open() : NULL;
+    result = 0;
     snprintf(key, keylen, "%s\"", alias);
-    if (sdb_get(dbname, key, SDB_ICASE, &value) < 0 || value == NULL) {
-	sdb_set(dbname, key, SDB_ICASE, "");
+    if (abook_oldvalue(old, oldcount, key) == NULL) {
+	sdb_batch_set(batch, key, "");
     }
-    for (i = 0; i < fcount; ++i) {
+    for (i = 0; i < fcount && result == 0; ++i) {
 	snprintf(key, keylen, "%s\"%s", alias, flist[i].field);
+	if (indexing) {
+	    if ((value = abook_oldvalue(old, oldcount, key)) != NULL
+		&& abook_reindex(idxdb, ibatch, flist[i].field, value,
+				 alias, 0) < 0) {
+		result = -1;
+	    }
+	    if (*flist[i].data
+		&& abook_reindex(idxdb, ibatch, flist[i].field,
+				 flist[i].data, alias, 1) < 0) {
+		result = -1;
+	    }
+	}
 	if (*flist[i].data) {
-	    sdb_set(dbname, key, SDB_ICASE, flist[i].data);
+	    sdb_batch_set(batch, key, flist[i].data);
 	} else {
-	    sdb_remove(dbname, key, SDB_ICASE);
+	    sdb_batch_remove(batch, key);
 	}
     }
     free(key);
+    sdb_freematch(old, oldcount, 1);
+
+    /* write the entry, then its index entries */
+    if (result == 0) result = sdb_batch_apply(dbname, batch, SDB_ICASE);
+    sdb_batch_close(batch);
+    if (sdb_unlock(dbname, alias, SDB_ICASE) < 0) result = -1;
+    written = result == 0;
+    if (indexing) {
+	if (written) {
+	    result = abook_idxapply(idxdb, ibatch);
+	} else {
+	    sdb_unlock(idxdb, NULL, SDB_ICASE);
+	}
+	sdb_batch_close(ibatch);
+    }
 
     /* if changes failed, back out quota change */
-    if ((result = sdb_unlock(dbname, NULL, SDB_ICASE)) < 0) {
-	option_doquota(uname, -delta);
-    }
+    if (!written) option_doquota(uname, -delta);
 
-    return (result);
+    return (result < 0 ? AB_FAIL : AB_SUCCESS);
 }
 
 /* delete an entry
@@ -834,11 +1550,12 @@ int abook_deleteent(id, name, alias)
     auth_id *id;
     char *name, *alias;
 {
-    char *key, *scan;
+    char *key, *scan, *field;
     sdb_keyvalue *kv;
-    int i, result, kvcount, ownerlen, keylen;
+    sdb_batch *batch, *ibatch;
+    int i, result, kvcount, ownerlen, keylen, indexing, written;
     long delta;
-    char dbname[256];
+    char dbname[256], idxdb[256];
 
     /* check permissions */
     if (!(abook_rights(id, name, NULL) & ACL_DELETE)) {
@@ -851,21 +1568,21 @@ int abook_deleteent(id, name, alias)
     for (scan = alias; *scan && *scan != '*' && *scan != '%'; ++scan);
     if (*scan) return (AB_FAIL);
 
-    /* lock database */
-    if (sdb_writelock(dbname, NULL, SDB_ICASE) < 0) return (AB_FAIL);
+    /* lock the entry */
+    if (sdb_writelock(dbname, alias, SDB_ICASE) < 0) return (AB_FAIL);
 
     /* find entries for key */
     keylen = strlen(alias) + 3;
     key = malloc(keylen);
     if (!key) {
-	sdb_unlock(dbname, NULL, SDB_ICASE);
+	sdb_unlock(dbname, alias, SDB_ICASE);
 	return (AB_FAIL);
     }
     snprintf(key, keylen, "%s\"*", alias);
     result = sdb_match(dbname, key, SDB_ICASE, NULL, 1, &kv, &kvcount);
     free(key);
     if (result < 0 || !kvcount) {
-	sdb_unlock(dbname, NULL, SDB_ICASE);
+	sdb_unlock(dbname, alias, SDB_ICASE);
 	return (result < 0 ? AB_FAIL : AB_NOEXIST);
     }
 
@@ -875,25 +1592,407 @@ int abook_deleteent(id, name, alias)
 	delta -= strlen(kv[i].key) + strlen(kv[i].value);
     }
     if ((result = option_doquota(auth_username(id), delta)) < 0) {
-	sdb_unlock(dbname, NULL, SDB_ICASE);
+	sdb_unlock(dbname, alias, SDB_ICASE);
 	return (result);
     }
 
-    /* nuke the entries */
+    /* gather the removals of the entries and their index entries */
+    abook_idxname(idxdb, sizeof(idxdb), ownerlen, name);
+    indexing = sdb_check(idxdb) == 0;
+    if (indexing && sdb_writelock(idxdb, NULL, SDB_ICASE) < 0) {
+	sdb_freematch(kv, kvcount, 1);
+	sdb_unlock(dbname, alias, SDB_ICASE);
+	option_doquota(auth_username(id), -delta);
+	return (AB_FAIL);
+    }
+    batch = sdb_batch_open();
+    ibatch = indexing ? sdb_batch_open() : NULL;
+    result = 0;
     for (i = 0; i < kvcount; ++i) {
-	sdb_remove(dbname, kv[i].key, SDB_ICASE);
+	field = strchr(kv[i].key, '"') + 1;
+	if (indexing && *field
+	    && abook_reindex(idxdb, ibatch, field, kv[i].value, alias, 0) < 0) {
+	    result = -1;
+	}
+	sdb_batch_remove(batch, kv[i].key);
+    }
+    sdb_freematch(kv, kvcount, 1);
+
+    /* nuke the entries, then their index entries */
+    if (result == 0) result = sdb_batch_apply(dbname, batch, SDB_ICASE);
+    sdb_batch_close(batch);
+    if (sdb_unlock(dbname, alias, SDB_ICASE) < 0) result = -1;
+    written = result == 0;
+    if (indexing) {
+	if (written) {
+	    result = abook_idxapply(idxdb, ibatch);
+	} else {
+	    sdb_unlock(idxdb, NULL, SDB_ICASE);
+	}
+	sdb_batch_close(ibatch);
     }
-    sdb_freematch(kv, kvcount, 0);
+    if (!written) option_doquota(auth_username(id), -delta);
 
-    /* unlock */
-    if (sdb_unlock(dbname, NULL, SDB_ICASE) < 0) {
-	option_doquota(auth_username(id), -delta);
+    return (result < 0 ? AB_FAIL : AB_SUCCESS);
+}
+
+/* the keys and values of the fields read by abook_import, with the place
+ * of each in the stream, and the quota charged for them while loading
+ */
+typedef struct abook_pair {
+    char *key;
+    char *value;
+    long seq;
+} abook_pair;
+typedef struct abook_pairlist {
+    abook_pair *pair;
+    long count, size, pos;
+    char *dbname, *uname;	/* address book and owner being charged */
+    long delta;			/* quota charged, once charged is set */
+    int charged, quota;		/* option_doquota was called, its result */
+} abook_pairlist;
+
+/* compare two imported fields by key, then by place in the stream
+ */
+static int abook_paircmp(const void *p1, const void *p2)
+{
+    int cmp = strcasecmp(((abook_pair *) p1)->key, ((abook_pair *) p2)->key);
+
+    if (cmp) return (cmp);
+    return (((abook_pair *) p1)->seq < ((abook_pair *) p2)->seq ? -1 : 1);
+}
+
+/* add the key "<alias>"<field>" with a copy of value to a list of
+ * imported fields
+ *  returns -1 on failure, 0 on success
+ */
+static int abook_addpair(abook_pairlist *pl, char *alias, char *field,
+			 char *value)
+{
+    abook_pair *pair;
+    int keylen;
+
+    if (pl->count == pl->size) {
+	pl->size = pl->size ? pl->size * 2 : 64;
+	if (pl->pair == NULL) {
+	    pair = (abook_pair *) malloc(pl->size * sizeof (abook_pair));
+	} else {
+	    pair = (abook_pair *) realloc((char *) pl->pair,
+					  pl->size * sizeof (abook_pair));
+	}
+	if (pair == NULL) return (-1);
+	pl->pair = pair;
+    }
+    pair = pl->pair + pl->count;
+    keylen = strlen(alias) + strlen(field) + 2;
+    if ((pair->key = malloc(keylen)) == NULL) return (-1);
+    if ((pair->value = strdup(value)) == NULL) {
+	free(pair->key);
+	return (-1);
+    }
+    snprintf(pair->key, keylen, "%s\"%s", alias, field);
+    pair->seq = pl->count++;
+
+    return (0);
+}
+
+/* pass the imported fields to sdb_bulkload one at a time, working out the
+ * quota change as for abook_store.  sdb_bulkload holds the address book's
+ * lock while it reads the fields, so the fields they replace can't change
+ * before they're loaded.  The quota is charged at the end of the fields,
+ * and the load fails if it can't be.
+ */
+static int abook_nextpair(void *rock, char **key, char **value)
+{
+    abook_pairlist *pl = (abook_pairlist *) rock;
+    abook_pair *pair;
+    char *field, *old;
+
+    if (pl->pos == pl->count) {
+	pl->quota = option_doquota(pl->uname, pl->delta);
+	if (pl->quota < 0) return (-1);
+	pl->charged = 1;
+	return (0);
+    }
+    pair = pl->pair + pl->pos++;
+    field = strchr(pair->key, '"') + 1;
+    if (*field) {
+	pl->delta += strlen(field) + strlen(pair->value);
+	if (sdb_get(pl->dbname, pair->key, SDB_ICASE, &old) == 0
+	    && old != NULL) {
+	    pl->delta -= strlen(field) + strlen(old);
+	}
+    }
+    *key = pair->key;
+    *value = pair->value;
+
+    return (1);
+}
+
+/* import a stream of entries into an address book in one write, charging
+ * the owner's quota once for all of them.  next(rock, &alias, &field,
+ * &data) returns 1 and the next field, 0 at the end or -1 on failure.
+ * Empty data is skipped, and the last data for a field wins.  The field
+ * indexes are dropped, to be rebuilt when next searched.
+ *  returns: AB_SUCCESS, AB_FAIL, AB_PERM, AB_QUOTA, AB_NOEXIST
+ */
+int abook_import(id, name, next, rock)
+    auth_id *id;
+    char *name;
+    int (*next)();
+    void *rock;
+{
+    char dbname[256], uname[256], idxdb[256];
+    char *alias, *field, *data, *scan, *last;
+    abook_pairlist pl;
+    long i, n;
+    int result, ownerlen;
+
+    if ((ownerlen = abook_dbname(dbname, sizeof(dbname), name)) < 0) return (AB_FAIL);
+    snprintf(uname, sizeof(uname), "%.*s", ownerlen, name);
+    if ((result = abook_mustexist(dbname, name, ownerlen)) != AB_SUCCESS) {
+	return (result);
+    }
+    if (!(abook_rights(id, name, NULL) & ACL_WRITE)) {
+	return (AB_PERM);
+    }
+
+    /* read the fields, with a marker key for each new alias */
+    memset((char *) &pl, 0, sizeof (pl));
+    last = NULL;
+    while ((result = (*next)(rock, &alias, &field, &data)) > 0) {
+	for (scan = alias; *scan && *scan != '*'
+	     && *scan != '%' && *scan != '"'; ++scan);
+	if (*scan || scan == alias) break;
+	for (scan = field;
+	     *scan && *scan != '*' && *scan != '?' && *scan != '%'; ++scan);
+	if (*scan || scan == field) break;
+	if (!*data) continue;
+	if (last == NULL || strcasecmp(last, alias)) {
+	    if (last) free(last);
+	    if ((last = strdup(alias)) == NULL
+		|| abook_addpair(&pl, alias, "", "") < 0) {
+		break;
+	    }
+	}
+	if (abook_addpair(&pl, alias, field, data) < 0) break;
+    }
+    if (last) free(last);
+    if (result != 0) {
+	result = AB_FAIL;
+	goto done;
+    }
+
+    /* sort the fields, keeping the last data for each */
+    if (pl.count) {
+	qsort(pl.pair, pl.count, sizeof (abook_pair), abook_paircmp);
+    }
+    for (i = n = 0; i < pl.count; ++i) {
+	if (i + 1 < pl.count
+	    && !strcasecmp(pl.pair[i].key, pl.pair[i + 1].key)) {
+	    free(pl.pair[i].key);
+	    free(pl.pair[i].value);
+	} else {
+	    pl.pair[n++] = pl.pair[i];
+	}
+    }
+    pl.count = n;
+
+    /* load the fields, charging the quota under the load's lock, and let
+     * the indexes be rebuilt from them
+     */
+    pl.dbname = dbname;
+    pl.uname = uname;
+    if (sdb_bulkload(dbname, SDB_ICASE, abook_nextpair, (void *) &pl) < 0) {
+	if (pl.charged) option_doquota(uname, -pl.delta);
+	result = pl.quota < 0 ? pl.quota : AB_FAIL;
+	goto done;
+    }
+    abook_idxname(idxdb, sizeof(idxdb), ownerlen, name);
+    if (sdb_check(idxdb) == 0) sdb_delete(idxdb);
+    result = AB_SUCCESS;
+
+  done:
+    for (i = 0; i < pl.count; ++i) {
+	free(pl.pair[i].key);
+	free(pl.pair[i].value);
+    }
+    if (pl.pair) free((char *) pl.pair);
+
+    return (result);
+}
+
+/* base64 alphabet, for LDIF values that can't be written plainly */
+static char abook_base64[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/* write an LDIF line for an attribute, in base64 if the value has
+ * characters LDIF can't carry plainly
+ *  returns -1 on failure, 0 on success
+ */
+static int abook_ldifline(FILE *out, char *attr, char *value)
+{
+    unsigned char *in = (unsigned char *) value;
+    int i, len, safe;
+    unsigned long bits;
+
+    len = strlen(value);
+    safe = *value != ' ' && *value != ':' && *value != '<'
+	&& (len == 0 || value[len - 1] != ' ');
+    for (i = 0; safe && i < len; ++i) {
+	if (in[i] > 126 || in[i] == '\r' || in[i] == '\n') safe = 0;
+    }
+    if (safe) return (fprintf(out, "%s: %s\n", attr, value) < 0 ? -1 : 0);
+
+    fprintf(out, "%s:: ", attr);
+    for (i = 0; i < len; i += 3) {
+	bits = (unsigned long) in[i] << 16;
+	if (i + 1 < len) bits |= (unsigned long) in[i + 1] << 8;
+	if (i + 2 < len) bits |= in[i + 2];
+	putc(abook_base64[bits >> 18], out);
+	putc(abook_base64[(bits >> 12) & 0x3f], out);
+	putc(i + 1 < len ? abook_base64[(bits >> 6) & 0x3f] : '=', out);
+	putc(i + 2 < len ? abook_base64[bits & 0x3f] : '=', out);
+    }
+
+    return (putc('\n', out) == EOF ? -1 : 0);
+}
+
+/* write a key of an address book to its LDIF export, starting a new
+ * record with the DN "cn=<alias>" at each new alias.  rock points to the
+ * last alias written.
+ *  returns -1 on failure, 0 on success
+ */
+static int abook_ldifentry(void *rock, FILE *out, char *key, char *value)
+{
+    char **last = (char **) rock;
+    char *field, *dn, *dst;
+    int alen, result;
+
+    if (value == NULL || (field = strchr(key, '"')) == NULL) return (0);
+    alen = field++ - key;
+    if (*last == NULL || strncasecmp(*last, key, alen) || (*last)[alen]) {
+	if (*last == NULL) {
+	    fputs("version: 1\n", out);
+	} else {
+	    free(*last);
+	}
+	if ((*last = malloc(alen + 1)) == NULL) return (-1);
+	memcpy(*last, key, alen);
+	(*last)[alen] = '\0';
+
+	/* escape the characters special to DNs */
+	if ((dn = malloc(2 * alen + 4)) == NULL) return (-1);
+	strcpy(dn, "cn=");
+	for (dst = dn + 3; alen--; ++key) {
+	    if (strchr(",+\"\\<>;=", *key) != NULL
+		|| (dst == dn + 3 && (*key == ' ' || *key == '#'))
+		|| (alen == 0 && *key == ' ')) {
+		*dst++ = '\\';
+	    }
+	    *dst++ = *key;
+	}
+	*dst = '\0';
+	putc('\n', out);
+	result = abook_ldifline(out, "dn", dn);
+	free(dn);
+	if (result < 0) return (-1);
+    }
+    if (!*field) return (0);
+
+    return (abook_ldifline(out, field, value));
+}
+
+/* export an address book as LDIF, with each entry a record whose DN is
+ * "cn=<alias>" and whose attributes are its fields.  The export is kept
+ * by sdb_export() until the address book changes.
+ *  returns: AB_SUCCESS, AB_FAIL, AB_PERM, AB_NOEXIST; on success *fd is
+ *  open on a file holding the export at *offset for *len bytes
+ */
+int abook_export(id, name, fd, offset, len)
+    auth_id *id;
+    char *name;
+    int *fd;
+    long *offset, *len;
+{
+    char dbname[256];
+    char *last = NULL;
+
+    if (abook_dbname(dbname, sizeof(dbname), name) < 0) return (AB_FAIL);
+    if (!(abook_rights(id, name, NULL) & ACL_READ)) return (AB_PERM);
+    if (sdb_check(dbname) < 0) return (AB_NOEXIST);
+
+    *fd = sdb_export(dbname, SDB_ICASE, abook_ldifentry, (void *) &last,
+		     offset, len);
+    if (last) free(last);
+    if (*fd < 0) return (AB_FAIL);
+    if (*len > INT_MAX) {
+	close(*fd);
 	return (AB_FAIL);
     }
-    
+
     return (AB_SUCCESS);
 }
 
+/* add the bytes the entries of an address book count against its owner's
+ * quota to *usage: the length of each field name and value, as charged by
+ * abook_store
+ *  returns -1 on failure, 0 on success
+ */
+static int abook_addusage(const char *name, long *usage)
+{
+    char dbname[256];
+    char *key, *value, *field;
+    sdb_iter *iter;
+    int result;
+
+    if (abook_dbname(dbname, sizeof(dbname), name) < 0
+	|| sdb_check(dbname) < 0) {
+	return (0);
+    }
+    iter = sdb_iter_open(dbname, "*", SDB_ICASE, NULL);
+    if (iter == NULL) return (-1);
+    while ((result = sdb_iter_next(iter, &key, &value)) > 0) {
+	if (value) *usage += strlen(value);
+	if ((field = strchr(key, '"'))) *usage += strlen(field + 1);
+    }
+    sdb_iter_close(iter);
+
+    return (result);
+}
+
+/* add up the bytes a user's address books count against the user's
+ * quota, for recomputing a quota usage which has drifted
+ *  returns -1 on failure, the usage on success
+ */
+long abook_usage(user)
+    char *user;
+{
+    char dbname[256];
+    char *name, *value;
+    sdb_iter *iter;
+    long usage;
+    int result;
+
+    /* the default address book, then the others the user owns */
+    usage = 0;
+    if (abook_addusage(user, &usage) < 0) return (-1);
+    snprintf(dbname, sizeof(dbname), abooksdb, user);
+    if (sdb_check(dbname) < 0) return (usage);
+    if ((iter = sdb_iter_open(dbname, "*", SDB_ICASE, NULL)) == NULL) {
+	return (-1);
+    }
+    while ((result = sdb_iter_next(iter, &name, &value)) > 0) {
+	if (strcasecmp(name, user)
+	    && (result = abook_addusage(name, &usage)) < 0) {
+	    break;
+	}
+    }
+    sdb_iter_close(iter);
+
+    return (result < 0 ? -1 : usage);
+}
+
 /* set an access control list
  *  rights is NULL to delete an entry: returns 1 if entry doesn't exist
  *  AB_FAIL, AB_NOEXIST, AB_PERM
@@ -902,8 +2001,8 @@ int abook_setacl(id, name, ident, rights)
     auth_id *id;
     char *name, *ident, *rights;
 {
-    char dbname[256];
-    char *value, *acl, tmpc;
+    char dbname[256], acldb[32];
+    char *value, *acl = NULL, tmpc;
     int ownerlen, result = AB_FAIL;
 
     /* check permissions */
@@ -916,12 +2015,13 @@ int abook_setacl(id, name, ident, rights)
     if (sdb_check(dbname) < 0) return (AB_NOEXIST);
 
     /* lock acl db */
-    if (sdb_writelock(abooks, name, SDB_ICASE) < 0) {
+    abook_acldb(acldb, sizeof(acldb), name);
+    if (sdb_writelock(acldb, name, SDB_ICASE) < 0) {
 	return (AB_FAIL);
     }
     
     /* check for acl */
-    if (sdb_get(abooks, name, SDB_ICASE, &value) >= 0) {
+    if (sdb_get(acldb, name, SDB_ICASE, &value) >= 0) {
 	/* if no ACL, create one */
 	if (value == NULL) {
 	    /* create default acl */
@@ -942,14 +2042,14 @@ int abook_setacl(id, name, ident, rights)
 	    && acl_set(&acl, ident, ACL_MODE_SET, 
 		       rights ? acl_strtomask(rights) : 0L, 
 		       NULL, NULL) == 0) {
-	    if (sdb_set(abooks, name, SDB_ICASE, acl) == 0) {
+	    if (sdb_set(acldb, name, SDB_ICASE, acl) == 0) {
 		result = AB_SUCCESS;
 	    }
 	}
     }
 
     /* unlock db */
-    if (sdb_unlock(abooks, name, SDB_ICASE) < 0) result = AB_FAIL;
+    if (sdb_unlock(acldb, name, SDB_ICASE) < 0) result = AB_FAIL;
     if (acl) free(acl);
     
     return (result);
@@ -975,7 +2075,7 @@ char *abook_getacl(id, name)
     auth_id *id;
     char *name;
 {
-    char dbname[256];
+    char dbname[256], acldb[32];
     char *acl;
     
     /* look up the database */
@@ -988,7 +2088,10 @@ char *abook_getacl(id, name)
     if (!(abook_rights(id, name, NULL) & ACL_LOOKUP)) return (NULL);
 
     /* check acl */
-    if (sdb_get(abooks, name, SDB_ICASE, &acl) < 0) return (NULL);
+    if (sdb_get(abook_acldb(acldb, sizeof(acldb), name), name, SDB_ICASE,
+		&acl) < 0) {
+	return (NULL);
+    }
     if (acl == NULL) acl = "";
 
     return (acl);
@@ -1002,20 +2105,29 @@ int abook_findstart(state, id, pat)
     char *pat;
 {
     char dbname[256];
-    int pkvcount;
+    char *scan;
     
-    state->kv = state->pkv = NULL;
-    if (sdb_match(abooks, pat, 0, NULL, 0, &state->kv, &state->kvcount) < 0) {
+    /* a pattern naming the owner only matches in the owner's shard of the
+     * global list; otherwise each shard is walked in turn
+     */
+    state->piter = NULL;
+    for (scan = pat; *scan != '\0' && *scan != '.' && *scan != '*'
+	     && *scan != '%' && *scan != '?'; ++scan);
+    if (scan > pat && (*scan == '.' || *scan == '\0')) {
+	state->shard = state->lastshard = abook_shard(pat);
+    } else {
+	state->shard = 0;
+	state->lastshard = SDB_SHARDS - 1;
+    }
+    if ((state->fpat = strdup(pat)) == NULL) return (AB_FAIL);
+    snprintf(dbname, sizeof(dbname), abooksharddb, state->shard);
+    if ((state->iter = sdb_iter_open(dbname, pat, 0, NULL)) == NULL) {
+	free(state->fpat);
+	state->fpat = NULL;
 	return (AB_FAIL);
     }
-    state->kvend = state->kv + state->kvcount;
-    state->kvpos = state->kv;
     snprintf(dbname, sizeof(dbname), abooksdb, auth_username(id));
-    sdb_match(dbname, pat, 0, NULL, 0, &state->pkv, &pkvcount);
-    if (state->pkv) {
-	state->kvend = state->pkv + pkvcount;
-	state->kvpos = state->pkv;
-    }
+    state->piter = sdb_iter_open(dbname, pat, 0, NULL);
 
     return (AB_SUCCESS);
 }
@@ -1031,31 +2143,42 @@ char *abook_find(state, id, abook, attrs)
     char **abook;
     int *attrs;
 {
-    char *user, *key;
+    char *user, *key, *value;
+    char acldb[32];
     int result = 0, ulen;
 
     user = auth_username(id);
     ulen = strlen(user);
     do {
-	if (!state->kvpos) return (NULL);
-	if (state->kvpos < state->kvend) {
-	    key = state->kvpos->key;
-	    if (state->pkv || strncmp(user, key, ulen)
-		|| (key[ulen] != '.' && key[ulen] != '\0')) {
-		result = abook_rights(id, state->kvpos->key, NULL)&ACL_LOOKUP;
-		*abook = state->kvpos->key;
-		*attrs = 0;
+	/* personal address book list first, then the global list */
+	if (state->piter) {
+	    if (sdb_iter_next(state->piter, &key, &value) <= 0) {
+		sdb_iter_close(state->piter);
+		state->piter = NULL;
+		continue;
 	    }
-	}
-	if (++state->kvpos >= state->kvend) {
-	    state->kvpos = NULL;
-	    if (state->pkv) {
-		sdb_freematch(state->pkv, state->kvend - state->pkv, 0);
-		state->pkv = NULL;
-		state->kvpos = state->kv;
-		state->kvend = state->kv + state->kvcount;
+	} else {
+	    if (!state->iter) return (NULL);
+	    if (sdb_iter_next(state->iter, &key, &value) <= 0) {
+		/* move on to the next shard */
+		sdb_iter_close(state->iter);
+		state->iter = NULL;
+		while (state->iter == NULL
+		       && state->shard < state->lastshard) {
+		    snprintf(acldb, sizeof(acldb), abooksharddb,
+			     ++state->shard);
+		    state->iter = sdb_iter_open(acldb, state->fpat, 0, NULL);
+		}
+		continue;
+	    }
+	    if (!strncmp(user, key, ulen)
+		&& (key[ulen] == '.' || key[ulen] == '\0')) {
+		continue;
 	    }
 	}
+	result = abook_rights(id, key, NULL) & ACL_LOOKUP;
+	*abook = key;
+	*attrs = 0;
     } while (!result);
 
     return (*abook);
@@ -1066,11 +2189,9 @@ char *abook_find(state, id, abook, attrs)
 void abook_finddone(state)
     abook_state *state;
 {
-    if (state->pkv) {
-	sdb_freematch(state->pkv, state->kvend - state->pkv, 0);
-    }
-    if (state->kv) {
-	sdb_freematch(state->kv, state->kvcount, 0);
-    }
-    state->kvpos = state->kv = state->pkv = NULL;
+    if (state->piter) sdb_iter_close(state->piter);
+    if (state->iter) sdb_iter_close(state->iter);
+    if (state->fpat) free(state->fpat);
+    state->iter = state->piter = NULL;
+    state->fpat = NULL;
 }
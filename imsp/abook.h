@@ -68,10 +68,24 @@ typedef struct abook_state {
     /* all fields are private to abook module: */
     sdb_keyvalue *kv, *kvpos, *kvend, *pkv;
     char *kvlast, *kvrights, *kvowner;
-    int kvcount;
+    int kvcount, lastsize;
+    sdb_iter *iter, *piter;	/* cursors for searches and finds */
+    char *fpat;			/* pattern of a find */
+    int shard, lastshard;	/* global list shards left to find in */
+    abook_fielddata *flist;	/* search criteria */
+    struct glob **glist;	/* compiled criteria patterns */
+    int fcount;
+    char dbname[256];
 } abook_state;
 
 #ifdef __STDC__
+/*  abook_init()
+ * create the shards of the global address book list, moving the entries
+ * of an unsharded list into them
+ *  returns: AB_SUCCESS, AB_FAIL
+ */
+int abook_init(void);
+
 /*  abook_fetch(state, id, name, alias, count, freedata)
  * fetch an address book entry
  *  state:  pointer to existing abook_state structure
@@ -151,6 +165,28 @@ int abook_store(auth_id *, char *, char *,
  */
 int abook_deleteent(auth_id *, char *, char *);
 
+/*  abook_import(id, name, next, rock)
+ * import a stream of entries in one write, charging the quota once.
+ * next(rock, &alias, &field, &data) returns 1 and the next field, 0 at
+ * the end or -1 on failure.
+ *  returns: AB_SUCCESS, AB_FAIL, AB_PERM, AB_QUOTA, AB_NOEXIST
+ */
+int abook_import(auth_id *, char *,
+		 int (*)(void *, char **, char **, char **), void *);
+
+/*  abook_export(id, name, fd, offset, len)
+ * export an address book as LDIF
+ *  returns: AB_SUCCESS, AB_FAIL, AB_PERM, AB_NOEXIST; on success *fd must
+ *  be closed by the caller, and holds the export at *offset for *len bytes
+ */
+int abook_export(auth_id *, char *, int *, long *, long *);
+
+/*  abook_usage(user)
+ * add up the bytes a user's address books count against the user's quota
+ *  returns: -1 on failure, the usage on success
+ */
+long abook_usage(char *);
+
 /*  abook_setacl(id, name, ident, rights)
  * set an access control list
  *  rights is NULL to delete an entry: returns 1 if entry doesn't exist
@@ -191,8 +227,11 @@ void abook_finddone(abook_state *);
 #else
 abook_fielddata *abook_fetch();
 void abook_fetchdone(), abook_searchdone(), abook_finddone();
-int abook_canfetch(), abook_canlock(), abook_searchstart(), abook_create();
+int abook_init(), abook_canfetch(), abook_canlock(), abook_searchstart();
+int abook_create();
 int abook_delete(), abook_rename(), abook_store(), abook_deleteent();
+int abook_import(), abook_export();
+long abook_usage();
 int abook_setacl(), abook_myrights(), abook_findstart();
 char *abook_search(), *abook_getacl(), *abook_find();
 #endif
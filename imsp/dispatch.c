@@ -52,10 +52,16 @@
 #include <sys/time.h>
 #include <sys/file.h>
 #include <sys/param.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 #include <netinet/in.h>
 #ifdef AIX
 #include <sys/select.h>
 #endif
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
 #include "dispatch.h"
 
 #include <sasl/sasl.h>
@@ -564,6 +570,59 @@ int dispatch_write(fbuf, buf, len)
     return (status);
 }
 
+/* (blocking) write len bytes of a file from offset, after any buffered
+ * output.  Without a SASL security layer or telemetry, the kernel copies
+ * the file to the connection with sendfile(); otherwise, or where that
+ * can't be done, the file is read into a buffer and written through
+ * do_flush(), encoding it for the security layer.
+ *  calls idle procedure on any write error
+ */
+int dispatch_sendfile(fbuf, fd, offset, len)
+    fbuf_t *fbuf;
+    int fd;
+    long offset, len;
+{
+    char buf[MAX_BUF];
+    int count;
+
+    if (dispatch_flush(fbuf) < 0) return (-1);
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+    if (fbuf->saslconn == NULL && fbuf->telem < 0) {
+	off_t pos = offset;
+
+	while (len > 0) {
+	    if (dispatch_loop(fbuf->fd, 1) < 0) {
+		(*err_proc)(DISPATCH_WRITE_ERR);
+		return (-1);
+	    }
+	    count = sendfile(fbuf->fd, fd, &pos, MIN(len, 1L << 30));
+	    if (count < 0) {
+		if (errno == EINTR || errno == EAGAIN) continue;
+		if (errno == EINVAL || errno == ENOSYS) break;
+		(*err_proc)(DISPATCH_WRITE_ERR);
+		return (-1);
+	    }
+	    if (count == 0) break;
+	    len -= count;
+	}
+	offset = pos;
+    }
+#endif
+    while (len > 0) {
+	if (lseek(fd, offset, SEEK_SET) < 0
+	    || (count = read(fd, buf, MIN(len, MAX_BUF))) <= 0) {
+	    (*err_proc)(DISPATCH_WRITE_ERR);
+	    return (-1);
+	}
+	if (fbuf->telem >= 0) write(fbuf->telem, buf, count);
+	if (do_flush(fbuf, buf, count) < 0) return (-1);
+	offset += count;
+	len -= count;
+    }
+
+    return (0);
+}
+
 /* close a file buffer and remove it from dispatch system
  */
 void dispatch_close(fbuf)
@@ -138,6 +138,9 @@ int dispatch_flush(fbuf_t *);
 /* (blocking) write data */
 int dispatch_write(fbuf_t *, const char *, int);
 
+/* (blocking) write part of a file, without copying it where possible */
+int dispatch_sendfile(fbuf_t *, int, long, long);
+
 /* close a file buffer and remove it from dispatch system */
 void dispatch_close(fbuf_t *);
 
@@ -152,6 +155,6 @@ void dispatch_init(), dispatch_initbuf(), dispatch_add(), dispatch_remove();
 void dispatch_setproc(), dispatch_close(), dispatch_telemetry();
 err_proc_t dispatch_err();
 int dispatch_check(), dispatch_loop(), dispatch_read(), dispatch_flush();
-int dispatch_write();
+int dispatch_write(), dispatch_sendfile();
 char *dispatch_readline();
 #endif
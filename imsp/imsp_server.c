@@ -46,6 +46,8 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <string.h>
+#include <stdlib.h>
+#include <limits.h>
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -117,6 +119,8 @@ typedef struct command_t {
 #define IMSP_LMARKED	   31
 #define IMSP_LAST	   32
 #define IMSP_SEEN	   33
+#define IMSP_IMPORTABOOK   34
+#define IMSP_EXPORTABOOK   35
 
 /* IMSP find options */
 #define FIND_MAILBOXES        0
@@ -143,6 +147,16 @@ static char *lockopt[] = {
 /* predefined options */
 static char opt_newuser[]   = "imsp.create.new.users";
 static char opt_required[]  = "imsp.required.bbsubs";
+static char opt_cache_slots[] = "imsp.cache.slots";
+static char opt_cache_maxbytes[] = "imsp.cache.maxbytes";
+static char opt_sync[] = "imsp.sync";
+static char opt_sync_writes[] = "imsp.sync.writes";
+static char opt_sync_delay[] = "imsp.sync.delay";
+static char opt_attrmap[] = "imsp.ldap.attrmap";
+/* names of the SDB_SYNC_* durability modes, in order */
+static char *syncmodes[] = {
+    "none", "group", "strict", NULL
+};
 
 /* user information */
 static auth_id *imsp_id;
@@ -246,6 +260,12 @@ static char msg_searchaddr[] = "* SEARCHADDRESS %s\r\n";
 static char msg_fetchaddr[] = "* FETCHADDRESS %s %s";
 static char msg_fielddata[] = " %a %s";
 static char txt_addressbook[] = "ADDRESSBOOK";
+static char msg_literalrdy[] = "+ go\r\n";
+static char txt_ldif[] = "LDIF";
+static char err_badldif[] = "Malformed LDIF data";
+static char err_badexport[] = "Failed to export address book";
+static char msg_exportabook[] = "* EXPORTADDRESSBOOK %s %a {%d}\r\n";
+static char txt_crlf[] = "\r\n";
 /* ACL messages */
 static char txt_acls[] = "ACL command";
 static char txt_setacl[] = "modify ACL for";
@@ -1180,6 +1200,421 @@ static void imsp_deleteaddress(fbuf, cp, tag, id, host)
     if (name) free(name);
 }
 
+/* NOTES
+ * IMPORTADDRESSBOOK takes a literal of LDIF (RFC 2849) records, parses it
+ * as it comes in from the client rather than copying it into memory first,
+ * and hands the fields to abook_import() to be stored in one write.  The
+ * alias of each entry is the value of the first part of its DN.  Each
+ * attribute is stored under the address book field imsp.ldap.attrmap maps
+ * to it, if any, or else under its own name, and repeated attributes are
+ * joined with ", ".  Records without a DN, such as a leading "version:"
+ * line, are skipped, as are values given by URL.
+ * END NOTES */
+
+/* an LDIF literal being read by IMPORTADDRESSBOOK
+ */
+typedef struct ldif_state {
+    fbuf_t *fbuf;
+    int left;			/* literal bytes not yet read */
+    int pos, len;		/* unread data in buf */
+    int peek;			/* character read ahead, or EOF */
+    int bad;			/* the literal is malformed */
+    char *line;			/* current unfolded line */
+    int linesize;		/* allocated size of line */
+    char *alias;		/* alias of current record */
+    abook_fielddata *flist;	/* fields of current record */
+    int fused, fsize;		/* fields in use and allocated */
+    int fnext;			/* next field to hand out */
+    option_list *attrmap;	/* address book fields to LDAP attributes */
+    char buf[MAX_BUF];		/* data read from the literal */
+} ldif_state;
+
+/* get the next character of an LDIF literal
+ *  returns EOF at the end of the literal
+ */
+static int ldif_getc(ls)
+    ldif_state *ls;
+{
+    int count;
+
+    if (ls->pos == ls->len) {
+	if (ls->left == 0) return (EOF);
+	count = ls->left < MAX_BUF ? ls->left : MAX_BUF;
+	if ((count = dispatch_read(ls->fbuf, ls->buf, count)) <= 0) {
+	    ls->left = 0;
+	    ls->bad = 1;
+	    return (EOF);
+	}
+	ls->left -= count;
+	ls->pos = 0;
+	ls->len = count;
+    }
+
+    return ((unsigned char) ls->buf[ls->pos++]);
+}
+
+/* read a line of an LDIF literal into ls->line, joining the lines folded
+ * into it and dropping the line end
+ *  returns -1 on failure, 0 at the end of the literal, 1 otherwise
+ */
+static int ldif_getline(ls)
+    ldif_state *ls;
+{
+    int c, len;
+    char *line;
+
+    if ((c = ls->peek) == EOF && (c = ldif_getc(ls)) == EOF) return (0);
+    for (len = 0;; c = ldif_getc(ls)) {
+	if (c == '\n') {
+	    /* a line starting with a space continues this one */
+	    if ((c = ldif_getc(ls)) != ' ') break;
+	    continue;
+	}
+	if (c == EOF) break;
+	if (c == '\r') continue;
+	if (len + 1 >= ls->linesize) {
+	    ls->linesize = ls->linesize ? ls->linesize * 2 : 256;
+	    line = ls->line == NULL ? malloc(ls->linesize)
+		: realloc(ls->line, ls->linesize);
+	    if (line == NULL) return (-1);
+	    ls->line = line;
+	}
+	ls->line[len++] = c;
+    }
+    ls->peek = c;
+    if (ls->line == NULL && (ls->line = malloc(ls->linesize = 256)) == NULL) {
+	return (-1);
+    }
+    ls->line[len] = '\0';
+
+    return (1);
+}
+
+/* free the current record of an LDIF literal
+ */
+static void ldif_freerecord(ls)
+    ldif_state *ls;
+{
+    while (ls->fused) {
+	--ls->fused;
+	free(ls->flist[ls->fused].field);
+	free(ls->flist[ls->fused].data);
+    }
+    ls->fnext = 0;
+    if (ls->alias) free(ls->alias);
+    ls->alias = NULL;
+}
+
+/* set the alias of the current record from its DN: the value of the DN's
+ * first part, with its escapes undone
+ *  returns -1 on failure, 0 on success
+ */
+static int ldif_dnalias(ls, dn)
+    ldif_state *ls;
+    char *dn;
+{
+    char *src, *dst;
+    char hex[3];
+
+    if ((src = strchr(dn, '=')) == NULL) {
+	ls->bad = 1;
+	return (-1);
+    }
+    if (ls->alias) free(ls->alias);
+    if ((ls->alias = dst = malloc(strlen(src))) == NULL) return (-1);
+    for (++src; *src && *src != ',' && *src != '+'; ++src) {
+	if (*src == '\\' && src[1]) {
+	    ++src;
+	    if (isxdigit((unsigned char) src[0])
+		&& isxdigit((unsigned char) src[1])) {
+		hex[0] = *src++;
+		hex[1] = *src;
+		hex[2] = '\0';
+		*dst++ = (char) strtol(hex, NULL, 16);
+		continue;
+	    }
+	}
+	*dst++ = *src;
+    }
+    *dst = '\0';
+
+    return (0);
+}
+
+/* find the address book field for an LDIF attribute: the field
+ * imsp.ldap.attrmap maps to it, or the attribute itself, lower cased
+ *  returns NULL if the attribute is mapped to no field
+ */
+static char *ldif_field(ls, attr)
+    ldif_state *ls;
+    char *attr;
+{
+    option_list *map = ls->attrmap;
+    int i;
+
+    if (map != NULL) {
+	for (i = 0; i + 1 < map->count; i += 2) {
+	    if (!strcasecmp(map->item[i + 1], attr)) {
+		return (strcasecmp(map->item[i], "null") ? map->item[i] : NULL);
+	    }
+	}
+    }
+
+    return (lcase(attr));
+}
+
+/* add a value to a field of the current record of an LDIF literal
+ *  returns -1 on failure, 0 on success
+ */
+static int ldif_addfield(ls, field, value)
+    ldif_state *ls;
+    char *field, *value;
+{
+    abook_fielddata *fd;
+    char *data;
+    int i, len;
+
+    if (!*value) return (0);
+    for (i = 0; i < ls->fused; ++i) {
+	fd = ls->flist + i;
+	if (!strcasecmp(fd->field, field)) {
+	    len = strlen(fd->data);
+	    if ((data = realloc(fd->data, len + strlen(value) + 3)) == NULL) {
+		return (-1);
+	    }
+	    sprintf(data + len, ", %s", value);
+	    fd->data = data;
+	    return (0);
+	}
+    }
+    if (ls->fused == ls->fsize) {
+	ls->fsize = ls->fsize ? ls->fsize * 2 : 16;
+	fd = (abook_fielddata *) (ls->flist == NULL
+	    ? malloc(ls->fsize * sizeof (abook_fielddata))
+	    : realloc((char *) ls->flist,
+		      ls->fsize * sizeof (abook_fielddata)));
+	if (fd == NULL) return (-1);
+	ls->flist = fd;
+    }
+    fd = ls->flist + ls->fused;
+    if ((fd->field = strdup(field)) == NULL) return (-1);
+    if ((fd->data = strdup(value)) == NULL) {
+	free(fd->field);
+	return (-1);
+    }
+    ++ls->fused;
+
+    return (0);
+}
+
+/* read the next record with a DN from an LDIF literal
+ *  returns -1 on failure, 0 at the end of the literal, 1 otherwise
+ */
+static int ldif_record(ls)
+    ldif_state *ls;
+{
+    char *attr, *value, *field;
+    int result, len;
+
+    ldif_freerecord(ls);
+    while ((result = ldif_getline(ls)) > 0) {
+	attr = ls->line;
+	if (*attr == '\0') {
+	    /* a blank line ends the record */
+	    if (ls->alias != NULL) return (1);
+	    ldif_freerecord(ls);
+	    continue;
+	}
+	if (*attr == '#') continue;
+	if ((value = strchr(attr, ':')) == NULL) {
+	    ls->bad = 1;
+	    return (-1);
+	}
+	*value++ = '\0';
+	if (*value == '<') continue;
+	if (*value == ':') {
+	    for (++value; *value == ' '; ++value);
+	    if ((len = from64(value, value)) < 0) {
+		ls->bad = 1;
+		return (-1);
+	    }
+	    value[len] = '\0';
+	} else {
+	    while (*value == ' ') ++value;
+	}
+
+	/* drop attribute options such as ";lang-en" */
+	if ((field = strchr(attr, ';')) != NULL) *field = '\0';
+	if (!strcasecmp(attr, "dn")) {
+	    if (ldif_dnalias(ls, value) < 0) return (-1);
+	} else if (strcasecmp(attr, "objectclass")
+		   && strcasecmp(attr, "version")
+		   && strcasecmp(attr, "changetype")
+		   && (field = ldif_field(ls, attr)) != NULL
+		   && ldif_addfield(ls, field, value) < 0) {
+	    return (-1);
+	}
+    }
+    if (result == 0 && ls->alias != NULL) result = 1;
+
+    return (result);
+}
+
+/* hand the fields of an LDIF literal to abook_import() one at a time
+ */
+static int ldif_next(rock, alias, field, data)
+    void *rock;
+    char **alias, **field, **data;
+{
+    ldif_state *ls = (ldif_state *) rock;
+    int result;
+
+    while (ls->fnext == ls->fused) {
+	if ((result = ldif_record(ls)) <= 0) return (result);
+    }
+    *alias = ls->alias;
+    *field = ls->flist[ls->fnext].field;
+    *data = ls->flist[ls->fnext++].data;
+
+    return (1);
+}
+
+/* do the "IMPORTADDRESSBOOK" command
+ */
+static void imsp_importabook(fbuf, cp, tag, id, host)
+    fbuf_t *fbuf;
+    command_t *cp;
+    char *tag, *host;
+    auth_id *id;
+{
+    char *name, *format = NULL, *pos, *user;
+    int litlen, nonsynch, ldif, result;
+    ldif_state *ls;
+
+    /* the literal must end the command line */
+    if ((name = copy_astring(fbuf, 1)) == NULL
+	|| (format = copy_atom(fbuf)) == NULL
+	|| *(pos = fbuf->upos) != '{') {
+	SEND_RESPONSE2(fbuf, tag, rpl_wrongargs, cp->word, 3);
+	if (format) free(format);
+	if (name) free(name);
+	return;
+    }
+    for (litlen = 0; isdigit((unsigned char) *++pos);) {
+	if (litlen > (INT_MAX - 9) / 10) break;
+	litlen = litlen * 10 + (*pos - '0');
+    }
+    nonsynch = *pos == '+';
+    if (nonsynch) ++pos;
+    if (pos[0] != '}' || pos[1] != '\0'
+	|| (ls = (ldif_state *) malloc(sizeof (ldif_state))) == NULL) {
+	SEND_RESPONSE2(fbuf, tag, rpl_wrongargs, cp->word, 3);
+	free(format);
+	free(name);
+	return;
+    }
+    lcase(name);
+    memset((char *) ls, '\0', sizeof (ldif_state));
+    ls->fbuf = fbuf;
+    ls->left = litlen;
+    ls->peek = EOF;
+
+    /* read the literal, unless the client can still be told not to send it */
+    ldif = !strcasecmp(format, txt_ldif);
+    result = AB_FAIL;
+    if (ldif || nonsynch) {
+	if (!nonsynch) {
+	    SEND_STRING(fbuf, msg_literalrdy);
+	    dispatch_flush(fbuf);
+	}
+	if (ldif) {
+	    ls->attrmap = option_getlist("", opt_attrmap, 1);
+	    result = abook_import(id, name, ldif_next, (void *) ls);
+	    if (ls->attrmap) option_freelist(ls->attrmap);
+	}
+	while (ldif_getc(ls) != EOF);
+	dispatch_readline(fbuf);
+    }
+
+    user = auth_username(auth_level(id) >= AUTH_USER ? id : NULL);
+    if (!ldif) {
+	SEND_RESPONSE1(fbuf, tag, rpl_notsupported, format);
+    } else {
+	switch (result) {
+	    case AB_NOEXIST:
+		im_send(fbuf, NULL, rpl_noabook, tag, name);
+		break;
+	    case AB_QUOTA:
+		SEND_RESPONSE1(fbuf, tag, rpl_no, err_quota);
+		break;
+	    case AB_PERM:
+		im_send(fbuf, NULL, rpl_abookauth, tag, user, txt_modify,
+			name);
+		break;
+	    case AB_FAIL:
+		SEND_RESPONSE1(fbuf, tag, rpl_no,
+			       ls->bad ? err_badldif : err_badstore);
+		break;
+	    default:
+		SEND_RESPONSE1(fbuf, tag, rpl_complete, cp->word);
+		break;
+	}
+    }
+    ldif_freerecord(ls);
+    if (ls->flist) free((char *) ls->flist);
+    if (ls->line) free(ls->line);
+    free((char *) ls);
+    free(format);
+    free(name);
+}
+
+/* do the "EXPORTADDRESSBOOK" command: send the address book as an LDIF
+ * literal, straight from the file sdb_export() keeps it in
+ */
+static void imsp_exportabook(fbuf, cp, tag, id, host)
+    fbuf_t *fbuf;
+    command_t *cp;
+    char *tag, *host;
+    auth_id *id;
+{
+    char *name, *user;
+    int fd;
+    long offset, len;
+
+    user = auth_username(auth_level(id) >= AUTH_USER ? id : NULL);
+    if ((name = copy_astring(fbuf, 1)) == NULL
+	|| fbuf->upos != fbuf->lend) {
+	SEND_RESPONSE2(fbuf, tag, rpl_wrongargs, cp->word, 1);
+    } else {
+	lcase(name);
+	switch (abook_export(id, name, &fd, &offset, &len)) {
+	    case AB_NOEXIST:
+		im_send(fbuf, NULL, rpl_noabook, tag, name);
+		break;
+	    case AB_PERM:
+		im_send(fbuf, NULL, rpl_abookauth, tag, user, txt_access,
+			name);
+		break;
+	    case AB_FAIL:
+		SEND_RESPONSE1(fbuf, tag, rpl_no, err_badexport);
+		break;
+	    default:
+		im_send(fbuf, NULL, msg_exportabook, name, txt_ldif, (int) len);
+		if (dispatch_sendfile(fbuf, fd, offset, len) < 0) {
+		    /* literal is incomplete: client can't resync, so drop it */
+		    close(fd);
+		    dispatch_close(fbuf);
+		    break;
+		}
+		close(fd);
+		SEND_STRING(fbuf, txt_crlf);
+		SEND_RESPONSE1(fbuf, tag, rpl_complete, cp->word);
+		break;
+	}
+    }
+    if (name) free(name);
+}
+
 /* do the "SETACL" and "DELETEACL" commands
  */
 static void imsp_setacl(fbuf, cp, tag, id, host)
@@ -1431,7 +1866,7 @@ static void imsp_capability(fbuf, cp, tag, id, host)
   }
 
   /* send the newline */
-  SEND_STRING(fbuf," LITERAL+\r\n");
+  SEND_STRING(fbuf," LITERAL+ IMPORTADDRESSBOOK=LDIF EXPORTADDRESSBOOK=LDIF\r\n");
 
   SEND_RESPONSE1(fbuf, tag, rpl_complete, cp->word);
 }
@@ -1488,6 +1923,8 @@ static command_t com_list[] = {
     {"createaddressbook", IMSP_CREATEABOOK, imsp_createabook},
     {"deleteaddressbook", IMSP_DELETEABOOK, imsp_deleteabook},
     {"renameaddressbook", IMSP_RENAMEABOOK, imsp_renameabook},
+    {"importaddressbook", IMSP_IMPORTABOOK, imsp_importabook},
+    {"exportaddressbook", IMSP_EXPORTABOOK, imsp_exportabook},
     {"capability", IMSP_CAPABILITY, imsp_capability},
     {"authenticate", IMSP_AUTHENTICATE, imsp_authenticate},
     {"list", IMSP_LIST, imsp_list},
@@ -1498,6 +1935,56 @@ static command_t com_list[] = {
     {NULL, 0, NULL}
 };
 
+/* configure database caching and durability for this connection from the
+ * global options
+ */
+static void imsp_config_cache(void)
+{
+    char *value;
+    int i;
+
+    value = option_get("", opt_cache_slots, 1, NULL);
+    if (value) {
+	if (sdb_config(SDB_CONF_SLOTS, atol(value)) < 0) {
+	    syslog(LOG_ERR, "imspd: bad value for %s: %s",
+		   opt_cache_slots, value);
+	}
+	free(value);
+    }
+    value = option_get("", opt_cache_maxbytes, 1, NULL);
+    if (value) {
+	if (sdb_config(SDB_CONF_MAXBYTES, atol(value)) < 0) {
+	    syslog(LOG_ERR, "imspd: bad value for %s: %s",
+		   opt_cache_maxbytes, value);
+	}
+	free(value);
+    }
+    value = option_get("", opt_sync, 1, NULL);
+    if (value) {
+	for (i = 0; syncmodes[i] && strcasecmp(syncmodes[i], value); ++i);
+	if (!syncmodes[i] || sdb_config(SDB_CONF_SYNC, i) < 0) {
+	    syslog(LOG_ERR, "imspd: bad value for %s: %s", opt_sync, value);
+	}
+	free(value);
+    }
+    value = option_get("", opt_sync_writes, 1, NULL);
+    if (value) {
+	if (sdb_config(SDB_CONF_SYNCWRITES, atol(value)) < 0) {
+	    syslog(LOG_ERR, "imspd: bad value for %s: %s",
+		   opt_sync_writes, value);
+	}
+	free(value);
+    }
+    value = option_get("", opt_sync_delay, 1, NULL);
+    if (value) {
+	if (sdb_config(SDB_CONF_SYNCDELAY, atol(value)) < 0) {
+	    syslog(LOG_ERR, "imspd: bad value for %s: %s",
+		   opt_sync_delay, value);
+	}
+	free(value);
+    }
+}
+
 /* start the protocol exchange
  */
 void im_start(int fd, char *host)
@@ -1539,6 +2026,8 @@ void im_start(int fd, char *host)
     }
     (void) dispatch_err(MAX_IDLE_TIME, MAX_WRITE_WAIT, im_err);
     dispatch_initbuf(fbuf, fd);
+    sdb_watch();
+    imsp_config_cache();
 
     /* start SASL and set properties for this server thread 
      */
@@ -1582,6 +2071,8 @@ void im_start(int fd, char *host)
 		}
 	    }
 	}
+	sdb_sync(0);
+	sdb_trim();
 	dispatch_flush(fbuf);
     }
     dispatch_close(fbuf);
@@ -0,0 +1,285 @@
+/* imspdb.c -- offline maintenance of the IMSP databases
+ *
+ * Copyright (c) 1993-2000 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer. 
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any other legal
+ *    details, please contact  
+ *      Office of Technology Transfer
+ *      Carnegie Mellon University
+ *      5000 Forbes Avenue
+ *      Pittsburgh, PA  15213-3890
+ *      (412) 268-4387, fax: (412) 268-7395
+ *      tech-transfer@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <syslog.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include "util.h"
+#include "syncdb.h"
+#include "option.h"
+#include "authize.h"
+#include "abook.h"
+
+int imspd_debug = 0;
+
+/* the work of one worker process */
+typedef struct job {
+    int (*proc)();			/* what to do to each database */
+    char *format;			/* format to convert to, or NULL */
+    int jobs;				/* number of workers */
+    int job;				/* this worker's number */
+    int errors;				/* databases or users that failed */
+    char user[256];			/* last user whose quota was done */
+} job;
+
+/* fatal abort (called from xmalloc.c)
+ */
+void fatal(const char *s, int code)
+{
+    syslog(LOG_ERR, "%s", s);
+    exit(code);
+}
+
+/* check whether a database or user belongs to this worker.  All the
+ * databases of a user go to the same worker.
+ */
+static int mine(job *j, const char *owner, int len)
+{
+    unsigned long hash = 0;
+
+    while (len--) hash = hash * 31 + TOLOWER(*owner++);
+
+    return (hash % j->jobs == j->job);
+}
+
+/* find the owner of a database: the user of a private database, or the
+ * database itself
+ *  returns the length of the owner
+ */
+static int dbowner(char *db, char **owner)
+{
+    char *end;
+
+    *owner = db;
+    if (!strncmp(db, "user/", 5) && (end = strchr(db + 5, '/')) != NULL) {
+	*owner = db + 5;
+	return (end - *owner);
+    }
+
+    return (strlen(db));
+}
+
+/* report whether a database is in order
+ */
+static int doverify(job *j, char *db)
+{
+    switch (sdb_verify(db, SDB_ICASE)) {
+    case -1:
+	fprintf(stderr, "imspdb: %s: can't be read\n", db);
+	++j->errors;
+	break;
+
+    case 1:
+	printf("%s: needs compacting\n", db);
+	++j->errors;
+	break;
+    }
+
+    return (0);
+}
+
+/* rewrite a database, sorted and with its log folded in, in its own
+ * format or the one asked for
+ */
+static int doconvert(job *j, char *db)
+{
+    if (sdb_convert(db, j->format, SDB_ICASE) < 0) {
+	fprintf(stderr, "imspdb: %s: can't be rewritten\n", db);
+	++j->errors;
+    }
+
+    return (0);
+}
+
+/* recompute the quota usage of a user from the user's options and
+ * address books
+ */
+static int doquota(job *j, char *user)
+{
+    long usage;
+
+    if ((usage = abook_usage(user)) < 0) {
+	fprintf(stderr, "imspdb: %s: can't read address books\n", user);
+	++j->errors;
+	return (0);
+    }
+    switch (option_requota(user, usage, &usage)) {
+    case -1:
+	fprintf(stderr, "imspdb: %s: can't set quota usage\n", user);
+	++j->errors;
+	break;
+
+    case 1:
+	printf("%s: quota usage corrected to %ld\n", user, usage);
+	break;
+    }
+
+    return (0);
+}
+
+/* do a job's work on one database found by sdb_walk.  The quota is done
+ * once for each user, on finding the first of the user's databases.
+ */
+static int walkproc(char *db, void *rock)
+{
+    job *j = (job *) rock;
+    char *owner;
+    int len;
+
+    len = dbowner(db, &owner);
+    if (!mine(j, owner, len)) return (0);
+    if (j->proc != doquota) return ((*j->proc)(j, db));
+    if (owner == db || len >= sizeof (j->user)
+	|| (!strncmp(j->user, owner, len) && j->user[len] == '\0')) {
+	return (0);
+    }
+    memcpy(j->user, owner, len);
+    j->user[len] = '\0';
+
+    return (doquota(j, j->user));
+}
+
+/* do one worker's share of the databases or users named, or of all
+ * databases if none are
+ *  returns the exit status of the worker
+ */
+static int work(job *j, int argc, char **argv)
+{
+    char *owner;
+    int i;
+
+    if (sdb_init() < 0) {
+	fprintf(stderr, "imspdb: failed to initialize database module\n");
+	return (1);
+    }
+    if (argc == 0) {
+	if (sdb_walk(walkproc, (void *) j) < 0) {
+	    fprintf(stderr, "imspdb: can't read the database directories\n");
+	    ++j->errors;
+	}
+    }
+    for (i = 0; i < argc; ++i) {
+	if (j->proc == doquota) {
+	    if (mine(j, argv[i], strlen(argv[i]))) doquota(j, argv[i]);
+	} else if (mine(j, owner, dbowner(argv[i], &owner))) {
+	    (*j->proc)(j, argv[i]);
+	}
+    }
+    sdb_done();
+
+    return (j->errors ? 1 : 0);
+}
+
+int
+main(int argc, char **argv)
+{
+    extern int optind;
+    extern char *optarg;
+    int c, errflag = 0, status, result;
+    pid_t pid;
+    job j;
+
+    memset((char *) &j, '\0', sizeof (j));
+    j.jobs = 1;
+    while ((c = getopt(argc, argv, "j:")) != EOF) {
+	switch (c) {
+	case 'j':
+	    j.jobs = atoi(optarg);
+	    if (j.jobs < 1) errflag = 1;
+	    break;
+	default:
+	    errflag = 1;
+	    break;
+	}
+    }
+    if (optind < argc && !strcmp(argv[optind], "verify")) {
+	j.proc = doverify;
+    } else if (optind < argc && !strcmp(argv[optind], "compact")) {
+	j.proc = doconvert;
+    } else if (optind + 1 < argc && !strcmp(argv[optind], "convert")) {
+	j.proc = doconvert;
+	j.format = argv[++optind];
+    } else if (optind < argc && !strcmp(argv[optind], "quota")) {
+	j.proc = doquota;
+    } else {
+	errflag = 1;
+    }
+    if (errflag) {
+	fprintf(stderr,
+		"Usage: %s [-j jobs] verify [db ...]\n"
+		"       %s [-j jobs] compact [db ...]\n"
+		"       %s [-j jobs] convert flat|skiplist [db ...]\n"
+		"       %s [-j jobs] quota [user ...]\n"
+		"use -j to share the work out between that many processes\n",
+		argv[0], argv[0], argv[0], argv[0]);
+	exit(2);
+    }
+    ++optind;
+    (void) openlog("imspdb", LOG_PID | LOG_PERROR, LOG_LOCAL6);
+    (void) setlogmask(LOG_UPTO(LOG_INFO));
+
+    /* the database module isn't reentrant, so the workers are processes */
+    if (j.jobs == 1) exit(work(&j, argc - optind, argv + optind));
+    result = 0;
+    for (j.job = 0; j.job < j.jobs; ++j.job) {
+	if ((pid = fork()) == 0) {
+	    exit(work(&j, argc - optind, argv + optind));
+	} else if (pid < 0) {
+	    fprintf(stderr, "imspdb: unable to start worker: %s\n",
+		    strerror(errno));
+	    result = 1;
+	    break;
+	}
+    }
+    while (wait(&status) > 0) {
+	if (!WIFEXITED(status) || WEXITSTATUS(status)) result = 1;
+    }
+
+    exit(result);
+}
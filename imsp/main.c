@@ -64,6 +64,7 @@
 #include "authize.h"
 #include "util.h"
 #include "syncdb.h"
+#include "abook.h"
 #include "option.h"
 #include "sasl_support.h"
 
@@ -182,6 +183,9 @@ static void start_server(int port_number)
 	  continue;
 	}
 
+	/* bring the global databases the children will share up to date */
+	sdb_refresh(SDB_ICASE);
+
 	/* fork server process */
 	if (!imspd_debug) {
 	  pid = fork();
@@ -253,7 +257,7 @@ main(int argc, char **argv)
 	       "and you must run as root.\n");
 	exit(1);
     }
-    sdb_create("abooks");
+    abook_init();
     dispatch_init();
 
     if (mysasl_init("imspd", &errstr) < 0) {
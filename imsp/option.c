@@ -100,6 +100,31 @@ static char *magicopt(name, val, user)
     return (val);
 }
 
+/* get a handle on a user's options database, or the global one if user is
+ * the empty string.  The last user's handle is kept, as a session keeps
+ * asking about the same user.
+ */
+static sdb_db *option_db(user)
+    char *user;
+{
+    static sdb_db *globaldb, *userdb;
+    static char username[256];
+    char dbname[256];
+
+    if (!*user) {
+	if (globaldb == NULL) globaldb = sdb_open(options);
+	return (globaldb);
+    }
+    if (userdb == NULL || strcmp(username, user)) {
+	sdb_close(userdb);
+	snprintf(dbname, sizeof(dbname), optiondb, user);
+	snprintf(username, sizeof(username), "%s", user);
+	userdb = sdb_open(dbname);
+    }
+
+    return (userdb);
+}
+
 /* make sure user has options database
  *  returns 0 if database exists, -1 on failure
  */
@@ -126,46 +151,43 @@ int option_create(user)
     return (sdb_create(dbname));
 }
 
+/* get the next match of a cursor, or set key to NULL at the end
+ */
+static void option_next(it, key, value)
+    sdb_iter *it;
+    char **key, **value;
+{
+    if (it == NULL || sdb_iter_next(it, key, value) <= 0) *key = NULL;
+}
+
 /* begin a match
  */
 int option_matchstart(state, user, pat)
     option_state *state;
     char *user, *pat;
 {
-    int result;
     char dbname[256];
 
-    /* read user options database if user isn't the empty string */
-    state->ukv = (sdb_keyvalue *) NULL;
-    state->ucount = 0;
+    state->giter = state->uiter = (sdb_iter *) NULL;
+    state->buflen = 0;
+    state->buf = (char *) NULL;
+
+    /* match user options database if user isn't the empty string */
     if (*user) {
 	snprintf(dbname, sizeof(dbname), optiondb, user);
-	result = sdb_match(dbname, pat, SDB_ICASE, NULL, 0,
-			   &state->ukv, &state->ucount);
+	state->uiter = sdb_iter_open(dbname, pat, SDB_ICASE, NULL);
+	if (state->uiter == NULL) return (-1);
     }
-    if (*user && result < 0) {
-	state->ucount = state->gcount = 0;
-	state->gkv = state->ukv = (sdb_keyvalue *) NULL;
+
+    /* match global options database */
+    state->giter = sdb_iter_open(options, pat, SDB_ICASE, NULL);
+    if (state->giter == NULL) {
+	sdb_iter_close(state->uiter);
+	state->uiter = (sdb_iter *) NULL;
 	return (-1);
-    } else {
-	/* read global options database
-	 * set copy flag due to magic options
-	 */
-	result = sdb_match(options, pat, SDB_ICASE, NULL, 1,
-			   &state->gkv, &state->gcount);
-	if (result < 0) {
-	    sdb_freematch(state->ukv, state->ucount, 0);
-	    state->ucount = state->gcount = 0;
-	    state->gkv = state->ukv = (sdb_keyvalue *) NULL;
-	    return (-1);
-	}
     }
-    state->ukvpos = state->ukv;
-    state->gkvpos = state->gkv;
-    state->utotal = state->ucount;
-    state->gtotal = state->gcount;
-    state->buflen = 0;
-    state->buf = (char *) NULL;
+    option_next(state->uiter, &state->ukey, &state->uval);
+    option_next(state->giter, &state->gkey, &state->gval);
 
     return (0);
 }
@@ -185,15 +207,15 @@ char *option_match(state, user, name, value, rwflag, admin)
     int cmp;
     char *val;
 
-    /* NOTE: assume gkv & ukv arrays are sorted from lowest to highest */
+    /* NOTE: both cursors return keys from lowest to highest */
     do {
 	/* find the smallest key */
-	if (state->gcount) {
+	if (state->gkey) {
 	    cmp = -1;
-	    if (state->ucount) {
-		cmp = strcasecmp(state->gkvpos->key, state->ukvpos->key);
+	    if (state->ukey) {
+		cmp = strcasecmp(state->gkey, state->ukey);
 	    }
-	} else if (state->ucount) {
+	} else if (state->ukey) {
 	    cmp = 1;
 	} else {
 	    return (NULL);
@@ -201,18 +223,18 @@ char *option_match(state, user, name, value, rwflag, admin)
 
 	/* grab the argument */
 	if (cmp == 0) {
-	    *name = state->ukvpos->key;
-	    val = state->ukvpos->value;
-	    ++state->ukvpos, ++state->gkvpos;
-	    --state->gcount, --state->ucount;
+	    *name = state->ukey;
+	    val = state->uval;
+	    option_next(state->uiter, &state->ukey, &state->uval);
+	    option_next(state->giter, &state->gkey, &state->gval);
 	} else if (cmp > 0) {
-	    *name = state->ukvpos->key;
-	    val = state->ukvpos->value;
-	    ++state->ukvpos, --state->ucount;
+	    *name = state->ukey;
+	    val = state->uval;
+	    option_next(state->uiter, &state->ukey, &state->uval);
 	} else {
-	    *name = state->gkvpos->key;
-	    val = state->gkvpos->value;
-	    ++state->gkvpos, --state->gcount;
+	    *name = state->gkey;
+	    val = state->gval;
+	    option_next(state->giter, &state->gkey, &state->gval);
 	}
     } while (*val == 'N' && !admin);
 
@@ -250,10 +272,10 @@ void option_matchdone(state)
     option_state *state;
 {
     if (state->buf) free(state->buf);
-    if (state->gkv) sdb_freematch(state->gkv, state->gtotal, 1);
-    if (state->ukv) sdb_freematch(state->ukv, state->utotal, 0);
+    sdb_iter_close(state->giter);
+    sdb_iter_close(state->uiter);
     state->buf = NULL;
-    state->gkv = state->ukv = NULL;
+    state->giter = state->uiter = NULL;
 }
 
 /* get an option
@@ -267,18 +289,16 @@ char *option_get(user, opt, admin, rwflag)
     int *rwflag;
 {
     char *result, *value;
-    char dbname[256];
 
     /* initialize results */
     value = result = NULL;
     
     /* check user options database if user isn't the empty string */
-    if (*user) {
-	snprintf(dbname, sizeof(dbname), optiondb, user);
-	if (sdb_get(dbname, opt, SDB_ICASE, &value) < 0) return (NULL);
+    if (*user && sdb_dbget(option_db(user), opt, SDB_ICASE, &value) < 0) {
+	return (NULL);
     }
     /* check global options */
-    if (value == NULL && sdb_get(options, opt, SDB_ICASE, &value) < 0) {
+    if (value == NULL && sdb_dbget(option_db(""), opt, SDB_ICASE, &value) < 0) {
 	return (NULL);
     }
 
@@ -314,18 +334,16 @@ int option_test(user, opt, admin, dflt)
     int admin, dflt;
 {
     char *value;
-    char dbname[256];
 
     /* initialize result */
     value = NULL;
     
     /* check user options database if user isn't the empty string */
-    if (*user) {
-	snprintf(dbname, sizeof(dbname), optiondb, user);
-	if (sdb_get(dbname, opt, SDB_ICASE, &value) < 0) return (NULL);
+    if (*user && sdb_dbget(option_db(user), opt, SDB_ICASE, &value) < 0) {
+	return (NULL);
     }
     /* check global options */
-    if (value == NULL && sdb_get(options, opt, SDB_ICASE, &value) < 0) {
+    if (value == NULL && sdb_dbget(option_db(""), opt, SDB_ICASE, &value) < 0) {
 	return (NULL);
     }
 
@@ -485,6 +503,52 @@ int option_doquota(user, delta)
     return (result);
 }
 
+/* recompute a user's quota usage from scratch: the read-write options in
+ * the user's options database, as charged by option_set, plus extra bytes
+ * counted elsewhere (the user's address books)
+ *  returns -1 on db error, 0 if the usage was right, 1 if it was changed
+ *  *usage is set to the recomputed usage
+ */
+int option_requota(user, extra, usage)
+    char *user;
+    long extra;
+    long *usage;
+{
+    sdb_iter *iter;
+    char *key, *value;
+    int result;
+    char dbname[256];
+    char usagestr[64];
+
+    /* add up the read-write options */
+    *usage = extra;
+    snprintf(dbname, sizeof(dbname), optiondb, user);
+    if (sdb_check(dbname) < 0) {
+	if (!extra) return (0);
+	if (sdb_create(dbname) < 0) return (-1);
+    }
+    if ((iter = sdb_iter_open(dbname, "*", SDB_ICASE, NULL)) == NULL) {
+	return (-1);
+    }
+    while ((result = sdb_iter_next(iter, &key, &value)) > 0) {
+	if (value && *value == 'W') *usage += strlen(key) + strlen(value) - 2;
+    }
+    sdb_iter_close(iter);
+    if (result < 0) return (-1);
+
+    /* replace the running total if it has drifted */
+    snprintf(usagestr, sizeof(usagestr), "R %ld", *usage);
+    if (sdb_writelock(dbname, opt_usage, SDB_ICASE) < 0) return (-1);
+    if (sdb_get(dbname, opt_usage, SDB_ICASE, &value) < 0) {
+	result = -1;
+    } else if (value == NULL ? *usage != 0 : strcmp(value, usagestr)) {
+	result = sdb_set(dbname, opt_usage, SDB_ICASE, usagestr) < 0 ? -1 : 1;
+    }
+    if (sdb_unlock(dbname, opt_usage, SDB_ICASE) < 0) result = -1;
+
+    return (result);
+}
+
 /* set an option
  *  returns -1 on failure, -3 on over quota
  */
@@ -50,8 +50,9 @@
 /* state used for option_match */
 typedef struct option_state {
     /* all variables are private to option module */
-    sdb_keyvalue *gkv, *ukv, *gkvpos, *ukvpos;
-    int gcount, ucount, gtotal, utotal, buflen;
+    sdb_iter *giter, *uiter;
+    char *gkey, *gval, *ukey, *uval;
+    int buflen;
     char *buf;
 } option_state;
 
@@ -127,6 +128,13 @@ int option_lookup( /* char *user, char *opt, int admin, char *str */ );
  */
 int option_doquota( /* char *user, long delta */ );
 
+/* recompute a user's quota usage from the user's options plus extra bytes
+ * counted elsewhere (the user's address books), correcting it if needed
+ *  usage is set to the recomputed usage
+ *  returns -1 on db error, 0 if the usage was right, 1 if it was changed
+ */
+int option_requota( /* char *user, long extra, long *usage */ );
+
 /* set an option
  *  returns -1 on failure, -3 on over quota
  */
@@ -56,19 +56,33 @@
 #include <config.h>
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
 #include <sys/file.h>
 #include <sys/param.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <syslog.h>
+#include <dirent.h>
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
 #include "util.h"
+#include "lock.h"
+#include "map.h"
+#include "mpool.h"
+#include "retry.h"
+#include "cyrusdb.h"
 #include "syncdb.h"
 #include "glob.h"
+#include "hash.h"
 
 /* prefixes for database files */
 #define PREFIX		"/var/imsp"
@@ -81,52 +95,366 @@
 #define MAXDBPATHLEN	(PREFIXLEN + MAXDBLEN)
 
 /* cache sizing constants */
-#define CACHE_INCREMENT 100		/* number of elements to grow cache by */
+#define KVPAGE		128		/* keyvalue pairs in a cache index page */
+#define CACHE_SLOTS	4		/* default private caches kept per type */
+#define CACHE_BUCKETS	1021		/* hash buckets for cached database names */
+#define POOL_SIZE	1024		/* first block of a cache's string pool */
+#define LOAD_RETRIES	5		/* reloads if a writer races a reader */
+#define PEEK_LIMIT	16		/* lookups made on a db before loading it */
+#define PEEK_LOGMAX	8192		/* longest log scanned by a lookup */
+#define FETCH_POOL	65536		/* engine lookups kept before reusing pool */
+#define MAXMAGIC	16		/* longest storage engine magic number */
+#define FOLD_BUF	256		/* longest lookup key folded on the stack */
+
+/* charge memory a cache allocates, or refund memory it frees, to the cache
+ * and to the total for the process
+ */
+#define CHARGE(c, n)	((c)->bytes += (n), sdb_bytes += (n))
+#define REFUND(c, n)	((c)->bytes -= (n), sdb_bytes -= (n))
 
-/* a file cache */
-typedef struct cache {
+/* set if a cache's index is still the one sdb_refresh() loaded before the
+ * process forked, and so shared with the parent
+ */
+#define INHERITED(c)	((c)->loaded && (c)->gen == (c)->sharegen)
+
+/* log sizing constants */
+#define LOG_INCREMENT	1024		/* bytes to grow pending log records by */
+#define LOG_COMPACT	65536		/* smallest log folded into its file */
+#define LOGKEYNEED(key)	(2 * strlen(key) + 2)	/* record with no value */
+#define LOGNEED(key, value)	(LOGKEYNEED(key) + 2 * strlen(value) + 1)
+
+/* write lock constants.  A writer locks one byte of the database file,
+ * picked by hashing the key, so writers of different keys don't wait for
+ * each other.  Appending to the log locks byte KEYLOCK_LOG, and a lock on
+ * the whole database locks the whole file.
+ */
+#define KEYLOCK_LOG	0		/* byte locked to append to the log */
+#define KEYLOCK_SLOTS	1024		/* bytes after it used for key locks */
+
+/* group commit window defaults, see sdb_config() */
+#define SYNC_WRITES	32		/* writes made durable by one fsync */
+#define SYNC_DELAY	5		/* seconds a write may wait for fsync */
+
+/* change watch constants, see sdb_watch() */
+#define WATCH_DIRS	32		/* directories watched at once */
+#define WATCH_BUF	4096		/* bytes of events read at once */
+#define WATCH_EVENTS	(IN_CREATE | IN_DELETE | IN_MODIFY | IN_MOVED_FROM \
+			 | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+/* files of a cache waiting for a group commit fsync */
+#define SYNC_LOG	0x01		/* log has unsynced records */
+#define SYNC_DIR	0x02		/* directory has unsynced entries */
+
+/* output buffer size used when writing database files */
+#define WBUF_SIZE	8192
+
+/* binary database file format.  All integers are 32 bits in network byte
+ * order.  The file starts with a header:
+ *	magic, version, flags (SDB_ICASE if sorted case insensitive), count
+ * followed by an index of "count" record offsets in key order, followed by
+ * the records themselves:
+ *	key length, value length (SDB_NOVALUE for a NULL value),
+ *	key, NUL, value, NUL, padding to a 4 byte boundary
+ * Files without the magic number are read as the legacy text format
+ * (one "key value" line per entry) and rewritten in binary on first write.
+ */
+static char sdb_magic[] = "\0SYNCDB\n";
+#define SDB_MAGICLEN	8
+#define SDB_VERSION	1
+#define SDB_HEADERLEN	(SDB_MAGICLEN + 12)
+#define SDB_NOVALUE	0xffffffffUL
+#define SDB_RECLEN(klen, vlen) ((8 + (klen) + 1 + (vlen) + 3) & ~3UL)
+#define GETNET32(p) \
+    (((unsigned long) ((const unsigned char *) (p))[0] << 24) \
+     | ((unsigned long) ((const unsigned char *) (p))[1] << 16) \
+     | ((unsigned long) ((const unsigned char *) (p))[2] << 8) \
+     | (unsigned long) ((const unsigned char *) (p))[3])
+
+/* a page of a cache index: a sorted run of keyvalue pairs, with the keys
+ * in the form they're compared in
+ */
+typedef struct kvpage {
+    unsigned long count;		/* number of pairs in use */
+    sdb_keyvalue kv[KVPAGE];
+    char *fold[KVPAGE];			/* key, or its folded copy */
+} kvpage;
+
+/* file data and a string pool shared by a cache with the old versions of
+ * its index still being read.  The cache hands them over when it lets go,
+ * and the last reader frees them.
+ */
+typedef struct vstore {
+    int refs;				/* cache and versions using it */
+    const char *base;			/* file data, once handed over */
+    unsigned long len;			/* length of base */
+    int mapped;				/* base is a file mapping */
+    struct mpool *pool;			/* string pool, once handed over */
+} vstore;
+
+/* a version of a cache's index read by open cursors.  It's the cache's
+ * own index until the cache changes or is freed; the version is then
+ * retired with a copy of the index as it was, or the index itself.
+ */
+typedef struct version {
+    int refs;				/* cursors reading the version */
+    int retired;			/* set once it's no longer the cache's */
+    kvpage **page;			/* retired index pages, in key order */
+    unsigned long pagecount;		/* number of retired index pages */
+    vstore *store;			/* data the retired pages point into */
+} version;
+
+/* a file cache, and the handle sdb_open() returns for it */
+typedef struct sdb_db {
+    struct sdb_db *next;		/* next cache, in LRU order */
+    int priv;				/* set for a user's private database */
+    int type;				/* offset of private db type in db */
+    int typelen;			/* length of private db type */
+    int opens;				/* open handles on the cache */
+    unsigned long bytes;		/* approximate memory used by cache */
     char db[MAXDBPATHLEN+1];		/* database name */
     unsigned long mtime;		/* last modified time */
     unsigned short modified : 1;	/* 0 = unmodified, 1 = modified */
     unsigned short loaded : 1;		/* 0 = unloaded, 1 = loaded */
     unsigned short icase : 1;		/* case insensitive flag for cache */
+    unsigned short mapped : 1;		/* base is a file mapping, not malloc'd */
+    unsigned short whole : 1;		/* locked as a whole, not by key */
+    unsigned short watched : 1;		/* a watch has seen no change since load */
     int fd;				/* file descriptor, if locked */
     int locks;				/* number of locks on db */
-    unsigned long cachesize;		/* number of element slots in cache */
+    int pins;				/* number of open cursors on db */
+    version *cur;			/* version cursors read, if any */
+    vstore *shared;			/* data shared with retired versions */
+    unsigned long gen;			/* changed when index pairs move */
+    unsigned long sharegen;		/* gen as sdb_refresh() left it, or 0 */
+    unsigned long peeks;		/* lookups made without loading */
     unsigned long cachecount;		/* number of instantiated elements */
-    sdb_keyvalue *kv;			/* cache element array */
+    kvpage **page;			/* index pages, in key order */
+    unsigned long pagecount;		/* number of index pages */
+    unsigned long pagesize;		/* allocated slots in page array */
+    const char *base;			/* mapped binary file or parsed text file */
+    unsigned long len;			/* length of base */
+    struct mpool *pool;			/* keys and values stored since loading */
+    unsigned long ino;			/* inode of loaded database file */
+    unsigned long size;			/* size of loaded database file */
+    unsigned long logino;		/* inode of replayed log file */
+    unsigned long logpos;		/* bytes of log file replayed */
+    char *log;				/* log records pending until unlock */
+    unsigned long loglen;		/* length of pending log records */
+    unsigned long logsize;		/* allocated size of pending log */
+    int syncpending;			/* SYNC_* files waiting for fsync */
+    unsigned long flushes;		/* log appends and file rewrites */
+    unsigned long syncs;		/* fsyncs of its files */
+    unsigned long synctime;		/* total fsync time, microseconds */
+    unsigned long syncmax;		/* longest fsync, microseconds */
+    struct cyrusdb_backend *backend;	/* storage engine, NULL for our files */
+    struct db *bdb;			/* open storage engine handle */
+    struct txn *tid;			/* engine transaction, if locked */
+    unsigned long fmtino;		/* inode whose format was checked */
 } cache;
 
-/* valid databases and caches */
+/* a cursor over the matches of a key wildcard and value pattern */
+struct sdb_iter {
+    cache *c;				/* pinned cache */
+    version *v;				/* version of the index being read */
+    int flags;				/* case selection flag */
+    char *pat;				/* copy of key pattern */
+    int plen;				/* length of literal prefix of pat */
+    glob *g, *vg;			/* key and value globs, NULL for "*" */
+    unsigned long gen;			/* cache generation of pg and idx */
+    unsigned long pg, idx;		/* index position of next pair */
+    char *last;				/* copy of last key returned */
+    unsigned long lastsize;		/* allocated size of last */
+    int done;				/* set at end of matches */
+};
+
+/* buffered output to a new database file */
+typedef struct wbuf {
+    int fd;				/* output file descriptor */
+    int err;				/* set after a write error */
+    unsigned long len;			/* bytes waiting in buf */
+    char buf[WBUF_SIZE];
+} wbuf;
+
+/* storage engines, recognized by the magic number of their files */
+static struct cyrusdb_backend *backends[] = {
+    &cyrusdb_skiplist, NULL
+};
+
+/* global databases loaded by sdb_refresh(), and the sharded ones */
 static char *globdbstr[] = {
     "options", "mailboxes", "new", "changed", "abooks", NULL
 };
-static char *privdbstr[] = {
-    "options", "mailboxes", "subs", "alock",
-    "abooks", "abook", NULL
+static char *sharddbstr[] = {
+    "abooks", NULL
 };
-#define NUMGDBSTR	(sizeof (globdbstr) / sizeof (char *) - 1)
-#define NUMPDBSTR	(sizeof (privdbstr) / sizeof (char *) - 1)
-#define PDBPREFIXPOS    (NUMPDBSTR - 2)
-static cache globdb[NUMGDBSTR];
-static cache privdb[NUMPDBSTR];
+static hash_table cachetab;		/* caches by canonical database name */
+static cache *cachelist;		/* all caches, most recent first */
+
+#ifdef HAVE_SYS_INOTIFY_H
+/* a watched database directory and the names in it */
+typedef struct watch {
+    struct watch *next;			/* next watch, in LRU order */
+    int wd;				/* watch descriptor, -1 if dir is missing */
+    char **name;			/* names in the directory */
+    int count;				/* number of names */
+    int size;				/* allocated slots in name */
+    char dir[MAXDBPATHLEN+1];		/* directory name */
+} watch;
+
+/* change watches, see sdb_watch() */
+static int watchfd = -1;		/* inotify descriptor, -1 if not watching */
+static int userwd = -1;			/* watch on the private db directory */
+static watch *watchlist;		/* watched directories, most recent first */
+#endif
+
+/* cache limits, see sdb_config() */
+static long sdb_slots = CACHE_SLOTS;
+static long sdb_maxbytes = 0;
+
+/* memory used by all caches, and cache statistics, see sdb_stats() */
+static unsigned long sdb_bytes = 0;
+static sdb_cachestats sdb_counts;
+
+/* durability mode and group commit window, see sdb_config() */
+static int sdb_syncmode = SDB_SYNC_GROUP;
+static long sdb_syncwrites = SYNC_WRITES;
+static long sdb_syncdelay = SYNC_DELAY;
+static long sdb_pending = 0;		/* writes waiting for group commit */
+static time_t sdb_pendtime;		/* time of the first of them */
 
 /* lock file extension */
 static char newext[] = "%s..";
 
+/* log file extension -- database names can't end with a "." */
+static char logext[] = "%s.log.";
+
+/* export file extension, and the name an export is written under */
+static char exportext[] = "%s.export.";
+static char exportnewext[] = "%s.%d.export.";
+
 /* private macro definitions */
 #define CLEANUP_RETURN(x)     do { rtval = x; goto CLEANUP; } while(0)
 
 /* private function prototypes */
 static void freecache(cache *c);
+static int retire(cache *c, int freeing);
 static int writecache(cache *c);
+static int loadcache(cache *c, int flags);
+static int cacheset(cache *c, char *key, int flags, char *value);
+static int cacheremove(cache *c, char *key, int flags);
+static int lockcache(cache *c, int flags, char *key);
+static int unlockcache(cache *c);
+static int compactlog(cache *c);
+static char *poolstrdup(cache *c, char *str);
+static int synccache(cache *c, int what);
+static void logstats(cache *c);
+static int checkformat(cache *c);
+static void closebackend(cache *c);
+static int loadbackend(cache *c, int flags);
+static int commitbackend(cache *c);
+static int flushlog(cache *c);
+static char *poolmemdup(cache *c, const char *data, int len);
 extern int strcasecmp();
+extern int strncasecmp();
 
 extern int imspd_debug;
 
 /*  */
 
-/* free a cache (assume it's unlocked)
+/* drop a reference to data shared with retired versions, freeing it with
+ * the last one
+ */
+static void releasestore(vs)
+    vstore *vs;
+{
+    if (--vs->refs > 0) return;
+    if (vs->pool != NULL) free_mpool(vs->pool);
+    if (vs->mapped) {
+	map_free(&vs->base, &vs->len);
+    } else if (vs->base != NULL) {
+	free((char *) vs->base);
+    }
+    free((char *) vs);
+}
+
+/* drop a cursor's reference to a version of a cache's index
+ */
+static void releaseversion(c, v)
+    cache *c;
+    version *v;
+{
+    if (--v->refs > 0) return;
+    if (!v->retired) {
+	c->cur = NULL;
+    } else {
+	while (v->pagecount) free((char *) v->page[--v->pagecount]);
+	if (v->page != NULL) free((char *) v->page);
+	releasestore(v->store);
+    }
+    free((char *) v);
+}
+
+/* retire the version of a cache's index read by open cursors before the
+ * cache changes it, giving it a copy of the index, or before the cache is
+ * freed, giving it the index itself.  The file data and string pool the
+ * index points into are shared until the cache lets go of them.
+ * returns -1 if the cursors must follow the cache instead, 0 on success
+ */
+static int retire(c, freeing)
+    cache *c;
+    int freeing;			/* I: the cache is about to be freed */
+{
+    version *v = c->cur;
+    kvpage **pages;
+    unsigned long pg;
+
+/* : share the data */
+    if (c->shared == NULL) {
+	c->shared = (vstore *) malloc(sizeof (vstore));
+	if (c->shared == NULL) return (-1);
+	memset((char *) c->shared, '\0', sizeof (vstore));
+	c->shared->refs = 1;
+    }
+
+/* : hand over the index, or copy the pairs in use of each page */
+    if (freeing) {
+	pages = c->page;
+	pg = c->pagecount;
+	c->page = NULL;
+	c->pagecount = 0;
+    } else {
+	pages = NULL;
+	if (c->pagecount) {
+	    pages = (kvpage **) malloc(c->pagecount * sizeof (kvpage *));
+	    if (pages == NULL) return (-1);
+	}
+	for (pg = 0; pg < c->pagecount; ++pg) {
+	    pages[pg] = (kvpage *) malloc(sizeof (kvpage));
+	    if (pages[pg] == NULL) {
+		while (pg) free((char *) pages[--pg]);
+		free((char *) pages);
+		return (-1);
+	    }
+	    pages[pg]->count = c->page[pg]->count;
+	    memcpy((char *) pages[pg]->kv, (char *) c->page[pg]->kv,
+		   pages[pg]->count * sizeof (sdb_keyvalue));
+	    memcpy((char *) pages[pg]->fold, (char *) c->page[pg]->fold,
+		   pages[pg]->count * sizeof (char *));
+	}
+    }
+    v->page = pages;
+    v->pagecount = pg;
+    v->store = c->shared;
+    ++c->shared->refs;
+    v->retired = 1;
+    c->cur = NULL;
+
+    return (0);
+}
+
+/* free a cache.  A locked cache keeps its file descriptor and lock.
+ * Keys and values live in the file data or the string pool, so nothing
+ * needs to be freed element by element.
  */
 
 /* HISTORY
@@ -136,31 +464,62 @@ extern int imspd_debug;
 static void freecache(c)
     cache *c;
 {
-    register int i;			/* loop counter */
-    
     /* sanity checks */
     if (c == NULL) return;
 
-    if (c->kv != NULL) {
+    /* open cursors keep reading the index they started on */
+    if (c->cur != NULL) retire(c, 1);
 
-      /* walk the cache element array freeing elements */
-      for (i = 0; i < c->cachecount; i++) {
-	if (c->kv[i].key != NULL) free(c->kv[i].key);
-	if (c->kv[i].value != NULL) free(c->kv[i].value);
+    /* free the index */
+    if (c->page != NULL) {
+      while (c->pagecount) {
+	free((char *) c->page[--c->pagecount]);
       }
+      free((char *) c->page);
+      c->page = NULL;
+    }
+
+    /* hand the file data and the strings stored since loading to older
+     * versions still being read, or free them
+     */
+    if (c->shared != NULL) {
+      c->shared->base = c->base;
+      c->shared->len = c->len;
+      c->shared->mapped = c->mapped;
+      c->shared->pool = c->pool;
+      releasestore(c->shared);
+      c->shared = NULL;
+      c->pool = NULL;
+      c->mapped = 0;
+      c->base = NULL;
+    }
+    if (c->pool != NULL) {
+      free_mpool(c->pool);
+      c->pool = NULL;
+    }
 
-      /* free the cache array */
-      free((char *)c->kv);
-      c->kv = NULL;
+    /* release the file data */
+    if (c->mapped) {
+      map_free(&c->base, &c->len);
+      c->mapped = 0;
+    } else if (c->base != NULL) {
+      free((char *) c->base);
     }
+    c->base = NULL;
+    c->len = 0;
 
     /* reset cache counts to 0 */
     c->cachecount = 0;
-    c->cachesize = 0;
+    c->pagesize = 0;
+    sdb_bytes -= c->bytes;
+    c->bytes = 0;
+    ++c->gen;
 
     /* reset cache state to unloaded */
     c->modified = 0;
     c->loaded = 0;
+    c->watched = 0;
+    if (c->locks > 0) return;
     if (c->fd != -1) {
       if (c->fd < 3) {
 	if (c->fd != 0) { /* this stuff may be uninitialzed soo... */
@@ -171,685 +530,3760 @@ static void freecache(c)
       }
     }
     c->fd = -1;
-    if (c->locks > 0) {
-      fprintf(stderr,"Shouldn't free cache %s - %d locks still active\n", 
-	      c->db, c->locks);
-    }
 }
 
 /*  */
 
-/* find a cache by its name
- */
-
 /* NOTES
- * There are two cache tables that contain cache datastructures for supported
- * databases: global cache and private cache.   Global cache contains cached global
- * databases like the generic options, mailbox lists etc.   Private cache contains
- * databases like user defined address books.
- *
- * -- DEVELOPER ATTENTION --
- * The current algorithm supports only one cached addressbook database at a time.
- * If a request comes for an addressbook database that is not loaded, then the
- * currently loaded addressbook entry is flushed, and the requested one is loaded.
- * The cache table should be changed to maintain a list of "loaded" databases.
- * This will dramatically improve the performance of copying entries between
- * addressbooks on the same server.
+ * A server process watches the database directories it uses with inotify
+ * once sdb_watch() is called.  A cache whose files no watch has seen
+ * change since it was loaded is current, and the names in a watched
+ * directory tell which databases exist, so neither needs a stat() of the
+ * files on each access.  The watch descriptor doesn't block, so waiting
+ * events are read as a cache is accessed, in one read() that returns at
+ * once when nothing has changed.  A directory is
+ * watched from the first time one of its databases is checked, the least
+ * recently used watch making room for it past WATCH_DIRS.  A user
+ * directory that doesn't exist is known to be missing for as long as the
+ * watch on the "user" directory doesn't see it created.  When the event
+ * queue overflows, every watch is dropped and caches check their files
+ * until their directories are watched again.
  * END NOTES */
 
-/* HISTORY
- * IncrDev Feb 27, 1996 by sh: to flush modified private cache databases
- * END HISTORY */
-
-static cache *findcache(db)
-    char *db;
+#ifdef HAVE_SYS_INOTIFY_H
+/* forget that a cache is current if it's kept in a directory, or is a file
+ * in it, or its log
+ */
+static void watchforget1(c, dir, len, name, nlen)
+    cache *c;
+    char *dir;
+    unsigned long len;			/* I: length of dir */
+    char *name;				/* I: file name, NULL for any */
+    unsigned long nlen;			/* I: length of name without ".log." */
 {
-    char *scan;
-    int i;
-    
-/* : try to load a private cache database */
-    if (!strncmp(db, PRIVPREFIX, PRIVPREFIXLEN) && db[PRIVPREFIXLEN] == '/') {
-
-/* : - pick off the private name */
-	scan = strchr(db + PRIVPREFIXLEN + 1, '/');
-	if (scan == NULL) return (NULL);
-	++scan;
+    char *rest;
 
-/* : - walk the private database table matching the name */
-	for (i = 0; privdbstr[i]; ++i) {
-
-	    if (!strcmp(scan, privdbstr[i]) ||
-		(i >= PDBPREFIXPOS
-		 && !strncmp(scan, privdbstr[i], strlen(privdbstr[i])))) {
+    if (strncmp(c->db, dir, len) || c->db[len] != '/') return;
+    rest = c->db + len + 1;
+    if (name == NULL || (strlen(rest) == nlen && !strncmp(rest, name, nlen))) {
+	c->watched = 0;
+    }
+}
 
-/* : -- if this is not the correct instance of the private database then flush it and get the right one */
-		if (strcmp(privdb[i].db + PREFIXLEN + 1, db)) {
-		    if (privdb[i].locks > 0) return (NULL);
-		    if (privdb[i].modified) {
-			writecache(&privdb[i]);
-		    }
-		    freecache(&privdb[i]);
-		    snprintf(privdb[i].db, sizeof(privdb[i].db), "%s/%s", PREFIX, db);
-		}
-		return (&privdb[i]);
-	    }
+/* forget that the caches kept in a directory, or of one file in it, are
+ * current
+ */
+static void watchforget(dir, name)
+    char *dir;
+    char *name;				/* I: file name, NULL for all */
+{
+    cache *c;
+    unsigned long len, nlen;
+
+    len = strlen(dir);
+    nlen = 0;
+    if (name != NULL) {
+	nlen = strlen(name);
+	if (nlen > sizeof (logext) - 3
+	    && !strcmp(name + nlen - (sizeof (logext) - 3), logext + 2)) {
+	    nlen -= sizeof (logext) - 3;
 	}
-	return (NULL);
     }
-    for (i = 0; globdbstr[i]; ++i) {
-	if (!strcmp(db, globdbstr[i])) {
-	    snprintf(globdb[i].db, sizeof(globdb[i].db), "%s/%s", PREFIX, db);
-	    return (&globdb[i]);
-	}
+    for (c = cachelist; c != NULL; c = c->next) {
+	watchforget1(c, dir, len, name, nlen);
     }
-    return (NULL);
 }
 
-/*  */
-
-/* key compare functions for the sdb_keyvalue structure
+/* find the watch on a directory, making it the most recently used
  */
-static int keycmp(kv1, kv2)
-    sdb_keyvalue *kv1, *kv2;
+static watch *watchfind(dir)
+    char *dir;
 {
-    return (strcmp(kv1->key, kv2->key));
+    watch *w, *prev;
+
+    for (prev = NULL, w = watchlist; w != NULL; prev = w, w = w->next) {
+	if (!strcmp(w->dir, dir)) break;
+    }
+    if (w != NULL && prev != NULL) {
+	prev->next = w->next;
+	w->next = watchlist;
+	watchlist = w;
+    }
+
+    return (w);
 }
-static int ikeycmp(kv1, kv2)
-    sdb_keyvalue *kv1, *kv2;
+
+/* stop watching a directory, forgetting what it told about its caches
+ */
+static void watchdrop(w)
+    watch *w;
 {
-    return (strcasecmp(kv1->key, kv2->key));
-}
+    watch *prev;
 
-/*  */
+    if (watchlist == w) {
+	watchlist = w->next;
+    } else {
+	for (prev = watchlist; prev->next != w; prev = prev->next);
+	prev->next = w->next;
+    }
+    if (w->wd != -1) inotify_rm_watch(watchfd, w->wd);
+    watchforget(w->dir, NULL);
+    while (w->count) free(w->name[--w->count]);
+    if (w->name != NULL) free((char *) w->name);
+    free((char *) w);
+}
 
-/* parse the data in the cache database file into the cache
+/* add a name to, or remove it from, the names in a watched directory
  * returns -1 on failure, 0 on success
  */
+static int watchname(w, name, add)
+    watch *w;
+    char *name;
+    int add;				/* I: non-zero to add the name */
+{
+    int i;
+    char **names;
 
-/* HISTORY
- * IncrDev Feb 21, 1996 by sh: rewrote it to allocate parsed key/value pairs
- * IncrDev Feb 21, 1996 by sh: changed contract to accept data buffer
- * END HISTORY */
+    for (i = 0; i < w->count && strcmp(w->name[i], name); ++i);
+    if (!add) {
+	if (i < w->count) {
+	    free(w->name[i]);
+	    w->name[i] = w->name[--w->count];
+	}
+	return (0);
+    }
+    if (i < w->count) return (0);
+    if (w->count == w->size) {
+	i = w->size ? w->size * 2 : 16;
+	if (w->name == NULL) {
+	    names = (char **) malloc(i * sizeof (char *));
+	} else {
+	    names = (char **) realloc((char *) w->name, i * sizeof (char *));
+	}
+	if (names == NULL) return (-1);
+	w->name = names;
+	w->size = i;
+    }
+    if ((w->name[w->count] = strdup(name)) == NULL) return (-1);
+    ++w->count;
 
-static int parsecache(c, data, flags)
-  cache *c;				/* U: cache to parse into */
-  char* data;				/* I: database data buffer */
-  int flags;				/* I: case insensitive if non-zero */
-{
-    int sorted;				/* source file was sorted if 1 */
-    long lines;				/* number of lines in data */
-    long size;				/* allocation size in bytes */
-    char* scan;				/* source data scan pointer */
-    char* dst;				/* destination data write pointer */
-    char* token;			/* current token */
-    char savech;			/* temporary save character */
-    sdb_keyvalue *kv;			/* current keyvalue in cache */
-    int (*cmpf)();			/* sort comparison function */
+    return (0);
+}
 
-/* : initialization */
-    lines = 0;
-    sorted = 1;
-    cmpf = (flags & SDB_ICASE) ? strcasecmp : strcmp;
+/* start watching a directory and list the names in it.  A missing user
+ * directory is watched through the "user" directory.
+ * returns NULL if the directory can't be watched
+ */
+static watch *watchadd(dir)
+    char *dir;
+{
+    watch *w, *last;
+    DIR *d;
+    struct dirent *de;
+    int count, len;
+
+/* : make room by dropping the least recently used watch */
+    count = 0;
+    for (last = watchlist; last != NULL; last = last->next) {
+	if (++count == WATCH_DIRS) {
+	    watchdrop(last);
+	    break;
+	}
+    }
 
-/* : count the number of lines in the database data */
-    lines = 0;
-    for (scan = data; *scan != '\0'; scan++) {
-	if (*scan == '\n') lines++;
+    w = (watch *) malloc(sizeof (watch));
+    if (w == NULL) return (NULL);
+    memset((char *) w, '\0', sizeof (watch));
+    snprintf(w->dir, sizeof(w->dir), "%s", dir);
+    w->next = watchlist;
+    watchlist = w;
+
+/* : the watch goes on before the names are read, so no change is missed */
+    w->wd = inotify_add_watch(watchfd, dir, WATCH_EVENTS);
+    if (w->wd < 0) {
+	w->wd = -1;
+	len = PREFIXLEN + PRIVPREFIXLEN + 2;
+	if (errno != ENOENT || userwd == -1
+	    || strncmp(dir, PREFIX "/" PRIVPREFIX "/", len)
+	    || strchr(dir + len, '/') != NULL) {
+	    watchdrop(w);
+	    return (NULL);
+	}
+	return (w);
+    }
+    if ((d = opendir(dir)) == NULL) {
+	watchdrop(w);
+	return (NULL);
     }
+    while ((de = readdir(d)) != NULL) {
+	if (de->d_name[0] == '.') continue;
+	if (watchname(w, de->d_name, 1) < 0) {
+	    closedir(d);
+	    watchdrop(w);
+	    return (NULL);
+	}
+    }
+    closedir(d);
 
-/* : make sure that we count a line without a linefeed at the end */
-    if (*(scan-1) != '\n') ++lines;
+    return (w);
+}
 
-/* : CLAIM - the number of lines in the data is equivalent to the number of
-     key value pairs in the database.   We can base the size of the cache on
-     that value.   In fact, when we allocate the array, we allocate the required
-     number of slots plus a CACHE_INCREMENT that allows for growth of the cache
-     from new keyvalue pairs. */
-/* : allocate space for the cache array */
-    size = ((lines + CACHE_INCREMENT) * sizeof(sdb_keyvalue));
-    kv = (sdb_keyvalue *) malloc(size);
-    if (kv == NULL) {
-	return (-1);
-    }
-    c->kv = kv;
-    c->cachecount = lines;
-    c->cachesize = lines + CACHE_INCREMENT;
+/* apply the events waiting on the watch descriptor
+ */
+static void watchdrain()
+{
+    long buf[WATCH_BUF / sizeof (long)];	/* aligned event buffer */
+    struct inotify_event *ev;		/* current event */
+    char *scan, *end;			/* current event and end of events */
+    watch *w, *next;			/* watch of the event */
+    int n;				/* bytes of events read */
+    char dir[MAXDBPATHLEN+1];		/* user directory name buffer */
+
+    while ((n = read(watchfd, (char *) buf, sizeof (buf))) > 0) {
+	for (scan = (char *) buf, end = scan + n; scan < end;
+	     scan += sizeof (struct inotify_event) + ev->len) {
+	    ev = (struct inotify_event *) scan;
+
+/* : - an overflowed queue leaves nothing known */
+	    if (ev->mask & IN_Q_OVERFLOW) {
+		while (watchlist != NULL) watchdrop(watchlist);
+		continue;
+	    }
 
-/* : walk each line in the data parsing key value pairs */
-    scan = data;
-    for (kv = c->kv; lines; --lines, ++kv) {
+/* : - a user directory was created or removed, or the "user" directory
+       itself went away */
+	    if (userwd != -1 && ev->wd == userwd) {
+		if (ev->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+		    userwd = -1;
+		    for (w = watchlist; w != NULL; w = next) {
+			next = w->next;
+			if (w->wd == -1) watchdrop(w);
+		    }
+		} else if (ev->len) {
+		    snprintf(dir, sizeof(dir), "%s/%s/%s", PREFIX, PRIVPREFIX,
+			     ev->name);
+		    if ((w = watchfind(dir)) != NULL) watchdrop(w);
+		}
+		continue;
+	    }
 
-/* : - parse the key, handling quoted characters */
-	token = scan;
-	for (dst = scan; (*scan != ' ') && (*scan != '\n') && (*scan != '\0'); scan++) {
-	    if (*scan == '\\') {
-		if (*++scan == 'n') {
-		    *dst++ = '\n';
-		    continue;
-		} else if (*scan == 's') {
-		    *dst++ = ' ';
+/* : - a file in a watched directory changed, or the directory went away */
+	    for (w = watchlist; w != NULL; w = w->next) {
+		if (w->wd != -1 && w->wd == ev->wd) break;
+	    }
+	    if (w == NULL) continue;
+	    if (ev->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+		watchdrop(w);
+	    } else if (ev->len) {
+		if ((ev->mask & (IN_CREATE | IN_MOVED_TO))
+		    && watchname(w, ev->name, 1) < 0) {
+		    watchdrop(w);
 		    continue;
 		}
+		if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+		    watchname(w, ev->name, 0);
+		}
+		watchforget(w->dir, ev->name);
 	    }
-	    *dst++ = *scan;
 	}
+    }
 
-/* : - save the current scan character and write a NUL terminator to the parsed string */
-	savech = *scan;
-	*dst = '\0';			/* this may overwrite *scan */
+/* : an interrupted read is retried next time, a failed one leaves nothing
+     known */
+    if (n < 0 && errno != EAGAIN && errno != EINTR) {
+	while (watchlist != NULL) watchdrop(watchlist);
+    }
+}
 
-/* : - copy the parsed key to the keyvalue pair */
-	kv->key = strdup(token);
-	if (kv->key == NULL) {
-	    return(-1);
-	}
+/* find or start the watch on the directory of a database file
+ * returns NULL if the directory isn't watched
+ */
+static watch *watchdir(path)
+    char *path;
+{
+    watch *w;
+    char *slash;
+    char dir[MAXDBPATHLEN+1];
+
+    if (watchfd == -1) return (NULL);
+    watchdrain();
+    snprintf(dir, sizeof(dir), "%s", path);
+    if ((slash = strrchr(dir, '/')) == NULL) return (NULL);
+    *slash = '\0';
+    if ((w = watchfind(dir)) == NULL) w = watchadd(dir);
+
+    return (w);
+}
 
-/* : - restore the saved scan character */
-	*scan = savech;
+/* check if a loaded cache is still current without looking at its files
+ * returns 1 if no change to its files has been seen since it was loaded
+ */
+static int watchcurrent(c)
+    cache *c;
+{
+    if (watchfd == -1) return (0);
+    watchdrain();
 
-/* : - if at end of line or string then set the value to NULL */
-	if ((*scan == '\n') || (*scan == '\0')) {
-	    kv->value = NULL;
-	}
-	
-/* : - else parse the value, handling quoted characters */
-	else {
-	    ++scan;
-	    token = scan;
-	    for (dst = scan; (*scan != '\n') && (*scan != '\0'); ++scan) {
-		if (*scan == '\\') {
-		    if (*++scan == 'n') {
-			*dst++ = '\n';
-			continue;
-		    } else if (*scan == 's') {
-			*dst++ = ' ';
-			continue;
-		    }
-		}
-		*dst++ = *scan;
-	    }
-	    *dst = '\0';
+    return (c->watched);
+}
 
-/* : - copy the parsed value to the keyvalue pair */
-	    kv->value = strdup(token);
-	    if (kv->value == NULL) {
-		return(-1);
-	    }
-	}
+/* watch the files of a cache before they're checked
+ * returns 1 if the cache can be trusted once loaded, until a change is seen
+ */
+static int watchcache(c)
+    cache *c;
+{
+    watch *w;
 
-/* : - move scan to the start of the next line */
-	scan++;
+    c->watched = 0;
+    w = watchdir(c->db);
 
-/* : - check to make sure that the data is sorted */
-	if (sorted && (kv != c->kv) && ((*cmpf)(kv[-1].key, kv->key) > 0)) {
-	    sorted = 0;
-	}
-    }
+    return (w != NULL && w->wd != -1);
+}
 
-/* : sort it, only if necessary */
-    if (!sorted) {
-	qsort(c->kv, c->cachecount, sizeof (sdb_keyvalue),
-	      (flags & SDB_ICASE) ? ikeycmp : keycmp);
+/* look up the existence of a database file in a watched directory
+ * returns -1 if it isn't known, 0 if the file doesn't exist, 1 if it does
+ */
+static int watchexists(path)
+    char *path;
+{
+    watch *w;
+    char *name;
+    int i;
+
+    if ((w = watchdir(path)) == NULL) return (-1);
+    if (w->wd == -1) return (0);
+    name = strrchr(path, '/') + 1;
+    for (i = 0; i < w->count; ++i) {
+	if (!strcmp(w->name[i], name)) return (1);
     }
 
-/* : return success */
-    return(0);
+    return (0);
 }
+#else
+#define watchcurrent(c)		0
+#define watchcache(c)		0
+#define watchexists(path)	(-1)
+#endif
 
 /*  */
 
-/* load a cache from database file
- * returns -1 on error, 0 on success
+/* find a cache by its name
  */
 
+/* NOTES
+ * Every database that has been used is kept in one table of caches, hashed
+ * by its canonical name, which is the name relative to /var/imsp: "options"
+ * or "abooks.3" for a global database, "user/<name>/<db>" for one of a
+ * user's private databases.  Any name of that form will do, so a new kind
+ * of database needs no code here.  A name is canonical if no part of it is
+ * empty or starts or ends with '.', which keeps names out of each other's
+ * way and away from the ".log." and other files kept next to a database.
+ *
+ * The caches also form a list in least recently used order.  At most
+ * sdb_slots private databases of each type (the part of the private name
+ * up to the first '.', like "abook" or "options") are kept, and the least
+ * recently used unlocked one is dropped when a new one would pass that.
+ * This lets a client switch between, or copy entries between, several
+ * address books without reloading them each time.
+ *
+ * Every allocation a cache makes is charged to it and to sdb_bytes, the
+ * total for the process.  Once the total passes sdb_maxbytes, sdb_trim()
+ * frees unlocked caches until it's back under: the one with the most
+ * memory times its place in the list goes first, so a large book that
+ * hasn't been read for a while is freed before a small one used a moment
+ * ago.  A global database, or one with an open handle, keeps its entry and
+ * only loses its memory.  Global caches still as sdb_refresh() loaded them
+ * are shared with the parent process, so they don't count against the
+ * limit and aren't freed.  Since freeing a cache invalidates what
+ * sdb_match() returned from it without copying, the server only calls
+ * sdb_trim() between commands.
+ *
+ * Unlocked caches never hold changes that aren't on disk, but a cache
+ * whose log hasn't been folded into its file would have to replay it when
+ * loaded again.  The log is folded, as sdb_flush() does, before such a
+ * cache is freed.  Databases with open cursors are kept.
+ *
+ * sdb_open() returns the cache itself as a handle, so the sdb_db* calls
+ * skip finding it by name.
+ * END NOTES */
+
 /* HISTORY
- * IncrDev Feb 21, 1996 by sh: completely rewrote it to use new cache structure
+ * IncrDev Feb 27, 1996 by sh: to flush modified private cache databases
  * END HISTORY */
 
-static int loadcache(c, flags)
-    cache *c;
-    int flags;
+/* test if two private caches are of the same type
+ */
+static int sametype(c1, c2)
+    cache *c1, *c2;
 {
-    struct stat stbuf;			/* file statistics buffer */
-    int fd;				/* database file descriptor */
-    int fdl;				/* lock file descriptor */
-    int rtval;				/* return value */
-    int count;				/* number of characters read from file */
-    char* data;				/* raw (unparsed) database data */
-    char lname[MAXDBPATHLEN + 5];	/* lock file name buffer */
+    return (c1->typelen == c2->typelen
+	    && !strncmp(c1->db + c1->type, c2->db + c2->type, c1->typelen));
+}
 
-/* : initialization */
-    data = NULL;
-    rtval = 0;
+/* free a cache that's no longer used, writing anything it has pending
+ */
+static void dropcache(c)
+    cache *c;
+{
+    cache **prev;
 
-/* : quit if the cache is loaded and we don't care if it's stale */
-    if (c->loaded && (flags & SDB_QUICK)) {
-	return (0);
+    if (c->locks && c->backend != NULL) {
+	commitbackend(c);
+	c->locks = 0;
+    } else if (c->locks) {
+	flushlog(c);
+	lock_unlock(c->fd);
+	close(c->fd);
+	c->fd = -1;
+	c->locks = 0;
+	c->whole = 0;
     }
+    if (c->syncpending) synccache(c, c->syncpending);
+    logstats(c);
+    freecache(c);
+    closebackend(c);
+    if (c->opens) return;
 
-/* : quit if we can't stat the database file */
-    if (stat(c->db, &stbuf) < 0) {
-      if (imspd_debug) {
-	fprintf(stderr,"%s: ", c->db);
-	perror("failed to stat cache buffer");
-      }
-      return(-1);
-    }
+    for (prev = &cachelist; *prev != c; prev = &(*prev)->next);
+    *prev = c->next;
+    hash_del(c->db + PREFIXLEN + 1, &cachetab);
+    free((char *) c);
+}
 
-/* : quit if the cache is up to date */
-    if ((c->loaded == 1) && ((flags & SDB_ICASE) == c->icase)
-	&& (stbuf.st_mtime == c->mtime)) {
-	return(0);
+/* fold the log of a loaded cache into its file before the cache is freed,
+ * so it needn't be replayed when the database is loaded again
+ */
+static void writeback(c)
+    cache *c;
+{
+    if (!c->loaded || c->backend != NULL || !c->logpos) return;
+    if (lockcache(c, c->icase, NULL) == 0) {
+	if (c->logpos && compactlog(c) == 0) ++sdb_counts.writebacks;
+	unlockcache(c);
     }
+}
 
-/* : free any existing cache structure */
-    freecache(c);
+/* trim the private caches of keep's type back to sdb_slots, never
+ * dropping "keep"
+ */
+static void trimcache(keep)
+    cache *keep;
+{
+    cache *c, *victim;
+    long slots;
+
+    for (;;) {
+/* : count the slots of this type */
+	slots = 0;
+	for (c = cachelist; c != NULL; c = c->next) {
+	    if (c->priv && sametype(c, keep)) ++slots;
+	}
+	if (slots <= sdb_slots) return;
+
+/* : pick the least recently used unlocked one */
+	victim = NULL;
+	for (c = cachelist; c != NULL; c = c->next) {
+	    if (c->priv && c != keep && c->locks == 0 && c->pins == 0
+		&& c->opens == 0 && sametype(c, keep)) {
+		victim = c;
+	    }
+	}
+	if (victim == NULL) return;
 
-/* : if the database file is 0 length then the refresh is complete */
+/* : write it back and drop it */
+	writeback(victim);
+	++sdb_counts.evictions;
+	dropcache(victim);
+    }
+}
+
+/* check that a database name is canonical
+ * returns 1 for a global database, 2 for a private one, 0 if it's invalid
+ */
+static int checkname(db)
+    char *db;
+{
+    char *scan, *part;
+    int parts, len;
+
+    len = strlen(db);
+    if (len == 0 || len > MAXDBLEN) return (0);
+    parts = 0;
+    for (part = scan = db; ; ++scan) {
+	if (*scan != '/' && *scan != '\0') continue;
+	if (scan == part || *part == '.' || scan[-1] == '.') return (0);
+	++parts;
+	if (*scan == '\0') break;
+	part = scan + 1;
+    }
+    if (!strncmp(db, PRIVPREFIX, PRIVPREFIXLEN) && db[PRIVPREFIXLEN] == '/') {
+	return (parts == 3 ? 2 : 0);
+    }
+
+    return (parts == 1 && strcmp(db, PRIVPREFIX) ? 1 : 0);
+}
+
+/* find the cache of a database by its canonical name, adding one if the
+ * name is new
+ * returns NULL if the name isn't canonical
+ */
+static cache *findcache(db)
+    char *db;
+{
+    char *type;
+    int kind;
+    cache *c, **prev;
+
+/* : look the name up, and make the cache the most recently used */
+    if (cachetab.size == 0) construct_hash_table(&cachetab, CACHE_BUCKETS);
+    if ((c = (cache *) hash_lookup(db, &cachetab)) != NULL) {
+	if (cachelist != c) {
+	    for (prev = &cachelist; *prev != c; prev = &(*prev)->next);
+	    *prev = c->next;
+	    c->next = cachelist;
+	    cachelist = c;
+	}
+	return (c);
+    }
+    if ((kind = checkname(db)) == 0) return (NULL);
+
+/* : add a cache for it, making room for it if it's private */
+    c = (cache *) malloc(sizeof (cache));
+    if (c == NULL) return (NULL);
+    memset((char *) c, '\0', sizeof (cache));
+    c->fd = -1;
+    snprintf(c->db, sizeof(c->db), "%s/%s", PREFIX, db);
+    if (kind == 2) {
+	type = strrchr(db, '/') + 1;
+	c->priv = 1;
+	c->type = PREFIXLEN + 1 + (type - db);
+	c->typelen = strcspn(type, ".");
+    }
+    hash_insert(db, (void *) c, &cachetab);
+    c->next = cachelist;
+    cachelist = c;
+    if (c->priv) trimcache(c);
+
+    return (c);
+}
+
+/* open a handle on a database by name, as for sdb_check.  The database
+ * need not exist yet.
+ * returns NULL if the name isn't valid
+ */
+sdb_db *sdb_open(db)
+    char *db;
+{
+    cache *c;
+
+    if ((c = findcache(db)) != NULL) ++c->opens;
+
+    return (c);
+}
+
+/* close a handle returned by sdb_open
+ */
+void sdb_close(h)
+    sdb_db *h;
+{
+    if (h != NULL && h->opens > 0) --h->opens;
+}
+
+/*  */
+
+/* key compare functions for the sdb_keyvalue structure
+ */
+static int keycmp(kv1, kv2)
+    sdb_keyvalue *kv1, *kv2;
+{
+    return (strcmp(kv1->key, kv2->key));
+}
+static int ikeycmp(kv1, kv2)
+    sdb_keyvalue *kv1, *kv2;
+{
+    return (strcasecmp(kv1->key, kv2->key));
+}
+
+/*  */
+
+/* NOTES
+ * A cache's keyvalue pairs are kept in sorted pages of up to KVPAGE pairs,
+ * reached through an array of page pointers in key order -- a two level
+ * B+tree.  A key is found by a binary search of the pages' first keys and
+ * then of one page.  Adding or removing a key moves the pairs of one page
+ * and, when a page splits or empties, the page pointers, rather than every
+ * later pair in the database.  Pages are never left empty.
+ *
+ * Next to each key, a page keeps the form it's compared in.  For a case
+ * insensitive cache that's a copy folded to lower case in the string pool,
+ * made when the pair enters the index, or the key itself if it has no
+ * upper case letters.  A key being looked up is folded once, and the
+ * searches compare with strcmp(), which sorts folded keys the way
+ * strcasecmp() sorts the keys.
+ * END NOTES */
+
+/* get the form a key entering the index is compared in
+ * returns NULL on failure
+ */
+static char *foldkey(c, key)
+    cache *c;
+    char *key;
+{
+    char *scan, *fold;
+
+    if (!c->icase) return (key);
+    for (scan = key; *scan && TOLOWER(*scan) == (unsigned char) *scan;
+	 ++scan);
+    if (*scan == '\0') return (key);
+    if ((fold = poolstrdup(c, key)) == NULL) return (NULL);
+    for (scan = fold + (scan - key); *scan; ++scan) *scan = TOLOWER(*scan);
+
+    return (fold);
+}
+
+/* fold the first len characters of a key being looked up the way the index
+ * keys of the cache are, into buf if they fit in FOLD_BUF bytes
+ * returns the folded key, which is key itself if it needs no folding and
+ * must be freed if it's neither key nor buf, or NULL on failure
+ */
+static char *foldsearch(c, key, len, buf)
+    cache *c;
+    char *key;
+    unsigned long len;
+    char *buf;
+{
+    unsigned long i;
+    char *fold;
+
+    if (!c->icase) return (key);
+    for (i = 0; i < len && TOLOWER(key[i]) == (unsigned char) key[i]; ++i);
+    if (i == len) return (key);
+    fold = len < FOLD_BUF ? buf : malloc(len + 1);
+    if (fold == NULL) return (NULL);
+    for (i = 0; i < len; ++i) fold[i] = TOLOWER(key[i]);
+    fold[len] = '\0';
+
+    return (fold);
+}
+#define FOLDFREE(fold, key, buf) \
+    if ((fold) != (key) && (fold) != (buf)) free(fold)
+
+/* add an empty index page at position pos of the page array
+ * returns -1 on failure, 0 on success
+ */
+static int addpage(c, pos)
+    cache *c;
+    unsigned long pos;
+{
+    unsigned long size;
+    kvpage **pages;
+
+    if (c->pagecount == c->pagesize) {
+	size = c->pagesize ? c->pagesize * 2 : 4;
+	if (c->page == NULL) {
+	    pages = (kvpage **) malloc(size * sizeof (kvpage *));
+	} else {
+	    pages = (kvpage **) realloc((char *) c->page,
+					size * sizeof (kvpage *));
+	}
+	if (pages == NULL) return (-1);
+	c->page = pages;
+	CHARGE(c, (size - c->pagesize) * sizeof (kvpage *));
+	c->pagesize = size;
+    }
+    memmove((char *) (c->page + pos + 1), (char *) (c->page + pos),
+	    (c->pagecount - pos) * sizeof (kvpage *));
+    c->page[pos] = (kvpage *) malloc(sizeof (kvpage));
+    if (c->page[pos] == NULL) {
+	memmove((char *) (c->page + pos), (char *) (c->page + pos + 1),
+		(c->pagecount - pos) * sizeof (kvpage *));
+	return (-1);
+    }
+    c->page[pos]->count = 0;
+    ++c->pagecount;
+    CHARGE(c, sizeof (kvpage));
+
+    return (0);
+}
+
+/* find a key in the cache index.  On return, *pg and *idx are the position
+ * of the key, or the position it should be inserted at.
+ * returns 0 if the key was found, 1 if it wasn't, -1 on failure
+ */
+static int kvlocate(c, key, pg, idx)
+    cache *c;
+    char *key;
+    unsigned long *pg, *idx;
+{
+    long top, bot, mid;
+    int cmp;
+    unsigned long p;
+    kvpage *page;
+    char *fkey;				/* key folded like the index keys */
+    char buf[FOLD_BUF];			/* buffer for a short folded key */
+
+    *pg = *idx = 0;
+    if (c->pagecount == 0) return (1);
+    if ((fkey = foldsearch(c, key, strlen(key), buf)) == NULL) return (-1);
+
+/* : find the last page starting at or before the key */
+    p = 0;
+    bot = 0;
+    top = c->pagecount - 1;
+    cmp = 1;
+    while (bot <= top) {
+	mid = (bot + top) >> 1;
+	cmp = strcmp(fkey, c->page[mid]->fold[0]);
+	if (cmp < 0) {
+	    top = mid - 1;
+	} else {
+	    p = mid;
+	    if (cmp == 0) break;
+	    bot = mid + 1;
+	}
+    }
+    *pg = p;
+
+/* : search that page for the key or the slot it belongs in */
+    if (cmp != 0) {
+	page = c->page[p];
+	bot = 0;
+	top = page->count - 1;
+	while (bot <= top
+	       && (cmp = strcmp(fkey, page->fold[mid = (bot + top) >> 1]))) {
+	    if (cmp < 0) {
+		top = mid - 1;
+	    } else {
+		bot = mid + 1;
+	    }
+	}
+	*idx = cmp ? bot : mid;
+    }
+    FOLDFREE(fkey, key, buf);
+
+    return (cmp != 0);
+}
+
+/* find a key in the cache index
+ * returns the keyvalue pair, or NULL if the key isn't there
+ */
+static sdb_keyvalue *kvfind(c, key)
+    cache *c;
+    char *key;
+{
+    unsigned long pg, idx;
+
+    if (kvlocate(c, key, &pg, &idx)) return (NULL);
+
+    return (c->page[pg]->kv + idx);
+}
+
+/* find the first key in the cache index that doesn't sort before the first
+ * len characters of key, which is folded like the index keys.  Keys
+ * sharing a prefix are adjacent in either sort order, so if any key starts
+ * with the prefix, *pg and *idx are set to the position of the first one.
+ */
+static void kvseek(c, key, len, pg, idx)
+    cache *c;
+    char *key;
+    int len;
+    unsigned long *pg, *idx;
+{
+    long top, bot, mid;
+    unsigned long p;
+    kvpage *page;
+
+    *pg = *idx = 0;
+    if (c->pagecount == 0) return;
+
+/* : find the last page starting before the prefix */
+    p = 0;
+    bot = 0;
+    top = c->pagecount - 1;
+    while (bot <= top) {
+	mid = (bot + top) >> 1;
+	if (strncmp(key, c->page[mid]->fold[0], len) <= 0) {
+	    top = mid - 1;
+	} else {
+	    p = mid;
+	    bot = mid + 1;
+	}
+    }
+
+/* : find the first key in that page not before the prefix.  If there
+     isn't one, the range starts with the next page */
+    page = c->page[p];
+    bot = 0;
+    top = page->count - 1;
+    while (bot <= top) {
+	mid = (bot + top) >> 1;
+	if (strncmp(key, page->fold[mid], len) <= 0) {
+	    top = mid - 1;
+	} else {
+	    bot = mid + 1;
+	}
+    }
+    *pg = p;
+    *idx = bot;
+    if (bot == page->count) {
+	++*pg;
+	*idx = 0;
+    }
+}
+
+/* find the keys in the cache index that start with the first len
+ * characters of key, which is folded like the index keys.  On return *pg
+ * and *idx are the position of the first of them.
+ * returns the number of keys with the prefix
+ */
+static unsigned long kvprefix(c, key, len, pg, idx)
+    cache *c;
+    char *key;
+    int len;
+    unsigned long *pg, *idx;
+{
+    unsigned long p, i, n, count;
+    kvpage *page;
+
+    kvseek(c, key, len, pg, idx);
+
+/* : count the keys in the range */
+    count = 0;
+    for (p = *pg, i = *idx; p < c->pagecount; ++p, i = 0) {
+	page = c->page[p];
+	for (n = i; n < page->count; ++n, ++count) {
+	    if (strncmp(key, page->fold[n], len)) return (count);
+	}
+    }
+
+    return (count);
+}
+
+/* add a pair for a key at a position found by kvlocate(), copying the key
+ * to the string pool.  The value is left for the caller to set.
+ * returns the new pair, or NULL on failure
+ */
+static sdb_keyvalue *kvinsert(c, pg, idx, key)
+    cache *c;
+    unsigned long pg, idx;
+    char *key;
+{
+    kvpage *page, *next;
+    char *fold;
+
+    if ((key = poolstrdup(c, key)) == NULL
+	|| (fold = foldkey(c, key)) == NULL) {
+	return (NULL);
+    }
+    if (c->cur != NULL) retire(c, 0);
+    if (c->pagecount == 0 && addpage(c, 0L) < 0) return (NULL);
+
+/* : a full page either starts a new one (when adding past its end, as a
+     sorted load does) or is split in half */
+    page = c->page[pg];
+    if (page->count == KVPAGE) {
+	if (addpage(c, pg + 1) < 0) return (NULL);
+	if (idx == KVPAGE) {
+	    ++pg;
+	    idx = 0;
+	} else {
+	    next = c->page[pg + 1];
+	    next->count = KVPAGE - KVPAGE / 2;
+	    memcpy((char *) next->kv, (char *) (page->kv + KVPAGE / 2),
+		   next->count * sizeof (sdb_keyvalue));
+	    memcpy((char *) next->fold, (char *) (page->fold + KVPAGE / 2),
+		   next->count * sizeof (char *));
+	    page->count = KVPAGE / 2;
+	    if (idx > KVPAGE / 2) {
+		++pg;
+		idx -= KVPAGE / 2;
+	    }
+	}
+	page = c->page[pg];
+    }
+
+/* : open up the slot */
+    memmove((char *) (page->kv + idx + 1), (char *) (page->kv + idx),
+	    (page->count - idx) * sizeof (sdb_keyvalue));
+    memmove((char *) (page->fold + idx + 1), (char *) (page->fold + idx),
+	    (page->count - idx) * sizeof (char *));
+    ++page->count;
+    ++c->cachecount;
+    ++c->gen;
+    page->kv[idx].key = key;
+    page->fold[idx] = fold;
+
+    return (page->kv + idx);
+}
+
+/* remove the keyvalue pair at a position found by kvlocate()
+ */
+static void kvdelete(c, pg, idx)
+    cache *c;
+    unsigned long pg, idx;
+{
+    kvpage *page;
+
+    if (c->cur != NULL) retire(c, 0);
+    page = c->page[pg];
+    --page->count;
+    --c->cachecount;
+    ++c->gen;
+    memmove((char *) (page->kv + idx), (char *) (page->kv + idx + 1),
+	    (page->count - idx) * sizeof (sdb_keyvalue));
+    memmove((char *) (page->fold + idx), (char *) (page->fold + idx + 1),
+	    (page->count - idx) * sizeof (char *));
+
+/* : drop the page once it's empty */
+    if (page->count == 0) {
+	free((char *) page);
+	--c->pagecount;
+	memmove((char *) (c->page + pg), (char *) (c->page + pg + 1),
+		(c->pagecount - pg) * sizeof (kvpage *));
+	REFUND(c, sizeof (kvpage));
+    }
+}
+
+/* build the cache index from an array of keyvalue pairs, sorting it first
+ * unless it's already sorted.  The array is freed.
+ * returns -1 on failure, 0 on success
+ */
+static int buildindex(c, kv, count, flags, sorted)
+    cache *c;
+    sdb_keyvalue *kv;
+    unsigned long count;
+    int flags;
+    int sorted;
+{
+    unsigned long i, j, n;
+    kvpage *page;
+
+    if (!sorted) {
+	qsort(kv, count, sizeof (sdb_keyvalue),
+	      (flags & SDB_ICASE) ? ikeycmp : keycmp);
+    }
+    c->icase = flags & SDB_ICASE;
+    for (i = 0; i < count; i += n) {
+	if (addpage(c, c->pagecount) < 0) {
+	    free((char *) kv);
+	    return (-1);
+	}
+	page = c->page[c->pagecount - 1];
+	n = count - i < KVPAGE ? count - i : KVPAGE;
+	memcpy((char *) page->kv, (char *) (kv + i), n * sizeof (sdb_keyvalue));
+	page->count = n;
+	for (j = 0; j < n; ++j) {
+	    if ((page->fold[j] = foldkey(c, page->kv[j].key)) == NULL) {
+		free((char *) kv);
+		return (-1);
+	    }
+	}
+    }
+    c->cachecount = count;
+    free((char *) kv);
+
+    return (0);
+}
+
+/*  */
+
+/* NOTES
+ * Keys and values in text database files and logs escape newlines as
+ * "\n", spaces in keys as "\s" and backslashes as "\\".  Most of them have
+ * nothing to escape, so rather than test each character, the routines
+ * below find the next character that matters with strcspn() and move the
+ * run before it whole; the C library searches several bytes at a time.
+ * END NOTES */
+
+/* undo the escapes of a key or value from a text database or log, in place,
+ * up to the first character of stop or the end of the string.  The result
+ * is not terminated.
+ * returns the end of the unescaped text, and sets *next to the character
+ * that stopped the scan
+ */
+static char *unescapespan(str, stop, next)
+    char *str;
+    char *stop;				/* delimiters, starting with '\\' */
+    char **next;
+{
+    char *dst;
+    unsigned long n;
+
+    for (dst = str;;) {
+	n = strcspn(str, stop);
+	if (dst != str) memmove(dst, str, n);
+	dst += n;
+	str += n;
+	if (*str != '\\') break;
+	if (*++str == 'n') {
+	    *dst++ = '\n';
+	    ++str;
+	} else if (*str == 's') {
+	    *dst++ = ' ';
+	    ++str;
+	} else if (*str == '\0') {
+	    *dst++ = '\\';
+	} else {
+	    *dst++ = *str++;
+	}
+    }
+    *next = str;
+
+    return (dst);
+}
+
+/* undo the escapes of a key or value from a text database or log, in place
+ */
+static void unescape(str)
+    char *str;
+{
+    char *end;
+
+    *unescapespan(str, "\\", &end) = '\0';
+}
+
+/* escape str into dst, which has room for twice its length, escaping
+ * spaces too if key is set
+ * returns the end of the escaped text in dst, which is not terminated
+ */
+static char *escapecpy(dst, str, key)
+    char *dst;
+    char *str;
+    int key;
+{
+    unsigned long n;
+
+    for (;;) {
+	n = strcspn(str, key ? "\\\n " : "\\\n");
+	memcpy(dst, str, n);
+	dst += n;
+	str += n;
+	if (*str == '\0') break;
+	*dst++ = '\\';
+	*dst++ = *str == '\n' ? 'n' : *str == ' ' ? 's' : '\\';
+	++str;
+    }
+
+    return (dst);
+}
+
+/*  */
+
+/* parse the data in the cache database file into the cache.  Keys and
+ * values are unescaped in place and point into data, which the caller
+ * keeps as the cache's base on success.
+ * returns -1 on failure, 0 on success
+ */
+
+/* HISTORY
+ * IncrDev Feb 21, 1996 by sh: rewrote it to allocate parsed key/value pairs
+ * IncrDev Feb 21, 1996 by sh: changed contract to accept data buffer
+ * END HISTORY */
+
+static int parsecache(c, data, flags)
+  cache *c;				/* U: cache to parse into */
+  char* data;				/* I: database data buffer */
+  int flags;				/* I: case insensitive if non-zero */
+{
+    int sorted;				/* source file was sorted if 1 */
+    long lines;				/* number of lines in data */
+    char* scan;				/* source data scan pointer */
+    char* end;				/* end of source data */
+    char* dst;				/* end of unescaped key or value */
+    sdb_keyvalue *array;		/* parsed keyvalue pairs */
+    sdb_keyvalue *kv;			/* current keyvalue pair */
+    int (*cmpf)();			/* sort comparison function */
+
+/* : initialization */
+    lines = 0;
+    sorted = 1;
+    cmpf = (flags & SDB_ICASE) ? strcasecmp : strcmp;
+
+/* : count the number of lines in the database data */
+    lines = 0;
+    end = data + strlen(data);
+    for (scan = data; (scan = memchr(scan, '\n', end - scan)) != NULL;
+	 scan++) {
+	lines++;
+    }
+
+/* : make sure that we count a line without a linefeed at the end */
+    if (*(end-1) != '\n') ++lines;
+
+/* : CLAIM - the number of lines in the data is equivalent to the number of
+     key value pairs in the database.   We can base the size of the array
+     the pairs are parsed into on that value. */
+/* : allocate space for the parsed pairs */
+    array = (sdb_keyvalue *) malloc(lines * sizeof(sdb_keyvalue));
+    if (array == NULL) {
+	return (-1);
+    }
+
+/* : walk each line in the data parsing key value pairs */
+    scan = data;
+    for (kv = array; kv < array + lines; ++kv) {
+
+/* : - parse the key, handling quoted characters */
+	kv->key = scan;
+	dst = unescapespan(scan, "\\ \n", &scan);
+
+/* : - if at end of line or string then set the value to NULL */
+	if ((*scan == '\n') || (*scan == '\0')) {
+	    kv->value = NULL;
+	}
+	
+/* : - else parse the value, handling quoted characters */
+	else {
+	    *dst = '\0';
+	    kv->value = ++scan;
+	    dst = unescapespan(scan, "\\\n", &scan);
+	}
+
+/* : - terminate the key or value */
+	*dst = '\0';			/* this may overwrite *scan */
+
+/* : - move scan to the start of the next line */
+	scan++;
+
+/* : - check to make sure that the data is sorted */
+	if (sorted && (kv != array) && ((*cmpf)(kv[-1].key, kv->key) > 0)) {
+	    sorted = 0;
+	}
+    }
+
+/* : index the pairs, sorting them only if necessary */
+    return (buildindex(c, array, (unsigned long) lines, flags, sorted));
+}
+
+/*  */
+
+/* point the cache at the records of a mapped binary database file
+ * returns -1 on failure, 0 on success
+ */
+static int mapcache(c, flags)
+    cache *c;				/* U: cache with c->base mapped */
+    int flags;				/* I: case insensitive if non-zero */
+{
+    unsigned long count;		/* number of records in the file */
+    unsigned long off;			/* offset of current record */
+    unsigned long avail;		/* bytes left after record header */
+    unsigned long klen, vlen;		/* key and value lengths */
+    unsigned long i;			/* loop counter */
+    const char *index;			/* record offset index */
+    sdb_keyvalue *array;		/* keyvalue pairs of the records */
+    sdb_keyvalue *kv;			/* current keyvalue pair */
+
+/* : check the header */
+    array = NULL;
+    if (GETNET32(c->base + SDB_MAGICLEN) != SDB_VERSION) {
+	syslog(LOG_ERR, "IOERROR: %s: unknown database version %lu", c->db,
+	       GETNET32(c->base + SDB_MAGICLEN));
+	return (-1);
+    }
+    count = GETNET32(c->base + SDB_MAGICLEN + 8);
+    if (count > (c->len - SDB_HEADERLEN) / 4) goto CORRUPT;
+    if (count == 0) return (0);
+
+/* : allocate space for the keyvalue pairs */
+    kv = array = (sdb_keyvalue *) malloc(count * sizeof (sdb_keyvalue));
+    if (array == NULL) return (-1);
+
+/* : walk the index pointing keys and values into the mapping */
+    index = c->base + SDB_HEADERLEN;
+    for (i = 0; i < count; ++i, ++kv) {
+	off = GETNET32(index + i * 4);
+	if (off < SDB_HEADERLEN || off > c->len - 8) goto CORRUPT;
+	klen = GETNET32(c->base + off);
+	vlen = GETNET32(c->base + off + 4);
+	avail = c->len - off - 8;
+	if (klen >= avail || c->base[off + 8 + klen] != '\0') goto CORRUPT;
+	kv->key = (char *) c->base + off + 8;
+	if (vlen == SDB_NOVALUE) {
+	    kv->value = NULL;
+	} else {
+	    avail -= klen + 1;
+	    if (vlen >= avail || kv->key[klen + 1 + vlen] != '\0') goto CORRUPT;
+	    kv->value = kv->key + klen + 1;
+	}
+    }
+
+/* : index the pairs, re-sorting if the file was sorted with the other
+     case sensitivity */
+    return (buildindex(c, array, count, flags,
+		       (GETNET32(c->base + SDB_MAGICLEN + 4) & SDB_ICASE)
+		       == (flags & SDB_ICASE)));
+
+ CORRUPT:
+    if (array != NULL) free((char *) array);
+    syslog(LOG_ERR, "IOERROR: %s: corrupt database file", c->db);
+    return (-1);
+}
+
+/*  */
+
+/* load a cache from database file, not including its log
+ * returns -1 on error, 0 on success
+ */
+
+/* HISTORY
+ * IncrDev Feb 21, 1996 by sh: completely rewrote it to use new cache structure
+ * END HISTORY */
+
+static int loadbase(c, flags)
+    cache *c;
+    int flags;
+{
+    struct stat stbuf;			/* file statistics buffer */
+    int fd;				/* database file descriptor */
+    int rtval;				/* return value */
+    int count;				/* number of characters read from file */
+    char* data;				/* raw (unparsed) database data */
+
+/* : initialization */
+    data = NULL;
+    rtval = 0;
+
+/* : quit if we can't stat the database file */
+    if (stat(c->db, &stbuf) < 0) {
+      if (imspd_debug) {
+	fprintf(stderr,"%s: ", c->db);
+	perror("failed to stat cache buffer");
+      }
+      return(-1);
+    }
+
+/* : free any existing cache structure */
+    freecache(c);
+
+/* : if the database file is 0 length then the refresh is complete */
     if (stbuf.st_size == 0) {
 	c->loaded = 1;
 	c->modified = 0;
 	c->icase = flags & SDB_ICASE;
 	c->cachecount = 0;
+	c->mtime = stbuf.st_mtime;
+	c->ino = stbuf.st_ino;
+	c->size = 0;
+	c->logino = c->logpos = 0;
 	return(0);
     }
 
-/* : open the database file if it hasn't already been opened */
-    fd = c->fd;
-    if (c->locks != 0 && (c->fd == -1)) {
-      if (imspd_debug) {
-	fprintf(stderr,"internal consistency error. We got locks but not a valid fd for %s\n",
-		c->db);
-	return(-1);
-      } else {
-	syslog(LOG_ERR,"internal consistency error. We got locks but not a valid fd for %s\n",
-	       c->db);
-      }
+/* : open the database file if it hasn't already been opened */
+    fd = c->fd;
+    if (c->locks != 0 && (c->fd == -1)) {
+      if (imspd_debug) {
+	fprintf(stderr,"internal consistency error. We got locks but not a valid fd for %s\n",
+		c->db);
+	return(-1);
+      } else {
+	syslog(LOG_ERR,"internal consistency error. We got locks but not a valid fd for %s\n",
+	       c->db);
+      }
+    }
+
+    if ((c->locks == 0) || (c->fd == -1)) {
+	fd = open(c->db, O_RDONLY);
+	if (fd < 0) {
+	  if (imspd_debug) {
+	    fprintf(stderr,"%s: ", c->db);
+	    perror("failed to open DB");
+	  }
+	  return (-1);
+	}
+	c->fd = fd;
+    }
+
+/* : map binary database files and use the records in place */
+    if (fstat(fd, &stbuf) < 0) {
+	CLEANUP_RETURN(-1);
+    }
+    if (stbuf.st_size >= SDB_HEADERLEN) {
+	map_refresh(fd, 1, &c->base, &c->len, stbuf.st_size, c->db, NULL);
+	c->mapped = 1;
+	if (!memcmp(c->base, sdb_magic, SDB_MAGICLEN)) {
+	    if (mapcache(c, flags) < 0) {
+		freecache(c);
+		CLEANUP_RETURN(-1);
+	    }
+	    goto LOADED;
+	}
+	map_free(&c->base, &c->len);
+	c->mapped = 0;
+    }
+
+/* : allocate a buffer to hold the database file text -- only legacy text
+     files take this path.  The parsed buffer is kept as the cache's base,
+     so the file's contents are only held once. */
+    data = (char *) malloc(stbuf.st_size + 1);
+    if (data == NULL) {
+      if (imspd_debug) {
+	perror("malloc of data failed");
+      } else {
+	syslog(LOG_ERR, "imspd: Unable to allocate %d bytes for %s: %m",
+	       stbuf.st_size+1, c->db);
+      }
+      CLEANUP_RETURN(-1);
+    }
+
+/* : read data from file into the data buffer */
+    if (lseek(fd, 0L, SEEK_SET) < 0) {
+	CLEANUP_RETURN(-1);
+    }
+    count = read(fd, data, stbuf.st_size);
+    if (count != stbuf.st_size) {
+      if (imspd_debug) {
+	fprintf(stderr, "internal consistency error count(%d) != stbuf.st_size (%d)\n",
+		count, stbuf.st_size);
+      }
+	CLEANUP_RETURN(-1);
+    }
+    data[count] = '\0';			/* set a sentinel -- THIS IS IMPORTANT!*/
+
+/* : parse the database data into the cache */
+    if (parsecache(c, data, flags) < 0) {
+	freecache(c);
+	if (imspd_debug) {
+	  fprintf(stderr,"parsecache failed\n");
+	}
+	CLEANUP_RETURN(-1);
+    }
+    c->base = data;
+    c->len = count + 1;
+    data = NULL;
+
+ LOADED:
+/* : mark the cache as loaded and not modified */
+    c->loaded = 1;
+    c->modified = 0;
+    c->icase = flags & SDB_ICASE;
+    c->mtime = stbuf.st_mtime;
+    c->ino = stbuf.st_ino;
+    c->size = stbuf.st_size;
+    c->logino = c->logpos = 0;
+    CHARGE(c, stbuf.st_size);
+
+ CLEANUP:
+/* : free the database data buffer */
+    if (data != NULL) {
+	free(data);
+    }
+
+/* : close the database file if unlocked */
+    if (c->locks == 0) {
+	close(fd);
+	c->fd = -1;
+    }
+
+/* : return the return value */
+    return(rtval);
+}
+
+/*  */
+
+/* apply log records added since the cache was last loaded or refreshed
+ * returns -1 on error, 1 if the log was replaced and the cache must be
+ * reloaded, 0 on success
+ */
+static int replaylog(c)
+    cache *c;
+{
+    struct stat stbuf;			/* log file statistics buffer */
+    int fd;				/* log file descriptor */
+    int rtval;				/* return value */
+    int flags;				/* sort flags of the cache */
+    long count;				/* number of new bytes in log */
+    char *data;				/* new log records */
+    char *scan, *end;			/* current record and its end */
+    char *key, *value;			/* key and value of current record */
+    char lname[MAXDBPATHLEN + 8];	/* log file name buffer */
+
+/* : initialization */
+    data = NULL;
+    rtval = 0;
+    flags = c->icase ? SDB_ICASE : 0;
+
+/* : a missing log is fine, unless one we read was folded into the file */
+    snprintf(lname, sizeof(lname), logext, c->db);
+    if ((fd = open(lname, O_RDONLY)) < 0) {
+	if (errno != ENOENT) return (-1);
+	return (c->logpos ? 1 : 0);
+    }
+
+/* : check that this is the log we've been reading */
+    if (fstat(fd, &stbuf) < 0) {
+	CLEANUP_RETURN(-1);
+    }
+    if (c->logpos
+	&& (stbuf.st_ino != c->logino || stbuf.st_size < c->logpos)) {
+	CLEANUP_RETURN(1);
+    }
+    c->logino = stbuf.st_ino;
+    if (stbuf.st_size == c->logpos) {
+	CLEANUP_RETURN(0);
+    }
+
+/* : read the new records */
+    count = stbuf.st_size - c->logpos;
+    data = (char *) malloc(count + 1);
+    if (data == NULL) {
+	CLEANUP_RETURN(-1);
+    }
+    if (lseek(fd, (off_t) c->logpos, SEEK_SET) < 0
+	|| read(fd, data, count) != count) {
+	CLEANUP_RETURN(-1);
+    }
+    data[count] = '\0';
+
+/* : apply each complete record -- a partial one is left for later */
+    for (scan = data; (end = strchr(scan, '\n')) != NULL; scan = end + 1) {
+	*end = '\0';
+	key = scan + 1;
+	if ((value = strchr(key, ' ')) != NULL) *value++ = '\0';
+	unescape(key);
+	if (value != NULL) unescape(value);
+	if (*scan == '+') {
+	    if (cacheset(c, key, flags, value) < 0) {
+		CLEANUP_RETURN(-1);
+	    }
+	} else if (*scan == '-') {
+	    cacheremove(c, key, flags);
+	} else {
+	    syslog(LOG_ERR, "IOERROR: %s: bad log record", lname);
+	}
+    }
+    c->logpos += scan - data;
+
+ CLEANUP:
+    if (data != NULL) {
+	free(data);
+    }
+    close(fd);
+
+    return (rtval);
+}
+
+/* bring a cache up to date with its database file and log
+ * returns -1 on error, 0 on success
+ */
+static int loadcache(c, flags)
+    cache *c;
+    int flags;
+{
+    struct stat stbuf;			/* file statistics buffer */
+    int tries;				/* number of loads attempted */
+    int result;				/* replaylog result */
+    int watched;			/* files are watched for changes */
+    int loads;				/* database files read */
+
+/* : quit if the cache is loaded and we don't care if it's stale, or no
+     change to its files has been seen since it was loaded */
+    if (c->loaded && (flags & SDB_QUICK)) {
+	++sdb_counts.hits;
+	return (0);
+    }
+    if (c->loaded && c->backend == NULL && (flags & SDB_ICASE) == c->icase
+	&& watchcurrent(c)) {
+	++sdb_counts.hits;
+	return (0);
+    }
+    watched = watchcache(c);
+
+/* : a storage engine's file is read through the engine */
+    if (c->locks == 0 && checkformat(c) < 0) return (-1);
+    if (c->backend != NULL) return (loadbackend(c, flags));
+
+    loads = 0;
+
+    for (tries = 0; tries < LOAD_RETRIES; ++tries) {
+
+/* : - quit if we can't stat the database file */
+	if (stat(c->db, &stbuf) < 0) {
+	  if (imspd_debug) {
+	    fprintf(stderr,"%s: ", c->db);
+	    perror("failed to stat cache buffer");
+	  }
+	  return(-1);
+	}
+
+/* : - reload unless the cache holds this same database file */
+	if (!c->loaded || (flags & SDB_ICASE) != c->icase
+	    || stbuf.st_ino != c->ino || stbuf.st_size != c->size
+	    || stbuf.st_mtime != c->mtime) {
+	    if (loads++ == 0) ++sdb_counts.misses;
+	    if (loadbase(c, flags) < 0) return (-1);
+	}
+
+/* : - apply the log, and make sure no writer folded it in meanwhile */
+	result = replaylog(c);
+	if (result < 0) {
+	    freecache(c);
+	    return (-1);
+	}
+	if (result == 0
+	    && (c->locks
+		|| (stat(c->db, &stbuf) == 0 && stbuf.st_ino == c->ino))) {
+	    if (loads == 0) ++sdb_counts.hits;
+	    c->watched = watched;
+	    return (0);
+	}
+	freecache(c);
+    }
+
+    syslog(LOG_ERR, "IOERROR: %s: database kept changing while loading", c->db);
+    return (-1);
+}
+
+/*  */
+
+/* find the last log record for a key, without applying the log.  Each
+ * lookup scans the whole log, so a log longer than PEEK_LOGMAX is left
+ * for loadcache to replay once.
+ * on success, value is set to a copy of the record's value in the cache's
+ * string pool, or NULL for a removal
+ * returns -1 on error, 0 if the log has no record for key, 1 if it has,
+ *  2 if the log is too long to scan
+ */
+static int peeklog(c, key, flags, value)
+    cache *c;
+    char *key;
+    int flags;
+    char **value;
+{
+    struct stat stbuf;			/* log file statistics buffer */
+    int fd;				/* log file descriptor */
+    int rtval;				/* return value */
+    const char *base;			/* mapped log file */
+    unsigned long len;			/* length of base */
+    const char *scan, *end;		/* current record and its end */
+    const char *last;			/* last record for key */
+    char *ekey, *dst;			/* key escaped as in the log */
+    unsigned long elen;			/* length of ekey */
+    char lname[MAXDBPATHLEN + 8];	/* log file name buffer */
+
+/* : a missing or empty log has nothing to say */
+    snprintf(lname, sizeof(lname), logext, c->db);
+    if ((fd = open(lname, O_RDONLY)) < 0) {
+	return (errno == ENOENT ? 0 : -1);
+    }
+    if (fstat(fd, &stbuf) < 0) {
+	close(fd);
+	return (-1);
+    }
+    if (stbuf.st_size == 0 || stbuf.st_size > PEEK_LOGMAX) {
+	close(fd);
+	return (stbuf.st_size == 0 ? 0 : 2);
+    }
+
+/* : escape the key the way logrecord() does */
+    if ((ekey = malloc(2 * strlen(key) + 1)) == NULL) {
+	close(fd);
+	return (-1);
+    }
+    dst = escapecpy(ekey, key, 1);
+    *dst = '\0';
+    elen = dst - ekey;
+
+/* : scan the complete records for the key */
+    base = NULL;
+    len = 0;
+    map_refresh(fd, 1, &base, &len, stbuf.st_size, lname, NULL);
+    close(fd);
+    last = NULL;
+    for (scan = base; (end = memchr(scan, '\n', base + len - scan)) != NULL;
+	 scan = end + 1) {
+	if (end - scan > elen
+	    && (scan[elen + 1] == ' ' || scan[elen + 1] == '\n')
+	    && !((flags & SDB_ICASE) ? strncasecmp(scan + 1, ekey, elen)
+		 : strncmp(scan + 1, ekey, elen))) {
+	    last = scan;
+	}
+    }
+    free(ekey);
+
+/* : copy out the value of the last record */
+    rtval = 0;
+    if (last != NULL) {
+	rtval = 1;
+	*value = NULL;
+	scan = last + elen + 1;
+	if (*last == '+' && *scan == ' ') {
+	    end = memchr(scan, '\n', base + len - scan);
+	    if ((dst = malloc(end - scan)) == NULL) {
+		rtval = -1;
+	    } else {
+		memcpy(dst, scan + 1, end - scan - 1);
+		dst[end - scan - 1] = '\0';
+		unescape(dst);
+		*value = poolstrdup(c, dst);
+		free(dst);
+	    }
+	}
+    }
+    map_free(&base, &len);
+
+    return (rtval);
+}
+
+/* look up a key of an unloaded cache straight from its mapped binary
+ * database file and log, without building the index.  The mapping is kept
+ * for further lookups until the file changes or the cache is loaded.
+ * returns -1 on error, 1 if the cache must be loaded instead, 0 on success
+ */
+static int peekcache(c, key, flags, value)
+    cache *c;
+    char *key;
+    int flags;
+    char **value;
+{
+    struct stat stbuf;			/* file statistics buffer */
+    int fd;				/* database file descriptor */
+    int cmp;				/* key comparison */
+    int result;				/* peeklog result */
+    unsigned long count;		/* number of records in the file */
+    unsigned long lo, hi, mid;		/* binary search bounds */
+    unsigned long off;			/* offset of current record */
+    unsigned long klen, vlen;		/* key and value lengths */
+    const char *rec;			/* key of current record */
+
+/* : map the database file, unless the last lookup's mapping is current */
+    ++c->peeks;
+    if (stat(c->db, &stbuf) < 0) return (-1);
+    if (!c->mapped || stbuf.st_ino != c->ino || stbuf.st_size != c->size
+	|| stbuf.st_mtime != c->mtime) {
+	freecache(c);
+	if ((fd = open(c->db, O_RDONLY)) < 0) return (-1);
+	if (fstat(fd, &stbuf) < 0) {
+	    close(fd);
+	    return (-1);
+	}
+	if (stbuf.st_size < SDB_HEADERLEN) {
+	    close(fd);
+	    return (1);
+	}
+	map_refresh(fd, 1, &c->base, &c->len, stbuf.st_size, c->db, NULL);
+	close(fd);
+	c->mapped = 1;
+	c->mtime = stbuf.st_mtime;
+	c->ino = stbuf.st_ino;
+	c->size = stbuf.st_size;
+    }
+
+/* : only binary files sorted the way we're asked to compare will do */
+    if (memcmp(c->base, sdb_magic, SDB_MAGICLEN)
+	|| GETNET32(c->base + SDB_MAGICLEN) != SDB_VERSION
+	|| (GETNET32(c->base + SDB_MAGICLEN + 4) & SDB_ICASE)
+	   != (flags & SDB_ICASE)) {
+	return (1);
+    }
+    count = GETNET32(c->base + SDB_MAGICLEN + 8);
+    if (count > (c->len - SDB_HEADERLEN) / 4) return (1);
+
+/* : the log has the latest word on the key */
+    result = peeklog(c, key, flags, value);
+    if (result < 0) return (-1);
+    if (result == 2) return (1);
+
+/* : make sure no writer folded the log into a new file meanwhile, or the
+     mapping would miss the changes that were in the log */
+    if (stat(c->db, &stbuf) < 0) return (-1);
+    if (stbuf.st_ino != c->ino || stbuf.st_size != c->size
+	|| stbuf.st_mtime != c->mtime) {
+	return (1);
+    }
+    if (result == 1) return (0);
+
+/* : binary search the record index -- damage is left for loadcache */
+    *value = NULL;
+    lo = 0;
+    hi = count;
+    while (lo < hi) {
+	mid = (lo + hi) / 2;
+	off = GETNET32(c->base + SDB_HEADERLEN + mid * 4);
+	if (off < SDB_HEADERLEN || off > c->len - 8) return (1);
+	klen = GETNET32(c->base + off);
+	if (klen >= c->len - off - 8 || c->base[off + 8 + klen] != '\0') {
+	    return (1);
+	}
+	rec = c->base + off + 8;
+	cmp = (flags & SDB_ICASE) ? strcasecmp(key, rec) : strcmp(key, rec);
+	if (cmp == 0) {
+	    vlen = GETNET32(c->base + off + 4);
+	    if (vlen != SDB_NOVALUE) {
+		if (vlen >= c->len - off - 8 - klen - 1
+		    || rec[klen + 1 + vlen] != '\0') {
+		    return (1);
+		}
+		*value = (char *) rec + klen + 1;
+	    }
+	    break;
+	}
+	if (cmp < 0) {
+	    hi = mid;
+	} else {
+	    lo = mid + 1;
+	}
+    }
+
+    return (0);
+}
+
+/*  */
+
+/* fsync a file written for a cache, keeping the cache's fsync statistics
+ * returns -1 on failure, 0 on success
+ */
+static int timedsync(c, fd)
+    cache *c;
+    int fd;
+{
+    struct timeval start, end;		/* fsync start and end times */
+    unsigned long usec;			/* fsync time */
+    int result;				/* fsync result */
+
+    gettimeofday(&start, NULL);
+    result = fsync(fd);
+    gettimeofday(&end, NULL);
+    usec = (end.tv_sec - start.tv_sec) * 1000000L
+	+ end.tv_usec - start.tv_usec;
+    ++c->syncs;
+    c->synctime += usec;
+    if (usec > c->syncmax) c->syncmax = usec;
+    if (result < 0) {
+	syslog(LOG_ERR, "IOERROR: syncing %s: %m", c->db);
+    }
+
+    return (result);
+}
+
+/* fsync the log and/or the directory of a cache
+ * returns -1 on failure, 0 on success
+ */
+static int synccache(c, what)
+    cache *c;
+    int what;				/* SYNC_* files to sync */
+{
+    int fd;				/* file descriptor */
+    int rtval;				/* return value */
+    char path[MAXDBPATHLEN + 8];	/* log or directory name buffer */
+
+    rtval = 0;
+    c->syncpending &= ~what;
+
+/* : a log that's gone was folded into a file which was synced first */
+    if (what & SYNC_LOG) {
+	snprintf(path, sizeof(path), logext, c->db);
+	if ((fd = open(path, O_WRONLY)) >= 0) {
+	    rtval = timedsync(c, fd);
+	    close(fd);
+	} else if (errno != ENOENT) {
+	    rtval = -1;
+	}
+    }
+
+/* : sync the directory to keep new and renamed files */
+    if (what & SYNC_DIR) {
+	snprintf(path, sizeof(path), "%s", c->db);
+	*strrchr(path, '/') = '\0';
+	if ((fd = open(path, O_RDONLY)) < 0) {
+	    rtval = -1;
+	} else {
+	    if (timedsync(c, fd) < 0) rtval = -1;
+	    close(fd);
+	}
+    }
+
+    return (rtval);
+}
+
+/* make a write to the files of a cache durable as sdb_syncmode asks: now,
+ * with the next group commit, or not at all.  fd is the file written, or
+ * -1 if it has been synced already.
+ */
+static void syncwrite(c, fd, what)
+    cache *c;
+    int fd;
+    int what;				/* SYNC_* files changed */
+{
+    ++c->flushes;
+    switch (sdb_syncmode) {
+    case SDB_SYNC_STRICT:
+	if (fd != -1) timedsync(c, fd);
+	if (what & SYNC_DIR) synccache(c, SYNC_DIR);
+	break;
+
+    case SDB_SYNC_GROUP:
+	if (sdb_pending++ == 0) sdb_pendtime = time(NULL);
+	c->syncpending |= fd == -1 ? what & ~SYNC_LOG : what;
+	break;
+    }
+}
+
+/* log the write statistics of a cache that's being dropped
+ */
+static void logstats(c)
+    cache *c;
+{
+    if (!c->flushes) return;
+    syslog(LOG_DEBUG, "imspd: %s: %lu writes, %lu fsyncs, "
+	   "%lu usec average, %lu usec max", c->db, c->flushes, c->syncs,
+	   c->syncs ? c->synctime / c->syncs : 0UL, c->syncmax);
+}
+
+/*  */
+
+/* write the cache content to database file, replacing it
+ */
+
+/* HISTORY
+ * IncrDev Feb 21, 1996 by sh: changed contract to just write cache to file
+ * END HISTORY */
+
+
+static int wbuf_flush(out)
+    wbuf *out;
+{
+    if (out->len && !out->err
+	&& retry_write(out->fd, out->buf, out->len) != out->len) {
+	out->err = 1;
+    }
+    out->len = 0;
+
+    return (out->err ? -1 : 0);
+}
+
+static void wbuf_write(out, data, len)
+    wbuf *out;
+    const char *data;
+    unsigned long len;
+{
+    unsigned long n;
+
+    while (len) {
+	if (out->len == sizeof (out->buf)) wbuf_flush(out);
+	n = sizeof (out->buf) - out->len;
+	if (n > len) n = len;
+	memcpy(out->buf + out->len, data, n);
+	out->len += n;
+	data += n;
+	len -= n;
+    }
+}
+
+static void wbuf_putnet32(out, n)
+    wbuf *out;
+    unsigned long n;
+{
+    char buf[4];
+
+    buf[0] = (char) (n >> 24);
+    buf[1] = (char) (n >> 16);
+    buf[2] = (char) (n >> 8);
+    buf[3] = (char) n;
+    wbuf_write(out, buf, 4L);
+}
+
+static int writecache(c)
+    cache *c;
+{
+    wbuf out;
+    int fd;
+    struct stat stbuf;
+    unsigned long pg, n;		/* index page and pairs left in it */
+    sdb_keyvalue *kv;			/* current keyvalue pair */
+    unsigned long count;		/* number of records written */
+    unsigned long off;			/* offset of next record */
+    unsigned long klen, vlen;		/* key and value lengths */
+    unsigned long pad;			/* record padding */
+    char newname[MAXDBPATHLEN + 5];
+
+/* : open and lock new database file for output */
+    snprintf(newname, sizeof(newname), newext, c->db);
+    if ((fd = open(newname, O_RDWR | O_CREAT | O_TRUNC, 0600)) < 0) {
+	return (-1);
+    }
+    if (lock_blocking(fd) < 0) {
+	close(fd);
+	unlink(newname);
+	return (-1);
+    }
+    out.fd = fd;
+    out.err = 0;
+    out.len = 0;
+
+/* : write the header */
+    count = c->cachecount;
+    wbuf_write(&out, sdb_magic, (unsigned long) SDB_MAGICLEN);
+    wbuf_putnet32(&out, (unsigned long) SDB_VERSION);
+    wbuf_putnet32(&out, (unsigned long) (c->icase ? SDB_ICASE : 0));
+    wbuf_putnet32(&out, count);
+
+/* : write the record index */
+    off = SDB_HEADERLEN + count * 4;
+    for (pg = 0; pg < c->pagecount; ++pg) {
+	kv = c->page[pg]->kv;
+	for (n = c->page[pg]->count; n; --n, ++kv) {
+	    wbuf_putnet32(&out, off);
+	    off += SDB_RECLEN(strlen(kv->key), kv->value == NULL ? 0
+			      : strlen(kv->value) + 1);
+	}
+    }
+
+/* : walk the cache writing keyvalue records to the database file */
+    for (pg = 0; pg < c->pagecount; ++pg) {
+	kv = c->page[pg]->kv;
+	for (n = c->page[pg]->count; n; --n, ++kv) {
+	    klen = strlen(kv->key);
+	    vlen = kv->value == NULL ? SDB_NOVALUE : strlen(kv->value);
+	    wbuf_putnet32(&out, klen);
+	    wbuf_putnet32(&out, vlen);
+	    wbuf_write(&out, kv->key, klen + 1);
+	    pad = 8 + klen + 1;
+	    if (vlen != SDB_NOVALUE) {
+		wbuf_write(&out, kv->value, vlen + 1);
+		pad += vlen + 1;
+	    }
+	    if (pad & 3) wbuf_write(&out, "\0\0\0", 4 - (pad & 3));
+	}
+    }
+
+/* : make sure write & rename succeed, syncing the new file first so a
+     crash can't leave a renamed file without its contents */
+    if (wbuf_flush(&out) < 0
+	|| (sdb_syncmode != SDB_SYNC_NONE && timedsync(c, fd) < 0)
+	|| fstat(fd, &stbuf) < 0 || rename(newname, c->db) < 0) {
+	unlink(newname);
+	close(fd);
+	return (-1);
+    }
+    syncwrite(c, -1, SYNC_DIR);
+
+/* : a locked cache holds the lock on the new file in place of the old one,
+     so nobody can lock the new file before we're done with it -- even when
+     the last unlock is compacting the log, which must go first */
+    if (c->fd != -1) {
+	close(c->fd);
+	c->fd = fd;
+    } else {
+	close(fd);
+    }
+
+/* : the cache doesn't map the new file, so its inode may be freed and
+     reused by a later rewrite of the same size; have the next load read
+     the file rather than trust the inode */
+    c->ino = 0;
+    c->size = stbuf.st_size;
+
+/* : return success */
+    return (0);
+}
+
+/*  */
+
+/* make room for need more bytes of pending log records
+ * returns -1 on failure, 0 on success
+ */
+static int logreserve(c, need)
+    cache *c;
+    unsigned long need;
+{
+    char *log;
+
+    if (c->loglen + need > c->logsize) {
+	c->logsize = c->loglen + need + LOG_INCREMENT;
+	if (c->log == NULL) {
+	    log = (char *) malloc(c->logsize);
+	} else {
+	    log = (char *) realloc(c->log, c->logsize);
+	}
+	if (log == NULL) return (-1);
+	c->log = log;
+    }
+
+    return (0);
+}
+
+/* add a set ('+') or remove ('-') record to the cache's pending log.  Keys
+ * and values are escaped as in text database files.
+ * returns -1 on failure, 0 on success
+ */
+static int logrecord(c, op, key, value)
+    cache *c;
+    int op;
+    char *key, *value;
+{
+    char *dst;
+
+/* : make room for the record */
+    if (logreserve(c, value == NULL ? LOGKEYNEED(key)
+		   : LOGNEED(key, value)) < 0) {
+	return (-1);
+    }
+
+/* : append the escaped record */
+    dst = c->log + c->loglen;
+    *dst++ = op;
+    dst = escapecpy(dst, key, 1);
+    if (value != NULL) {
+	*dst++ = ' ';
+	dst = escapecpy(dst, value, 0);
+    }
+    *dst++ = '\n';
+    c->loglen = dst - c->log;
+
+    return (0);
+}
+
+/* fold the log into the database file -- cache must be locked & current
+ * returns -1 on failure, 0 on success
+ */
+static int compactlog(c)
+    cache *c;
+{
+    char lname[MAXDBPATHLEN + 8];	/* log file name buffer */
+
+    if (writecache(c) < 0) {
+	syslog(LOG_ERR, "IOERROR: compacting %s: %m", c->db);
+	return (-1);
+    }
+    snprintf(lname, sizeof(lname), logext, c->db);
+    unlink(lname);
+    c->logino = c->logpos = 0;
+
+    return (0);
+}
+
+/* append the pending log records to the log file with a single write, and
+ * fold the log into the database file once it outgrows it.  cache must be
+ * locked and current for the keys it locks.  The log lock taken here is
+ * released with the cache's other locks.
+ * returns -1 on failure, 0 on success
+ */
+static int flushlog(c)
+    cache *c;
+{
+    struct stat stbuf;			/* log file statistics buffer */
+    int fd;				/* log file descriptor */
+    int rtval;				/* return value */
+    char lname[MAXDBPATHLEN + 8];	/* log file name buffer */
+
+    if (c->loglen == 0) return (0);
+
+/* : writers of other keys may have appended records since we locked ours;
+     take them in, so our position in the log is its end */
+    if (!c->whole && (lock_range(c->fd, (unsigned long) KEYLOCK_LOG, 1L) < 0
+		      || replaylog(c) != 0)) {
+	syslog(LOG_ERR, "IOERROR: catching up on %s: %m", c->db);
+	rtval = -1;
+	goto DROP;
+    }
+
+/* : append the records, dropping any partial record a failed writer left */
+    rtval = 0;
+    snprintf(lname, sizeof(lname), logext, c->db);
+    fd = open(lname, O_WRONLY | O_CREAT | O_APPEND, 0600);
+    if (fd < 0 || fstat(fd, &stbuf) < 0
+	|| (stbuf.st_size != c->logpos && ftruncate(fd, (off_t) c->logpos) < 0)
+	|| retry_write(fd, c->log, c->loglen) != c->loglen) {
+	syslog(LOG_ERR, "IOERROR: appending to %s: %m", lname);
+	if (fd >= 0) ftruncate(fd, (off_t) c->logpos);
+	rtval = -1;
+    } else {
+	syncwrite(c, fd, stbuf.st_size == 0 && c->logpos == 0
+		  ? SYNC_LOG | SYNC_DIR : SYNC_LOG);
+	c->logino = stbuf.st_ino;
+	c->logpos += c->loglen;
+    }
+    if (fd >= 0) close(fd);
+ DROP:
+    free(c->log);
+    c->log = NULL;
+    c->loglen = c->logsize = 0;
+
+/* : on failure, the cache no longer matches the disk so drop it */
+    if (rtval < 0) {
+	freecache(c);
+	return (rtval);
+    }
+    c->modified = 0;
+
+/* : fold the log into the file once it's large and bigger than the file,
+     unless writers of other keys are still at work on it */
+    if (c->logpos >= LOG_COMPACT && c->logpos >= c->size
+	&& (c->whole || lock_nonblocking(c->fd) == 0)) {
+	rtval = compactlog(c);
+    }
+
+    return (rtval);
+}
+
+/*  */
+
+/* find the storage format of a cache's database file from its magic
+ * number, opening a storage engine handle if the file belongs to one.
+ * Files without an engine's magic number are text or binary files of
+ * this module.  The format only changes when the file is replaced, so it
+ * is checked once per inode.  cache must be unlocked.
+ * returns -1 on error, 0 on success
+ */
+static int checkformat(c)
+    cache *c;
+{
+    struct stat stbuf;			/* file statistics buffer */
+    struct cyrusdb_backend *be;		/* engine of the file */
+    char magic[MAXMAGIC];		/* start of the file */
+    int fd, len, i;
+
+    if (stat(c->db, &stbuf) < 0) return (-1);
+    if (stbuf.st_ino != c->fmtino) {
+	if ((fd = open(c->db, O_RDONLY)) < 0) return (-1);
+	len = read(fd, magic, sizeof (magic));
+	close(fd);
+	be = NULL;
+	for (i = 0; backends[i] != NULL; ++i) {
+	    if (len >= backends[i]->magiclen
+		&& !memcmp(magic, backends[i]->magic, backends[i]->magiclen)) {
+		be = backends[i];
+	    }
+	}
+	if (be != c->backend) {
+	    freecache(c);
+	    closebackend(c);
+	    c->backend = be;
+	}
+	c->fmtino = stbuf.st_ino;
+    }
+
+/* : engines fsync each commit, as their recovery needs the records on
+     disk before the header says they're there */
+    if (c->backend != NULL && c->bdb == NULL
+	&& c->backend->open(c->db, sdb_syncmode != SDB_SYNC_NONE
+			    ? CYRUSDB_SYNC : 0, &c->bdb) != CYRUSDB_OK) {
+	syslog(LOG_ERR, "IOERROR: opening %s: %m", c->db);
+	c->bdb = NULL;
+	return (-1);
+    }
+
+    return (0);
+}
+
+/* close the storage engine handle of a cache, aborting any transaction
+ */
+static void closebackend(c)
+    cache *c;
+{
+    if (c->bdb != NULL) {
+	c->backend->close(c->bdb);
+	c->bdb = NULL;
+    }
+    c->tid = NULL;
+}
+
+/* state of a storage engine walk loading a cache */
+typedef struct loadrock {
+    cache *c;
+    sdb_keyvalue *kv;			/* pairs read so far */
+    unsigned long count;		/* number of pairs in kv */
+    unsigned long size;			/* allocated size of kv */
+    int flags;				/* case selection flag */
+    int sorted;				/* 0 once a pair came out of order */
+} loadrock;
+
+static int loadproc(rock, key, keylen, data, datalen)
+    void *rock;
+    const char *key;
+    int keylen;
+    const char *data;
+    int datalen;
+{
+    loadrock *lr = (loadrock *) rock;
+    sdb_keyvalue *kv;
+
+    if (lr->count == lr->size) {
+	lr->size = lr->size ? lr->size * 2 : KVPAGE;
+	kv = (sdb_keyvalue *) realloc((char *) lr->kv,
+				      lr->size * sizeof (sdb_keyvalue));
+	if (kv == NULL) return (-1);
+	lr->kv = kv;
+    }
+    kv = lr->kv + lr->count;
+    kv->key = poolmemdup(lr->c, key, keylen);
+    kv->value = data == NULL ? NULL : poolmemdup(lr->c, data, datalen);
+    if (kv->key == NULL || (data != NULL && kv->value == NULL)) return (-1);
+    if (lr->count && lr->sorted
+	&& ((lr->flags & SDB_ICASE) ? ikeycmp(kv - 1, kv)
+	    : keycmp(kv - 1, kv)) >= 0) {
+	lr->sorted = 0;
+    }
+    ++lr->count;
+
+    return (0);
+}
+
+/* bring a cache up to date with a storage engine's file by reading all of
+ * it.  Keys and values are copied to the string pool, as the engine's
+ * records only stay put until its next call.  A locked cache is kept up to
+ * date as it's changed, so it's only loaded once.
+ * returns -1 on error, 0 on success
+ */
+static int loadbackend(c, flags)
+    cache *c;
+    int flags;
+{
+    struct stat stbuf;			/* file statistics buffer */
+    loadrock lr;			/* pairs read */
+
+/* : every commit grows the file or replaces it, so the inode and size
+     tell if it changed */
+    if (stat(c->db, &stbuf) < 0) return (-1);
+    if (c->loaded && (flags & SDB_ICASE) == c->icase
+	&& (c->locks || (stbuf.st_ino == c->ino
+			 && stbuf.st_size == c->size))) {
+	++sdb_counts.hits;
+	return (0);
+    }
+    ++sdb_counts.misses;
+    freecache(c);
+
+    lr.c = c;
+    lr.kv = NULL;
+    lr.count = lr.size = 0;
+    lr.flags = flags;
+    lr.sorted = 1;
+    if (c->backend->foreach(c->bdb, "", 0, loadproc, (void *) &lr,
+			    c->locks ? &c->tid : NULL) != CYRUSDB_OK) {
+	syslog(LOG_ERR, "IOERROR: loading %s", c->db);
+	if (lr.kv != NULL) free((char *) lr.kv);
+	freecache(c);
+	return (-1);
+    }
+    if (buildindex(c, lr.kv, lr.count, flags, lr.sorted) < 0) {
+	freecache(c);
+	return (-1);
+    }
+    c->loaded = 1;
+    c->icase = flags & SDB_ICASE;
+    c->mtime = stbuf.st_mtime;
+    c->ino = stbuf.st_ino;
+    c->size = stbuf.st_size;
+
+    return (0);
+}
+
+/* look up a key of an unloaded cache through its storage engine.  The
+ * value is copied to the string pool, which is started over once it's
+ * large and the cache is unlocked.
+ * returns -1 on error, 1 if the cache must be loaded instead, 0 on success
+ */
+static int fetchbackend(c, key, flags, value)
+    cache *c;
+    char *key;
+    int flags;
+    char **value;
+{
+    const char *data;			/* engine's copy of the value */
+    int datalen;			/* length of data */
+    int icase;				/* engine's key order */
+
+/* : the engine only finds keys the way its file is sorted */
+    icase = c->backend->getflags(c->bdb) & CYRUSDB_ICASE ? SDB_ICASE : 0;
+    if (icase != (flags & SDB_ICASE)) return (1);
+
+    if (c->locks == 0 && c->bytes > FETCH_POOL) freecache(c);
+    switch (c->backend->fetch(c->bdb, key, strlen(key), &data, &datalen,
+			      c->locks ? &c->tid : NULL)) {
+    case CYRUSDB_OK:
+	*value = NULL;
+	if (data != NULL && (*value = poolmemdup(c, data, datalen)) == NULL) {
+	    return (-1);
+	}
+	return (0);
+
+    case CYRUSDB_NOTFOUND:
+	*value = NULL;
+	return (0);
+    }
+
+    return (-1);
+}
+
+/* commit the changes made to a locked cache in its storage engine
+ * returns -1 on failure, 0 on success
+ */
+static int commitbackend(c)
+    cache *c;
+{
+    struct stat before, after;		/* file statistics buffers */
+    struct txn *tid;			/* transaction to commit */
+
+    if (c->loaded && stat(c->db, &before) < 0) freecache(c);
+    tid = c->tid;
+    c->tid = NULL;
+    if (tid != NULL && c->backend->commit(c->bdb, tid) != CYRUSDB_OK) {
+	syslog(LOG_ERR, "IOERROR: committing %s", c->db);
+	freecache(c);
+	return (-1);
+    }
+
+/* : keep a loaded cache current with the file the commit left.  The
+     commit may checkpoint the file into a smaller new one, and unlocks it,
+     so only a file our own commit explains is taken as current; anything
+     else is reloaded on the next access */
+    if (c->loaded) {
+	if (stat(c->db, &after) < 0) {
+	    freecache(c);
+	} else if (after.st_ino == before.st_ino
+		   ? after.st_size == before.st_size
+		   : after.st_size <= before.st_size) {
+	    c->ino = after.st_ino;
+	    c->size = after.st_size;
+	    c->mtime = after.st_mtime;
+	} else {
+	    c->ino = 0;
+	}
+    }
+    if (c->modified) ++c->flushes;
+    c->modified = 0;
+
+    return (0);
+}
+
+/* write the cache content to its database file in a storage engine's
+ * format, replacing it
+ * returns -1 on failure, 0 on success
+ */
+static int writebackend(c, be)
+    cache *c;
+    struct cyrusdb_backend *be;
+{
+    struct db *db;			/* new file */
+    struct txn *tid;			/* transaction filling it */
+    unsigned long pg, n;		/* index page and pairs left in it */
+    sdb_keyvalue *kv;			/* current keyvalue pair */
+    int r;				/* engine result */
+    char newname[MAXDBPATHLEN + 5];
+
+/* : fill a new file in one transaction */
+    snprintf(newname, sizeof(newname), newext, c->db);
+    unlink(newname);
+    if (be->open(newname, CYRUSDB_CREATE | (c->icase ? CYRUSDB_ICASE : 0)
+		 | (sdb_syncmode != SDB_SYNC_NONE ? CYRUSDB_SYNC : 0),
+		 &db) != CYRUSDB_OK) {
+	return (-1);
+    }
+    tid = NULL;
+    r = CYRUSDB_OK;
+    for (pg = 0; r == CYRUSDB_OK && pg < c->pagecount; ++pg) {
+	kv = c->page[pg]->kv;
+	for (n = c->page[pg]->count; r == CYRUSDB_OK && n; --n, ++kv) {
+	    r = be->store(db, kv->key, strlen(kv->key), kv->value,
+			  kv->value == NULL ? 0 : strlen(kv->value), &tid);
+	}
+    }
+    if (tid != NULL) {
+	if (r == CYRUSDB_OK) {
+	    r = be->commit(db, tid);
+	} else {
+	    be->abort(db, tid);
+	}
+    }
+    be->close(db);
+
+/* : replace the old file */
+    if (r != CYRUSDB_OK || rename(newname, c->db) < 0) {
+	unlink(newname);
+	return (-1);
+    }
+    syncwrite(c, -1, SYNC_DIR);
+
+    return (0);
+}
+
+/*  */
+
+/* initialize sdb module (add to synchronization)
+ * returns -1 on failure, 0 on success
+ */
+int sdb_init()
+{
+    int i, shard;
+    struct stat stbuf;
+    char path[MAXPATHLEN];
+
+    /* register the global databases */
+    for (i = 0; globdbstr[i]; ++i) findcache(globdbstr[i]);
+    for (i = 0; sharddbstr[i]; ++i) {
+	for (shard = 0; shard < SDB_SHARDS; ++shard) {
+	    snprintf(path, sizeof(path), "%s.%d", sharddbstr[i], shard);
+	    findcache(path);
+	}
+    }
+
+    /* initialize directories */
+    snprintf(path, sizeof(path), "%s/%s", PREFIX, PRIVPREFIX);
+    if (stat(path, &stbuf) < 0) {
+	mkdir(PREFIX, 0700);
+	if (mkdir(path, 0700) < 0) {
+	    return (-1);
+	}
+    }
+
+    return (0);
+}
+
+/* start watching the database directories for changes made by other
+ * processes.  Each server process calls this for itself after forking,
+ * since the watch is read by the process that set it up.
+ * returns -1 if changes can't be watched, 0 on success
+ */
+int sdb_watch()
+{
+#ifdef HAVE_SYS_INOTIFY_H
+    int flags;
+    char path[MAXDBPATHLEN+1];
+
+    /* leave a watch inherited from the parent to the parent */
+    if (watchfd != -1) {
+	close(watchfd);
+	watchfd = -1;
+	userwd = -1;
+	while (watchlist != NULL) watchdrop(watchlist);
+    }
+
+    /* events are read as caches are used, without waiting for them */
+    if ((watchfd = inotify_init()) < 0) return (-1);
+    if ((flags = fcntl(watchfd, F_GETFL, 0)) < 0
+	|| fcntl(watchfd, F_SETFL, flags | O_NONBLOCK) < 0) {
+	close(watchfd);
+	watchfd = -1;
+	return (-1);
+    }
+
+    /* the user directory tells when user directories come and go */
+    snprintf(path, sizeof(path), "%s/%s", PREFIX, PRIVPREFIX);
+    userwd = inotify_add_watch(watchfd, path, WATCH_EVENTS);
+    if (userwd < 0) userwd = -1;
+
+    return (0);
+#else
+    return (-1);
+#endif
+}
+
+/* write pending changes and free cached database files
+ */
+
+/* HISTORY
+ * IncrDev Feb 21, 1996 by sh: to write modified caches before freeing them
+ * END HISTORY */
+
+void sdb_done()
+{
+    cache *c, *next;
+
+    /* log the cache statistics of the process */
+    if (sdb_counts.hits || sdb_counts.misses) {
+	syslog(LOG_DEBUG, "imspd: caches: %lu bytes, %lu hits, %lu misses, "
+	       "%lu evictions, %lu writebacks", sdb_bytes, sdb_counts.hits,
+	       sdb_counts.misses, sdb_counts.evictions, sdb_counts.writebacks);
+    }
+
+    /* write and free caches, keeping the ones with open handles */
+    for (c = cachelist; c != NULL; c = next) {
+	next = c->next;
+	dropcache(c);
+    }
+    sdb_pending = 0;
+
+#ifdef HAVE_SYS_INOTIFY_H
+    /* stop watching.  Closing the descriptor drops the watches, and leaves
+     * them alone in a parent that shares it.
+     */
+    if (watchfd != -1) {
+	close(watchfd);
+	watchfd = -1;
+	userwd = -1;
+	while (watchlist != NULL) watchdrop(watchlist);
+    }
+#endif
+}
+
+
+/* flush global and/or private databases to disk by folding the logs of
+ * cached databases into their files
+ */
+
+void sdb_flush(flags)
+int flags;
+{
+    cache *c;
+
+    /* compact global caches (to /var/imsp/<db>) and/or private caches
+     * (to /var/imsp/user/.../<db>)
+     */
+    for (c = cachelist; c != NULL; c = c->next) {
+	if (!(flags & (c->priv ? SDB_FLUSH_PRIVATE : SDB_FLUSH_GLOBAL))) {
+	    continue;
+	}
+	if (c->logpos && !c->locks && lockcache(c, c->icase, NULL) == 0) {
+	    if (c->logpos) compactlog(c);
+	    unlockcache(c);
+	}
+    }
+}
+
+/* load the global databases that exist, or bring already loaded ones up to
+ * date with their files and logs.  The server calls this before forking
+ * each connection, so every child starts with the same, current copy of
+ * the global databases: the mapped files are shared through the page
+ * cache and the cache indexes are shared copy-on-write, instead of each
+ * child loading its own.  The parent only reloads a database when a writer
+ * has changed it, and then only applies the new log records.
+ */
+
+void sdb_refresh(flags)
+int flags;
+{
+    cache *c;
+    struct stat stbuf;
+
+    for (c = cachelist; c != NULL; c = c->next) {
+	if (c->priv || c->locks) continue;
+	if (!c->loaded && stat(c->db, &stbuf) < 0) continue;
+	loadcache(c, flags & ~SDB_QUICK);
+	c->sharegen = c->loaded ? c->gen : 0;
+    }
+}
+
+/* set a tuning parameter of the sdb module
+ *  returns -1 on failure, 0 on success
+ */
+int sdb_config(param, value)
+    int param;
+    long value;
+{
+    switch (param) {
+    case SDB_CONF_SLOTS:
+	if (value < 1) return (-1);
+	sdb_slots = value;
+	break;
+
+    case SDB_CONF_MAXBYTES:
+	if (value < 0) return (-1);
+	sdb_maxbytes = value;
+	break;
+
+    case SDB_CONF_SYNC:
+	if (value != SDB_SYNC_NONE && value != SDB_SYNC_GROUP
+	    && value != SDB_SYNC_STRICT) {
+	    return (-1);
+	}
+	sdb_sync(1);
+	sdb_syncmode = value;
+	break;
+
+    case SDB_CONF_SYNCWRITES:
+	if (value < 1) return (-1);
+	sdb_syncwrites = value;
+	break;
+
+    case SDB_CONF_SYNCDELAY:
+	if (value < 0) return (-1);
+	sdb_syncdelay = value;
+	break;
+
+    default:
+	return (-1);
+    }
+
+    return (0);
+}
+
+/* get the memory use and hit counts of the caches of this process
+ */
+void sdb_stats(stats)
+    sdb_cachestats *stats;
+{
+    cache *c;
+
+    *stats = sdb_counts;
+    stats->bytes = sdb_bytes;
+    stats->caches = 0;
+    for (c = cachelist; c != NULL; c = c->next) {
+	if (c->bytes) ++stats->caches;
+    }
+}
+
+/* free the caches that have been used least, for their size, until the
+ * memory used by caches is back under sdb_maxbytes.  Data returned by
+ * sdb_get() or by sdb_match() without copying may become invalid.
+ */
+void sdb_trim()
+{
+    cache *c, *victim;
+    unsigned long bytes;
+    long age;
+    double cost, best;
+
+    if (sdb_maxbytes <= 0 || sdb_bytes <= sdb_maxbytes) return;
+    for (;;) {
+/* : count the memory the limit applies to */
+	bytes = 0;
+	for (c = cachelist; c != NULL; c = c->next) {
+	    if (!INHERITED(c)) bytes += c->bytes;
+	}
+	if (bytes <= sdb_maxbytes) return;
+
+/* : pick the unlocked cache with the most memory for its age */
+	victim = NULL;
+	best = 0;
+	for (c = cachelist, age = 1; c != NULL; c = c->next, ++age) {
+	    if (c->locks || c->pins || c->bytes == 0 || INHERITED(c)) continue;
+	    cost = (double) c->bytes * age;
+	    if (cost >= best) {
+		best = cost;
+		victim = c;
+	    }
+	}
+	if (victim == NULL) return;
+
+/* : write it back, and drop it or free its memory */
+	writeback(victim);
+	++sdb_counts.evictions;
+	if (victim->priv && victim->opens == 0) {
+	    dropcache(victim);
+	} else {
+	    freecache(victim);
+	}
+    }
+}
+
+/* make writes waiting for a group commit durable.  Unless force is set,
+ * this waits until the group is complete: sdb_syncwrites writes, or a
+ * write that has waited sdb_syncdelay seconds.
+ */
+void sdb_sync(force)
+    int force;
+{
+    cache *c;
+
+    if (!sdb_pending) return;
+    if (!force && sdb_pending < sdb_syncwrites
+	&& time(NULL) - sdb_pendtime < sdb_syncdelay) {
+	return;
+    }
+    for (c = cachelist; c != NULL; c = c->next) {
+	if (c->syncpending) synccache(c, c->syncpending);
+    }
+    sdb_pending = 0;
+}
+
+/* check if a database exists
+ *  returns 0 if exists, -1 otherwise
+ */
+int sdb_check(db)
+    char *db;
+{
+    cache *c;
+    struct stat stbuf;
+    
+    if ((c = findcache(db)) == NULL) return (-1);
+    if (c->loaded) return (0);
+
+    /* a watched directory knows the names in it */
+    switch (watchexists(c->db)) {
+	case 0:
+	    return (-1);
+	case 1:
+	    return (0);
+    }
+
+    return (stat(c->db, &stbuf) >= 0 ? 0 : -1);
+}
+
+/* create a new database.  fails if database exists or isn't createable.
+ * returns -1 on failure, 0 on success
+ */
+int sdb_create(db)
+    char *db;
+{
+    int fd;
+    char *scan;
+    char lname[MAXDBPATHLEN + 8];
+    cache *c;
+    struct stat stbuf;
+
+    /* verify that db is valid & doesn't exist */
+    if ((c = findcache(db)) == NULL || c->loaded || stat(c->db, &stbuf) >= 0) {
+	return (-1);
+    }
+
+    /* make user's subdirectory if needed */
+    if (!strncmp(db, PRIVPREFIX, PRIVPREFIXLEN)) {
+	scan = strchr(c->db + PREFIXLEN + PRIVPREFIXLEN + 2, '/');
+	if (scan == NULL) return (-1);
+	*scan = '\0';
+	mkdir(c->db, 0700);
+	*scan = '/';
+    }
+
+    /* create datafile, removing any stale log */
+    snprintf(lname, sizeof(lname), logext, c->db);
+    unlink(lname);
+    if ((fd = open(c->db, O_WRONLY | O_CREAT, 0600)) < 0 || close(fd) < 0) {
+	return (-1);
+    }
+
+    return (0);
+}
+
+/* delete a database.  fails if database isn't deletable.
+ * returns -1 on failure, 0 on success
+ */
+int sdb_delete(db)
+    char *db;
+{
+    char lname[MAXDBPATHLEN + 16];
+    cache *c;
+    
+    if ((c = findcache(db)) == NULL || c->locks) return (-1);
+
+    /* remove file, log, export and empty cache */
+    if (unlink(c->db) < 0) return (-1);
+    snprintf(lname, sizeof(lname), logext, c->db);
+    unlink(lname);
+    snprintf(lname, sizeof(lname), exportext, c->db);
+    unlink(lname);
+    freecache(c);
+    closebackend(c);
+    c->backend = NULL;
+    c->fmtino = 0;
+
+    /* try removing user directory for cleanliness sake */
+    if (!strncmp(db, PRIVPREFIX, PRIVPREFIXLEN)) {
+	strcpy(lname, c->db);
+	*strrchr(lname, '/') = '\0';
+	rmdir(lname);
+    }
+
+    return (0);
+}
+
+
+/* copy the contents of one database to another
+ *  returns -1 on failure, 0 on success
+ */
+int sdb_copy(dbsrc, dbdst, flags)
+    char *dbsrc, *dbdst;
+    int flags;
+{
+    cache *citem, *dst;
+    cache out;				/* source index under the dest's name */
+    char dbname[MAXDBPATHLEN+1];
+    int fd=0, result;
+
+    /* create the destination. this locks and prevents another
+    * rename from happening. */
+    if (sdb_create(dbdst) < 0) {
+      return (-1);
+    }
+
+    if ((citem = findcache(dbdst)) == NULL) {
+      sdb_delete(dbdst);
+      return (-1);
+    }
+    strcpy(dbname, citem->db);
+    /* grab lock on destination */
+    if ((fd = open(dbname, O_RDWR|O_CREAT, 0600)) < 0) {
+      sdb_delete(dbdst);
+      return (-1);
+    }
+
+    if (lock_reopen(fd, citem->db, NULL, NULL) < 0) {
+      sdb_delete(dbdst);
+      close(fd);
+      return (-1);
+    }
+    /* make sure files are valid */
+    if (((citem = findcache(dbsrc)) == NULL) || citem->locks) {
+      sdb_delete(dbdst);
+      return (-1);
+    }
+
+    /* read in source */
+    if (loadcache(citem, flags) < 0) {
+	lock_unlock(fd);
+	close(fd);
+	return (-1);
     }
 
-    if ((c->locks == 0) || (c->fd == -1)) {
-	fd = open(c->db, O_RDONLY);
-	if (fd < 0) {
-	  if (imspd_debug) {
-	    fprintf(stderr,"%s: ", c->db);
-	    perror("failed to open DB");
-	  }
-	  return (-1);
-	}
-	c->fd = fd;
+    /* write the source cache out as the destination & unlock file.  The
+     * write goes through a cache with just the destination's name and the
+     * source's index, so the source keeps its own file statistics.
+     */
+    memset((char *) &out, 0, sizeof (out));
+    strcpy(out.db, dbname);
+    out.fd = -1;
+    out.icase = citem->icase;
+    out.page = citem->page;
+    out.pagecount = citem->pagecount;
+    out.cachecount = citem->cachecount;
+    result = citem->backend != NULL ? writebackend(&out, citem->backend)
+	: writecache(&out);
+    lock_unlock(fd);
+    close(fd);
+
+    /* leave the destination's directory sync and write statistics with
+     * the destination's cache, or sync now if it's gone
+     */
+    if ((dst = findcache(dbdst)) == NULL) {
+	if (out.syncpending) synccache(&out, out.syncpending);
+    } else {
+	dst->syncpending |= out.syncpending;
+	dst->flushes += out.flushes;
+	dst->syncs += out.syncs;
+	dst->synctime += out.synctime;
+	if (out.syncmax > dst->syncmax) dst->syncmax = out.syncmax;
     }
 
-/* ESYS DOC - this is a very expensive proposition if the file is large.  For
-   a short while, we will have allocated in virtual memory TWICE the size
-   of the file.   This should be changed to some sort of chained buffer
-   structure like the c-client file string driver.   Reasonably fast and
-   not too expensive in memory. */
-/* : allocate a buffer to hold the database file text */
-    data = (char *) malloc(stbuf.st_size + 1);
-    if (data == NULL) {
-      if (imspd_debug) {
-	perror("malloc of data failed");
-      } else {
-	syslog(LOG_ERR, "imspd: Unable to allocate %d bytes for %s: %m",
-	       stbuf.st_size+1, c->db);
-      }
-      CLEANUP_RETURN(-1);
+    return (result);
+}
+
+/* write a new file in format be (NULL for the flat format) from the index
+ * of a locked and loaded cache over the old one, which is still locked,
+ * and drop the old file's log.  The cache is freed and unlocked, and the
+ * next access finds the new file.
+ * returns -1 on failure, 0 on success
+ */
+static int rewritecache(c, be)
+    cache *c;
+    struct cyrusdb_backend *be;
+{
+    char lname[MAXDBPATHLEN + 8];
+    int rtval;
+
+    rtval = be != NULL ? writebackend(c, be) : writecache(c);
+    if (rtval == 0) {
+	snprintf(lname, sizeof(lname), logext, c->db);
+	unlink(lname);
+	c->logino = c->logpos = 0;
     }
 
-/* : read data from file into the data buffer */
-    count = read(fd, data, stbuf.st_size);
-    if (count != stbuf.st_size) {
-      if (imspd_debug) {
-	fprintf(stderr, "internal consistency error count(%d) != stbuf.st_size (%d)\n",
-		count, stbuf.st_size);
-      }
-	CLEANUP_RETURN(-1);
+    /* release the old file.  A new flat file written for an engine's file
+     * comes back locked.
+     */
+    if (c->backend != NULL && c->fd != -1) {
+	lock_unlock(c->fd);
+	close(c->fd);
+	c->fd = -1;
     }
-    data[count] = '\0';			/* set a sentinel -- THIS IS IMPORTANT!*/
+    freecache(c);
+    if (unlockcache(c) < 0) rtval = -1;
+    closebackend(c);
+    c->backend = NULL;
+    c->fmtino = 0;
 
-/* : parse the database data into the cache */
-    if (parsecache(c, data, flags) < 0) {
-	freecache(c);
-	if (imspd_debug) {
-	  fprintf(stderr,"parsecache failed\n");
+    return (rtval);
+}
+
+/* convert a database to another storage format: "flat" for the binary
+ * files of this module, or the name of a storage engine.  A NULL format
+ * rewrites the database in its own format, folding in its log.  flags
+ * select the key order of the new file, as for sdb_get.
+ *  returns -1 on failure, 0 on success
+ */
+int sdb_convert(db, format, flags)
+    char *db, *format;
+    int flags;
+{
+    cache *c;
+    struct cyrusdb_backend *be;
+    int i;
+
+    if ((c = findcache(db)) == NULL || c->locks) return (-1);
+    be = NULL;
+    if (format != NULL && strcmp(format, "flat")) {
+	for (i = 0; backends[i] != NULL; ++i) {
+	    if (!strcmp(backends[i]->name, format)) be = backends[i];
 	}
-	CLEANUP_RETURN(-1);
+	if (be == NULL) return (-1);
     }
 
-/* : mark the cache as loaded and not modified */
-    c->loaded = 1;
-    c->modified = 0;
-    c->icase = flags & SDB_ICASE;
+    /* lock & load the database in its current format */
+    if (lockcache(c, flags, NULL) < 0) return (-1);
+    if (loadcache(c, flags & ~SDB_QUICK) < 0) {
+	unlockcache(c);
+	return (-1);
+    }
+    if (format == NULL) {
+	be = c->backend;
+    } else if (be == c->backend && (flags & SDB_ICASE) == c->icase
+	       && (be != NULL || c->mapped || c->cachecount == 0)) {
+	return (unlockcache(c));
+    }
 
- CLEANUP:
-/* : free the database data buffer */
-    if (data != NULL) {
-	free(data);
+    return (rewritecache(c, be));
+}
+
+/* a pair read by sdb_bulkload or a change in a batch, and its place in
+ * the stream
+ */
+typedef struct bulkpair {
+    char *key;
+    char *value;
+    unsigned long seq;
+    int op;				/* '+' to set, '-' to remove, 0 for none */
+} bulkpair;
+
+/* compare two bulkpairs by key, then by place in the stream
+ */
+static int bulkcmp(p1, p2)
+    bulkpair *p1, *p2;
+{
+    int cmp = strcmp(p1->key, p2->key);
+
+    return (cmp ? cmp : p1->seq < p2->seq ? -1 : 1);
+}
+static int ibulkcmp(p1, p2)
+    bulkpair *p1, *p2;
+{
+    int cmp = strcasecmp(p1->key, p2->key);
+
+    return (cmp ? cmp : p1->seq < p2->seq ? -1 : 1);
+}
+
+/* sort pairs by key in the order flags select, unless they're sorted
+ * already, keeping only the last pair for each key
+ * returns the number of pairs left
+ */
+static unsigned long sortpairs(pairs, count, flags, sorted)
+    bulkpair *pairs;
+    unsigned long count;
+    int flags;
+    int sorted;
+{
+    unsigned long i, n;
+    int (*cmpf)();
+
+    cmpf = (flags & SDB_ICASE) ? strcasecmp : strcmp;
+    if (!sorted) {
+	qsort(pairs, count, sizeof (bulkpair),
+	      (flags & SDB_ICASE) ? ibulkcmp : bulkcmp);
+    }
+    for (i = n = 0; i < count; ++i) {
+	if (i + 1 == count || (*cmpf)(pairs[i].key, pairs[i + 1].key)) {
+	    pairs[n++] = pairs[i];
+	}
     }
 
-/* : close the database file if unlocked */
-    if (c->locks == 0) {
-	close(fd);
-	c->fd = -1;
+    return (n);
+}
+
+/* add a stream of pairs to a database, writing the database file once
+ * rather than logging each pair and growing the index a key at a time.
+ * next(rock, &key, &value) returns 1 and the next pair, 0 at the end of
+ * the stream, or -1 on failure; key and value need only last until the
+ * next call.  The stream may come in any order; sorted streams skip the
+ * sort.  The last value in the stream for a key wins over earlier ones and
+ * the database's.  flags select the key order, as for sdb_get.  The
+ * database is locked and loaded while next is called, so next may read it
+ * with sdb_get, as abook_import does to charge quota for what it replaces.
+ *  returns -1 on failure, leaving the database as it was, 0 on success
+ */
+int sdb_bulkload(db, flags, next, rock)
+    char *db;
+    int flags;
+    int (*next)();
+    void *rock;
+{
+    cache *c;
+    bulkpair *pairs, *bp;
+    sdb_keyvalue *merged, *kv, *old;
+    unsigned long count, size, i, pg, idx;
+    int r, cmp, sorted;
+    char *key, *value;
+    int (*cmpf)();
+
+    if ((c = findcache(db)) == NULL || c->locks) return (-1);
+    if (lockcache(c, flags, NULL) < 0) return (-1);
+    if (loadcache(c, flags & ~SDB_QUICK) < 0) {
+	unlockcache(c);
+	return (-1);
     }
+    cmpf = (flags & SDB_ICASE) ? strcasecmp : strcmp;
 
-/* : return the return value */
-    return(rtval);
+/* : read the stream into the cache's string pool, noting if it's sorted */
+    pairs = NULL;
+    count = size = 0;
+    sorted = 1;
+    while ((r = (*next)(rock, &key, &value)) > 0) {
+	if (count == size) {
+	    size = size ? size * 2 : KVPAGE;
+	    bp = (bulkpair *) (pairs == NULL
+			       ? malloc(size * sizeof (bulkpair))
+			       : realloc((char *) pairs,
+					 size * sizeof (bulkpair)));
+	    if (bp == NULL) {
+		r = -1;
+		break;
+	    }
+	    pairs = bp;
+	}
+	bp = pairs + count;
+	bp->seq = count;
+	bp->op = '+';
+	if ((bp->key = poolstrdup(c, key)) == NULL
+	    || ((bp->value = value) != NULL
+		&& (bp->value = poolstrdup(c, value)) == NULL)) {
+	    r = -1;
+	    break;
+	}
+	if (count++ && sorted && (*cmpf)(bp[-1].key, bp->key) > 0) {
+	    sorted = 0;
+	}
+    }
+    if (r < 0 || count == 0) {
+	if (pairs != NULL) free((char *) pairs);
+	return (unlockcache(c) < 0 || r < 0 ? -1 : 0);
+    }
+
+/* : sort the stream, keeping the last pair for each key */
+    count = sortpairs(pairs, count, flags, sorted);
+
+/* : merge it with the index, the stream's values winning */
+    merged = (sdb_keyvalue *)
+	malloc((c->cachecount + count) * sizeof (sdb_keyvalue));
+    if (merged == NULL) {
+	free((char *) pairs);
+	unlockcache(c);
+	return (-1);
+    }
+    kv = merged;
+    i = 0;
+    for (pg = 0; pg < c->pagecount; ++pg) {
+	for (idx = 0; idx < c->page[pg]->count; ++idx) {
+	    old = c->page[pg]->kv + idx;
+	    cmp = 1;
+	    while (i < count && (cmp = (*cmpf)(pairs[i].key, old->key)) < 0) {
+		kv->key = pairs[i].key;
+		kv++->value = pairs[i++].value;
+	    }
+	    kv->key = old->key;
+	    kv++->value = cmp ? old->value : pairs[i++].value;
+	}
+    }
+    for (; i < count; ++i) {
+	kv->key = pairs[i].key;
+	kv++->value = pairs[i].value;
+    }
+    free((char *) pairs);
+
+/* : replace the index, letting open cursors keep the old one */
+    REFUND(c, c->pagecount * sizeof (kvpage)
+	   + c->pagesize * sizeof (kvpage *));
+    if (c->cur != NULL) retire(c, 1);
+    if (c->page != NULL) {
+	while (c->pagecount) free((char *) c->page[--c->pagecount]);
+	free((char *) c->page);
+	c->page = NULL;
+    }
+    c->pagesize = 0;
+    c->cachecount = 0;
+    ++c->gen;
+    if (buildindex(c, merged, kv - merged, flags, 1) < 0) {
+	freecache(c);
+	unlockcache(c);
+	return (-1);
+    }
+
+    return (rewritecache(c, c->backend));
 }
 
-/*  */
+/* NOTES
+ * A batch gathers the sets and removes of a group of keys, like the fields
+ * of an address book entry, to apply them to a locked database together.
+ * The changes are sorted once, and a key changed twice keeps its last
+ * change.  A small batch goes into the index a key at a time.  A batch
+ * large enough that this would move more pairs around than the index
+ * holds is merged with the index in one pass into new pages instead,
+ * keeping the folded keys the index has.  Room for all of the batch's log
+ * records is made before the index is touched, and the records go out
+ * with the lock's others in the single write made at unlock; if the index
+ * can't be changed, no record is kept and the cache is dropped, so the
+ * batch is applied whole or not at all.  A storage engine gets the changes
+ * in the transaction the lock holds.
+ * END NOTES */
+
+/* a batch of changes, private to the sdb module */
+struct sdb_batch {
+    bulkpair *pair;			/* changes, in the order made */
+    unsigned long count;		/* number of changes */
+    unsigned long size;			/* allocated slots in pair */
+    struct mpool *pool;			/* copies of keys and values */
+    int err;				/* set once a change couldn't be kept */
+};
 
-/* write the cache content to database file
+/* start a batch of changes
+ * returns NULL on failure
  */
+sdb_batch *sdb_batch_open()
+{
+    sdb_batch *b;
 
-/* HISTORY
- * IncrDev Feb 21, 1996 by sh: changed contract to just write cache to file
- * END HISTORY */
+    b = (sdb_batch *) malloc(sizeof (sdb_batch));
+    if (b == NULL) return (NULL);
+    memset((char *) b, '\0', sizeof (sdb_batch));
 
+    return (b);
+}
 
-static int writecache(c)
+/* add a change to a batch, copying the key and value
+ * returns -1 on failure, 0 on success
+ */
+static int batchadd(b, op, key, value)
+    sdb_batch *b;
+    int op;
+    char *key, *value;
+{
+    bulkpair *bp;
+    unsigned long size;
+
+    if (b == NULL) return (-1);
+    if (b->count == b->size) {
+	size = b->size ? b->size * 2 : 16;
+	bp = (bulkpair *) (b->pair == NULL
+			   ? malloc(size * sizeof (bulkpair))
+			   : realloc((char *) b->pair,
+				     size * sizeof (bulkpair)));
+	if (bp == NULL) {
+	    b->err = 1;
+	    return (-1);
+	}
+	b->pair = bp;
+	b->size = size;
+    }
+    if (b->pool == NULL) b->pool = new_mpool(POOL_SIZE);
+    bp = b->pair + b->count;
+    bp->key = mpool_strdup(b->pool, key);
+    bp->value = value == NULL ? NULL : mpool_strdup(b->pool, value);
+    bp->seq = b->count++;
+    bp->op = op;
+
+    return (0);
+}
+
+int sdb_batch_set(b, key, value)
+    sdb_batch *b;
+    char *key, *value;
+{
+    return (batchadd(b, '+', key, value));
+}
+
+int sdb_batch_remove(b, key)
+    sdb_batch *b;
+    char *key;
+{
+    return (batchadd(b, '-', key, (char *) NULL));
+}
+
+/* finish with a batch
+ */
+void sdb_batch_close(b)
+    sdb_batch *b;
+{
+    if (b == NULL) return;
+    if (b->pool != NULL) free_mpool(b->pool);
+    if (b->pair != NULL) free((char *) b->pair);
+    free((char *) b);
+}
+
+/* merge sorted changes with the index of a cache in one pass, into new
+ * pages.  A remove of a key that isn't there has its op cleared.
+ * returns -1 on failure, leaving the index as it was, 0 on success
+ */
+static int mergebatch(c, pairs, count)
     cache *c;
+    bulkpair *pairs;
+    unsigned long count;
 {
-    FILE *out;
-    int i;
-    char *scan;
-    char newname[MAXDBPATHLEN + 5];
+    kvpage **pages, *page;
+    unsigned long npages, size, total, pg, idx, i;
+    sdb_keyvalue *old;
+    char *key, *value, *fold;
+    int cmp;
+    int (*cmpf)();
+
+    cmpf = c->icase ? strcasecmp : strcmp;
+    size = (c->cachecount + count) / KVPAGE + 1;
+    pages = (kvpage **) malloc(size * sizeof (kvpage *));
+    if (pages == NULL) return (-1);
+    npages = total = 0;
+    page = NULL;
+    pg = idx = i = 0;
+    while (pg < c->pagecount || i < count) {
+
+/* : take the next pair of the index, the batch, or both for the same key */
+	old = pg < c->pagecount ? c->page[pg]->kv + idx : NULL;
+	cmp = old == NULL ? 1 : i == count ? -1
+	    : (*cmpf)(old->key, pairs[i].key);
+	key = value = fold = NULL;
+	if (cmp <= 0) {
+	    key = old->key;
+	    value = old->value;
+	    fold = c->page[pg]->fold[idx];
+	    if (++idx == c->page[pg]->count) {
+		++pg;
+		idx = 0;
+	    }
+	}
+	if (cmp >= 0) {
+	    if (pairs[i].op == '-') {
+		if (cmp > 0) pairs[i].op = 0;
+		++i;
+		continue;
+	    }
+	    if (cmp > 0 && ((key = poolstrdup(c, pairs[i].key)) == NULL
+			    || (fold = foldkey(c, key)) == NULL)) {
+		goto FAIL;
+	    }
+	    if ((value = pairs[i++].value) != NULL
+		&& (value = poolstrdup(c, value)) == NULL) {
+		goto FAIL;
+	    }
+	}
 
-/* : open new database file for output */
-    snprintf(newname, sizeof(newname), newext, c->db);
-    if ((out = fopen(newname, "w")) == NULL) {
-	return (-1);
+/* : add it to the last new page, starting another once that's full */
+	if (page == NULL || page->count == KVPAGE) {
+	    if ((page = (kvpage *) malloc(sizeof (kvpage))) == NULL) goto FAIL;
+	    page->count = 0;
+	    pages[npages++] = page;
+	}
+	page->kv[page->count].key = key;
+	page->kv[page->count].value = value;
+	page->fold[page->count++] = fold;
+	++total;
     }
 
-/* : walk the cache writing keyvalue elements to the database file */
-    for (i = 0; i < c->cachecount; ++i) {
-	if (c->kv[i].key == NULL) continue;
-	for (scan = c->kv[i].key; *scan; ++scan) {
-	    if (*scan == '\n') {
-		putc('\\', out);
-		putc('n', out);
-	    } else if (*scan == ' ') {
-		putc('\\', out);
-		putc('s', out);
-	    } else if (*scan == '\\') {
-		putc('\\', out);
-		putc('\\', out);
+/* : replace the index, letting open cursors keep the old one */
+    REFUND(c, c->pagecount * sizeof (kvpage)
+	   + c->pagesize * sizeof (kvpage *));
+    if (c->cur != NULL) retire(c, 1);
+    if (c->page != NULL) {
+	while (c->pagecount) free((char *) c->page[--c->pagecount]);
+	free((char *) c->page);
+    }
+    c->page = pages;
+    c->pagecount = npages;
+    c->pagesize = size;
+    c->cachecount = total;
+    CHARGE(c, npages * sizeof (kvpage) + size * sizeof (kvpage *));
+    ++c->gen;
+
+    return (0);
+
+ FAIL:
+    while (npages) free((char *) pages[--npages]);
+    free((char *) pages);
+    return (-1);
+}
+
+/* apply a batch to a database, which must be locked for its keys
+ * returns -1 on failure, 0 on success
+ */
+int sdb_dbbatch_apply(h, b, flags)
+    sdb_db *h;
+    sdb_batch *b;
+    int flags;
+{
+    cache *c;
+    bulkpair *bp;
+    unsigned long count, i, need;
+    int r;
+
+    if ((c = h) == NULL || !c->locks || b == NULL || b->err) return (-1);
+    if (b->count == 0) return (0);
+
+/* : sort the changes the way the index is, keeping each key's last */
+    count = sortpairs(b->pair, b->count, c->loaded ? c->icase : flags, 0);
+    b->count = count;
+
+/* : a storage engine changes its file in the lock's transaction */
+    if (c->backend != NULL) {
+	for (i = 0; i < count; ++i) {
+	    bp = b->pair + i;
+	    if (bp->op == '+') {
+		r = c->backend->store(c->bdb, bp->key, strlen(bp->key),
+				      bp->value, bp->value == NULL
+				      ? 0 : strlen(bp->value), &c->tid);
 	    } else {
-		putc(*scan, out);
+		r = c->backend->delete(c->bdb, bp->key, strlen(bp->key),
+				       &c->tid);
+		if (r == CYRUSDB_NOTFOUND) r = CYRUSDB_OK;
 	    }
+	    if (r != CYRUSDB_OK) return (-1);
 	}
-	if (c->kv[i].value != NULL) {
-	    putc(' ', out);
-	    for (scan = c->kv[i].value; *scan; ++scan) {
-		if (*scan == '\n') {
-		    putc('\\', out);
-		    putc('n', out);
-		} else if (*scan == '\\') {
-		    putc('\\', out);
-		    putc('\\', out);
-		} else {
-		    putc(*scan, out);
-		}
-	    }
+	c->modified = 1;
+	if (!c->loaded) return (0);
+    } else {
+
+/* : make room for the log records before the index changes */
+	for (need = 0, i = 0; i < count; ++i) {
+	    bp = b->pair + i;
+	    need += bp->op == '+' && bp->value != NULL
+		? LOGNEED(bp->key, bp->value) : LOGKEYNEED(bp->key);
 	}
-	putc('\n', out);
+	if (logreserve(c, need) < 0) return (-1);
     }
 
-/* : make sure write & rename succeed */
-    if (fclose(out) == EOF || rename(newname, c->db) < 0) {
-	unlink(newname);
-	return (-1);
+/* : change the index, merging the batch with it if inserting a key at a
+     time would move more pairs, which is half a page per insert */
+    if (count * (KVPAGE / 2) >= c->cachecount) {
+	r = mergebatch(c, b->pair, count);
+    } else {
+	for (r = 0, i = 0; r == 0 && i < count; ++i) {
+	    bp = b->pair + i;
+	    if (bp->op == '+') {
+		r = cacheset(c, bp->key, flags, bp->value);
+	    } else if (cacheremove(c, bp->key, flags) < 0) {
+		bp->op = 0;
+	    }
+	}
     }
+    if (r < 0) freecache(c);
 
-/* : remove any stray locks */
-    if (c->locks) {
-	lock_unlock(c->fd);
-	close(c->fd);
-	c->locks = -1;
+/* : an engine's file has the changes even if its cache had to go */
+    if (c->backend != NULL) return (0);
+    if (r < 0) return (-1);
+
+/* : note the changes for the log */
+    for (i = 0; i < count; ++i) {
+	bp = b->pair + i;
+	if (bp->op) logrecord(c, bp->op, bp->key, bp->op == '+' ? bp->value
+			      : (char *) NULL);
     }
+    c->modified = 1;
 
-/* : return success */
     return (0);
 }
 
-/* initialize sdb module (add to synchronization)
+int sdb_batch_apply(db, b, flags)
+    char *db;
+    sdb_batch *b;
+    int flags;
+{
+    return (sdb_dbbatch_apply(findcache(db), b, flags));
+}
+
+/* NOTES
+ * An export of a database is written to "<db>.export." once and handed
+ * out again until the database changes, so that clients downloading a
+ * whole address book over and over cost a sendfile() rather than a walk
+ * of the database each.  The file starts with a line giving the inode
+ * and size of the database file and log and the file's mtime when the
+ * export was begun.  Every change appends to the log or to an engine's
+ * file, or replaces the file, so a different line means the export is
+ * stale.  The line is taken before the walk, so a change made during
+ * the walk only makes the export look stale sooner than it is.
+ * END NOTES */
+
+/* describe the state of the files of a database, for sdb_export
  * returns -1 on failure, 0 on success
  */
-int sdb_init()
+static int exportstamp(c, stamp, size)
+    cache *c;
+    char *stamp;
+    int size;
 {
-    int i;
-    struct stat stbuf;
-    char path[MAXPATHLEN];
+    struct stat dbst, logst;		/* file and log statistics */
+    char lname[MAXDBPATHLEN + 8];	/* log file name buffer */
+
+    if (stat(c->db, &dbst) < 0) return (-1);
+    snprintf(lname, sizeof(lname), logext, c->db);
+    if (stat(lname, &logst) < 0) {
+	if (errno != ENOENT) return (-1);
+	logst.st_ino = 0;
+	logst.st_size = 0;
+    }
+    snprintf(stamp, size, "%lu %lu %lu %lu %lu\n",
+	     (unsigned long) dbst.st_ino, (unsigned long) dbst.st_size,
+	     (unsigned long) dbst.st_mtime, (unsigned long) logst.st_ino,
+	     (unsigned long) logst.st_size);
+
+    return (0);
+}
+
+/* get an export of a database written by proc, kept in a file until the
+ * database changes
+ *  returns -1 on failure, or a descriptor open on the export's file
+ */
+int sdb_export(db, flags, proc, rock, offset, len)
+    char *db;
+    int flags;
+    int (*proc)();
+    void *rock;
+    long *offset, *len;
+{
+    cache *c;
+    struct stat stbuf;			/* export file statistics */
+    sdb_iter *it;			/* walk of the database */
+    FILE *out;				/* new export being written */
+    int fd, n, result;
+    char *key, *value;
+    char stamp[128], buf[128];		/* database state, and export's */
+    char ename[MAXDBPATHLEN + 16];	/* export file name */
+    char newname[MAXDBPATHLEN + 32];	/* new export file name */
 
-    /* initialize cache */
-    for (i = 0; i < NUMGDBSTR; ++i) {
-	memset(globdb[i].db, '\0', sizeof (globdb[i].db));
-	globdb[i].modified = 0;
-	globdb[i].loaded = 0;
-	globdb[i].locks = 0;
-	globdb[i].cachesize = 0;
-	globdb[i].cachecount = 0;
-    }
-    for (i = 0; i < NUMPDBSTR; ++i) {
-	memset(privdb[i].db, '\0', sizeof (privdb[i].db));
-	privdb[i].modified = 0;
-	privdb[i].loaded = 0;
-	privdb[i].locks = 0;
-	privdb[i].fd = -1;
-	privdb[i].cachesize = 0;
-	privdb[i].cachecount = 0;
+    if ((c = findcache(db)) == NULL) return (-1);
+    if (exportstamp(c, stamp, sizeof(stamp)) < 0) return (-1);
+    n = strlen(stamp);
+    snprintf(ename, sizeof(ename), exportext, c->db);
+
+/* : hand out the last export, if the database is as it was then */
+    if ((fd = open(ename, O_RDONLY)) >= 0) {
+	if (read(fd, buf, n) == n && !memcmp(buf, stamp, n)
+	    && fstat(fd, &stbuf) == 0) {
+	    *offset = n;
+	    *len = stbuf.st_size - n;
+	    return (fd);
+	}
+	close(fd);
     }
 
-    /* initialize directories */
-    snprintf(path, sizeof(path), "%s/%s", PREFIX, PRIVPREFIX);
-    if (stat(path, &stbuf) < 0) {
-	mkdir(PREFIX, 0700);
-	if (mkdir(path, 0700) < 0) {
-	    return (-1);
+/* : write a new export under a name of this process's own */
+    snprintf(newname, sizeof(newname), exportnewext, c->db, (int) getpid());
+    if ((out = fopen(newname, "w")) == NULL) return (-1);
+    result = fputs(stamp, out) == EOF ? -1 : 0;
+    if (result == 0) {
+	if ((it = sdb_iter_open(db, "*", flags, NULL)) == NULL) {
+	    result = -1;
+	} else {
+	    while ((result = sdb_iter_next(it, &key, &value)) > 0
+		   && (result = (*proc)(rock, out, key, value)) >= 0);
+	    sdb_iter_close(it);
 	}
     }
+    if (fclose(out) == EOF) result = -1;
+
+/* : keep it open while it replaces the last one */
+    fd = -1;
+    if (result < 0 || (fd = open(newname, O_RDONLY)) < 0
+	|| fstat(fd, &stbuf) < 0 || rename(newname, ename) < 0) {
+	if (fd >= 0) close(fd);
+	unlink(newname);
+	return (-1);
+    }
+    *offset = n;
+    *len = stbuf.st_size - n;
 
-    return (0);
+    return (fd);
 }
 
-/* flush (write) and free cached database files
+/* call proc with the name of each database, as for sdb_check, and rock:
+ * the global databases first, then each user's databases one after
+ * another.  The walk stops when proc returns non-zero.
+ *  returns -1 if the database directories can't be read, the non-zero
+ *  return of proc, or 0 at the end of the walk
  */
-
-/* HISTORY
- * IncrDev Feb 21, 1996 by sh: to write modified caches before freeing them
- * END HISTORY */
-
-void sdb_done()
+int sdb_walk(proc, rock)
+    int (*proc)();
+    void *rock;
 {
-    int i;
-    cache *c;
-
-    /* write and free caches */
-    for (i = 0; i < NUMGDBSTR; ++i) {
-	c = globdb + i;
-	if (c->modified) {
-	    writecache(c);
-	}
-	if (c->locks) {
-	    lock_unlock(c->fd);
-	    close(c->fd);
-	    c->fd = -1;
-	    c->locks = 0;
+    DIR *top, *dir;
+    struct dirent *ent, *uent;
+    struct stat stbuf;
+    int result;
+    char path[MAXDBPATHLEN+1];
+    char db[MAXDBLEN+1];
+
+    if ((top = opendir(PREFIX)) == NULL) return (-1);
+    result = 0;
+    while (result == 0 && (ent = readdir(top)) != NULL) {
+	if (checkname(ent->d_name) != 1) continue;
+
+	/* any plain file is a database; directories such as the user
+	 * directory are not
+	 */
+	if (snprintf(path, sizeof(path), "%s/%s", PREFIX, ent->d_name)
+	    >= sizeof(path)
+	    || stat(path, &stbuf) < 0 || !S_ISREG(stbuf.st_mode)) {
+	    continue;
 	}
-	freecache(c);
+	result = (*proc)(ent->d_name, rock);
     }
-    for (i = 0; i < NUMPDBSTR; ++i) {
-	c = privdb + i;
-	if (c->modified) {
-	    writecache(c);
+    closedir(top);
+    if (result != 0) return (result);
+
+    snprintf(path, sizeof(path), "%s/%s", PREFIX, PRIVPREFIX);
+    if ((top = opendir(path)) == NULL) return (-1);
+    while (result == 0 && (uent = readdir(top)) != NULL) {
+	if (uent->d_name[0] == '.') continue;
+	if (snprintf(path, sizeof(path), "%s/%s/%s", PREFIX, PRIVPREFIX,
+		     uent->d_name) >= sizeof(path)
+	    || (dir = opendir(path)) == NULL) {
+	    continue;
 	}
-	if (c->locks) {
-	    lock_unlock(c->fd);
-	    close(c->fd);
-	    c->fd = -1;
-	    c->locks = 0;
+	while (result == 0 && (ent = readdir(dir)) != NULL) {
+	    if (snprintf(db, sizeof(db), "%s/%s/%s", PRIVPREFIX, uent->d_name,
+			 ent->d_name) >= sizeof(db)
+		|| checkname(db) != 2) {
+		continue;
+	    }
+	    result = (*proc)(db, rock);
 	}
-	freecache(c);
+	closedir(dir);
     }
+    closedir(top);
+
+    return (result);
 }
 
+/* NOTES
+ * sdb_verify() reads a database's files as they are, rather than through
+ * its cache: loading a cache sorts the keys and replays the log, which
+ * hides the problems it looks for.  A file which isn't sorted the way the
+ * server reads it is sorted again by each process that loads it, and a
+ * damaged escape or partial log record means a lost or mangled key.
+ * END NOTES */
 
-/* flush global and/or private databases to disk
+/* check the escapes of len bytes of a text database line or log record
+ * returns 0 if they're all valid, -1 otherwise
  */
-
-void sdb_flush(flags)
-int flags;
+static int checkescapes(line, len)
+    const char *line;
+    unsigned long len;
 {
-    int i;
-    cache *c;
-
-    /* write and free global caches (to /var/imsp/<db>) */
-    if (flags & SDB_FLUSH_GLOBAL)
-      for (i = 0; i < NUMGDBSTR; ++i) {
-	c = globdb + i;
-	if (c->modified) {
-	    writecache(c);
-	}
-      }
+    const char *scan, *end;
 
-    /* write and free private caches (to /var/imsp/user/.../<db>) */
-    if (flags & SDB_FLUSH_PRIVATE) {
-      for (i = 0; i < NUMPDBSTR; ++i) {
-	c = privdb + i;
-	if (c->modified) {
-	    writecache(c);
+    end = line + len;
+    for (scan = line; (scan = memchr(scan, '\\', end - scan)) != NULL;
+	 scan += 2) {
+	if (scan + 1 == end
+	    || (scan[1] != 'n' && scan[1] != 's' && scan[1] != '\\')) {
+	    return (-1);
 	}
-      }
     }
+
+    return (0);
 }
 
-/* check if a database exists
- *  returns 0 if exists, -1 otherwise
+/* check the order and escapes of a text database file
+ * returns -1 on error, 1 if there are problems, 0 otherwise
  */
-int sdb_check(db)
-    char *db;
-{
+static int verifytext(c, base, len, flags)
     cache *c;
-    struct stat stbuf;
-    
-    if ((c = findcache(db)) == NULL) return (-1);
-    
-    return ((c->loaded || stat(c->db, &stbuf) >= 0) ? 0 : -1);
+    const char *base;
+    unsigned long len;
+    int flags;
+{
+    char *data, *scan, *end, *key, *prev, *next;
+    unsigned long line;
+    int rtval, cmp;
+
+    if ((data = malloc(len + 1)) == NULL) return (-1);
+    memcpy(data, base, len);
+    data[len] = '\0';
+    rtval = 0;
+    prev = NULL;
+    for (scan = data, line = 1; scan < data + len; scan = end + 1, ++line) {
+	if ((end = memchr(scan, '\n', data + len - scan)) == NULL) {
+	    end = data + len;
+	}
+	if (checkescapes(scan, (unsigned long) (end - scan)) < 0) {
+	    syslog(LOG_WARNING, "%s: bad escape on line %lu", c->db, line);
+	    rtval = 1;
+	}
+	key = scan;
+	*end = '\0';
+	*unescapespan(key, "\\ ", &next) = '\0';
+	if (prev != NULL) {
+	    cmp = (flags & SDB_ICASE) ? strcasecmp(prev, key)
+		: strcmp(prev, key);
+	    if (cmp >= 0) {
+		syslog(LOG_WARNING, "%s: %s key on line %lu", c->db,
+		       cmp ? "unsorted" : "duplicate", line);
+		rtval = 1;
+	    }
+	}
+	prev = key;
+    }
+    free(data);
+
+    return (rtval);
 }
 
-/* create a new database.  fails if database exists or isn't createable.
- * returns -1 on failure, 0 on success
+/* check the records and order of a binary database file
+ * returns -1 if it's damaged, 1 if there are problems, 0 otherwise
  */
-int sdb_create(db)
-    char *db;
-{
-    int fd;
-    char *scan;
+static int verifybinary(c, base, len, flags)
     cache *c;
-    struct stat stbuf;
+    const char *base;
+    unsigned long len;
+    int flags;
+{
+    unsigned long i, count, off, klen, vlen;
+    const char *key, *prev;
+    int rtval, cmp, fflags;
 
-    /* verify that db is valid & doesn't exist */
-    if ((c = findcache(db)) == NULL || c->loaded || stat(c->db, &stbuf) >= 0) {
+    if (GETNET32(base + SDB_MAGICLEN) != SDB_VERSION) {
+	syslog(LOG_ERR, "%s: unknown database file version %lu", c->db,
+	       GETNET32(base + SDB_MAGICLEN));
 	return (-1);
     }
-
-    /* make user's subdirectory if needed */
-    if (!strncmp(db, PRIVPREFIX, PRIVPREFIXLEN)) {
-	scan = strchr(c->db + PREFIXLEN + PRIVPREFIXLEN + 2, '/');
-	if (scan == NULL) return (-1);
-	*scan = '\0';
-	mkdir(c->db, 0700);
-	*scan = '/';
+    rtval = 0;
+    fflags = GETNET32(base + SDB_MAGICLEN + 4) & SDB_ICASE;
+    if (fflags != (flags & SDB_ICASE)) {
+	syslog(LOG_WARNING, "%s: keys sorted case-%ssensitively", c->db,
+	       fflags ? "in" : "");
+	rtval = 1;
     }
-
-    /* create datafile */
-    if ((fd = open(c->db, O_WRONLY | O_CREAT, 0600)) < 0 || close(fd) < 0) {
-	return (-1);
+    count = GETNET32(base + SDB_MAGICLEN + 8);
+    if (count > (len - SDB_HEADERLEN) / 4) goto CORRUPT;
+    prev = NULL;
+    for (i = 0; i < count; ++i) {
+	off = GETNET32(base + SDB_HEADERLEN + i * 4);
+	if (off < SDB_HEADERLEN || off > len - 8) goto CORRUPT;
+	klen = GETNET32(base + off);
+	vlen = GETNET32(base + off + 4);
+	if (klen >= len - off - 8 || base[off + 8 + klen] != '\0') {
+	    goto CORRUPT;
+	}
+	key = base + off + 8;
+	if (vlen != SDB_NOVALUE
+	    && (vlen >= len - off - 8 - klen - 1 || key[klen + 1 + vlen])) {
+	    goto CORRUPT;
+	}
+	if (prev != NULL) {
+	    cmp = fflags ? strcasecmp(prev, key) : strcmp(prev, key);
+	    if (cmp >= 0) {
+		syslog(LOG_WARNING, "%s: %s key at record %lu", c->db,
+		       cmp ? "unsorted" : "duplicate", i);
+		rtval = 1;
+	    }
+	}
+	prev = key;
     }
 
-    return (0);
+    return (rtval);
+
+ CORRUPT:
+    syslog(LOG_ERR, "IOERROR: %s: corrupt database file", c->db);
+    return (-1);
 }
 
-/* delete a database.  fails if database isn't deletable.
- * returns -1 on failure, 0 on success
+/* foreach callback of sdb_verify(): reading the records is the check
  */
-int sdb_delete(db)
-    char *db;
+static int verifyproc(rock, key, keylen, data, datalen)
+    void *rock;
+    const char *key;
+    int keylen;
+    const char *data;
+    int datalen;
 {
-    char lname[MAXDBPATHLEN];
-    cache *c;
-    
-    if ((c = findcache(db)) == NULL || c->locks) return (-1);
-
-    /* remove file and empty cache */
-    if (unlink(c->db) < 0) return (-1);
-    freecache(c);
-
-    /* try removing user directory for cleanliness sake */
-    if (!strncmp(db, PRIVPREFIX, PRIVPREFIXLEN)) {
-	strcpy(lname, c->db);
-	*strrchr(lname, '/') = '\0';
-	rmdir(lname);
-    }
-
     return (0);
 }
 
-
-/* copy the contents of one database to another
- *  returns -1 on failure, 0 on success
+/* check the records of a database's log
+ * returns -1 on error, 1 if there are problems, 0 otherwise
  */
-int sdb_copy(dbsrc, dbdst, flags)
-    char *dbsrc, *dbdst;
-    int flags;
+static int verifylog(c)
+    cache *c;
 {
-    cache *citem;
-    char dbname[MAXDBPATHLEN+1];
-    int fd=0, result;
-
-    /* create the destination. this locks and prevents another
-    * rename from happening. */
-    if (sdb_create(dbdst) < 0) {
-      return (-1);
-    }
-
-    if ((citem = findcache(dbdst)) == NULL) {
-      sdb_delete(dbdst);
-      return (-1);
+    struct stat stbuf;			/* log file statistics buffer */
+    int fd;				/* log file descriptor */
+    int rtval;				/* return value */
+    const char *base;			/* mapped log file */
+    unsigned long len;			/* length of base */
+    const char *scan, *end;		/* current record and its end */
+    unsigned long line;			/* number of the current record */
+    char lname[MAXDBPATHLEN + 8];	/* log file name buffer */
+
+    snprintf(lname, sizeof(lname), logext, c->db);
+    if ((fd = open(lname, O_RDONLY)) < 0) {
+	return (errno == ENOENT ? 0 : -1);
     }
-    strcpy(dbname, citem->db);
-    /* grab lock on destination */
-    if ((fd = open(dbname, O_RDWR|O_CREAT, 0600)) < 0) {
-      sdb_delete(dbdst);
-      return (-1);
+    if (fstat(fd, &stbuf) < 0) {
+	close(fd);
+	return (-1);
     }
-
-    if (lock_reopen(fd, citem->db, NULL, NULL) < 0) {
-      sdb_delete(dbdst);
-      close(fd);
-      return (-1);
+    base = NULL;
+    len = 0;
+    map_refresh(fd, 1, &base, &len, stbuf.st_size, lname, NULL);
+    close(fd);
+    rtval = 0;
+    for (scan = base, line = 1;
+	 (end = memchr(scan, '\n', base + len - scan)) != NULL;
+	 scan = end + 1, ++line) {
+	if ((*scan != '+' && *scan != '-')
+	    || checkescapes(scan, (unsigned long) (end - scan)) < 0) {
+	    syslog(LOG_WARNING, "%s: bad log record %lu", c->db, line);
+	    rtval = 1;
+	}
     }
-    /* make sure files are valid */
-    if (((citem = findcache(dbsrc)) == NULL) || citem->locks) {
-      sdb_delete(dbdst);
-      return (-1);
+    if (scan != base + len) {
+	syslog(LOG_WARNING, "%s: partial record at end of log", c->db);
+	rtval = 1;
     }
+    if (len) map_free(&base, &len);
 
-    /* read in source */
-    if (loadcache(citem, flags) < 0) {
-	lock_unlock(fd);
+    return (rtval);
+}
+
+/* check that a database's files are in order: sorted the way flags ask
+ * (as for sdb_get) without duplicate keys, and escaped properly if they're
+ * text.  Problems are logged.
+ *  returns -1 if the database can't be read, 1 if it has problems which
+ *  rewriting it with sdb_convert() would fix, 0 if it's in order
+ */
+int sdb_verify(db, flags)
+    char *db;
+    int flags;
+{
+    cache *c;
+    struct stat stbuf;
+    struct cyrusdb_backend *be;
+    struct db *bdb;
+    const char *base;
+    unsigned long len;
+    int fd, i, rtval, logval;
+
+    if ((c = findcache(db)) == NULL) return (-1);
+    if ((fd = open(c->db, O_RDONLY)) < 0) return (-1);
+    if (fstat(fd, &stbuf) < 0) {
 	close(fd);
 	return (-1);
     }
+    base = NULL;
+    len = 0;
+    map_refresh(fd, 1, &base, &len, stbuf.st_size, c->db, NULL);
+    close(fd);
+
+    be = NULL;
+    for (i = 0; backends[i] != NULL; ++i) {
+	if (len >= backends[i]->magiclen
+	    && !memcmp(base, backends[i]->magic, backends[i]->magiclen)) {
+	    be = backends[i];
+	}
+    }
+    if (be != NULL) {
+	/* an engine keeps its own order; check that it can read it all */
+	rtval = -1;
+	if (be->open(c->db, 0, &bdb) == CYRUSDB_OK) {
+	    if (be->foreach(bdb, "", 0, verifyproc, NULL, NULL) >= 0) {
+		rtval = 0;
+	    }
+	    be->close(bdb);
+	}
+	if (rtval < 0) syslog(LOG_ERR, "IOERROR: %s: can't be read", c->db);
+    } else if (len >= SDB_HEADERLEN && !memcmp(base, sdb_magic, SDB_MAGICLEN)) {
+	rtval = verifybinary(c, base, len, flags);
+    } else {
+	rtval = verifytext(c, base, len, flags);
+    }
+    if (len) map_free(&base, &len);
 
-    /* change cache to be the destination */
-    citem->fd = fd;
-    strcpy(citem->db, dbname);
-
-    /* write the cache & unlock file */
-    result = writecache(citem);
+    if (rtval >= 0 && (logval = verifylog(c)) != 0) rtval = logval;
 
-    return (result);
+    return (rtval);
 }
 
 /* get value of a key
@@ -857,20 +4291,33 @@ int sdb_copy(dbsrc, dbdst, flags)
  * change on future sdb_* calls.
  * returns -1 on failure, 0 on success
  */
-int sdb_get(db, key, flags, value)
-    char *db, *key;
+int sdb_dbget(h, key, flags, value)
+    sdb_db *h;
+    char *key;
     int flags;
     char **value;
 {
     cache *c;
     sdb_keyvalue *kv;
+    int result;
 
     /* get db in cache */
-    c = findcache(db);
+    c = h;
     if (c == NULL) {
 	return(-1);
     }
     if (c->loaded == 0) {
+	/* look the key up in the file, until the db proves to be busy.  A
+	 * storage engine can always look keys up without loading.
+	 */
+	if (c->locks == 0 && checkformat(c) < 0) return (-1);
+	if (c->backend != NULL) {
+	    result = fetchbackend(c, key, flags, value);
+	    if (result <= 0) return (result);
+	} else if (c->locks == 0 && c->peeks < PEEK_LIMIT) {
+	    result = peekcache(c, key, flags, value);
+	    if (result <= 0) return (result);
+	}
 	if (loadcache(c, flags) < 0) {
 	    return (-1);
 	}
@@ -882,25 +4329,34 @@ int sdb_get(db, key, flags, value)
 	return (0);
     }
 
-    /* do binary search */
-    kv = kv_bsearch(key, c->kv, c->cachecount,
-		    (flags & SDB_ICASE) ? strcasecmp : strcmp);
+    /* search the index */
+    kv = kvfind(c, key);
     *value = kv ? kv->value : NULL;
 
     return (0);
 }
 
+/* get value of a key by database name
+ */
+int sdb_get(db, key, flags, value)
+    char *db, *key;
+    int flags;
+    char **value;
+{
+    return (sdb_dbget(findcache(db), key, flags, value));
+}
+
 /* count the number of keys in a database
  *  returns -1 on failure, number of keys on success
  */
-int sdb_count(db, flags)
-    char *db;
+int sdb_dbcount(h, flags)
+    sdb_db *h;
     int flags;
 {
     cache *c;
 
     /* get db in cache */
-    c = findcache(db);
+    c = h;
     if (c == NULL) {
 	return(-1);
     }
@@ -913,6 +4369,15 @@ int sdb_count(db, flags)
     return (c->cachecount);
 }
 
+/* count the number of keys in a database by name
+ */
+int sdb_count(db, flags)
+    char *db;
+    int flags;
+{
+    return (sdb_dbcount(findcache(db), flags));
+}
+
 /* check if a value matches a value pattern
  *  return 0 for match, 1 for no match, -1 for error
  */
@@ -945,8 +4410,8 @@ static int valuematch(vpat, value)
  * IncrDev Feb 22, 1996 by sh: to not depend on pseudo memory mapping
  * END HISTORY */
 
-int sdb_match(db, key, flags, vpat, copy, pkv, count)
-    char* db;				/* I: database name to match against */
+int sdb_dbmatch(h, key, flags, vpat, copy, pkv, count)
+    sdb_db *h;				/* I: database to match against */
     char* key;				/* I: key to match against */
     int flags;				/* I: case selection flag */
     char *vpat;				/* I: match pattern */
@@ -960,6 +4425,11 @@ int sdb_match(db, key, flags, vpat, copy, pkv, count)
     sdb_keyvalue *ksrc, *kdst;
     glob *g, *vg;
     int gcount, copysize;
+    unsigned long pg, idx;		/* position of first key to match */
+    unsigned long size;			/* number of keys to match against */
+    unsigned long left;			/* keys left to match against */
+    char *fkey;				/* literal prefix, folded */
+    char buf[FOLD_BUF];			/* buffer for a short folded prefix */
 
     /* initialization */
     *pkv = NULL;
@@ -969,7 +4439,7 @@ int sdb_match(db, key, flags, vpat, copy, pkv, count)
     if (vpat != NULL && vpat[0] == '*' && vpat[1] == '\0') vpat = NULL;
     
     /* get db in cache */
-    c = findcache(db);
+    c = h;
     if (c == NULL) {
 	return(-1);
     }
@@ -989,9 +4459,8 @@ int sdb_match(db, key, flags, vpat, copy, pkv, count)
 	 ++scan);
     if (!*scan) {
 
-	/* do binary search */
-	ksrc = kv_bsearch(key, c->kv, c->cachecount,
-			  (flags & SDB_ICASE) ? strcasecmp : strcmp);
+	/* search the index */
+	ksrc = kvfind(c, key);
 	if (ksrc && valuematch(vpat, value = ksrc->value) == 0) {
 	    key = ksrc->key;
 	    kdst = *pkv = (sdb_keyvalue *)
@@ -1015,18 +4484,34 @@ int sdb_match(db, key, flags, vpat, copy, pkv, count)
     /* set key to NULL if it's a "*" */
     if (key[0] == '*' && key[1] == '\0') key = NULL;
 
+    /* only keys starting with the literal prefix of the pattern can match,
+     * so restrict the search to their range of the index.  A cache sorted
+     * by case can't give the range of a case insensitive match, so that
+     * searches the whole index.
+     */
+    pg = idx = 0;
+    size = c->cachecount;
+    if (key && scan != key && (c->icase || !(flags & SDB_ICASE))) {
+	fkey = foldsearch(c, key, (unsigned long) (scan - key), buf);
+	if (fkey == NULL) return (-1);
+	size = kvprefix(c, fkey, scan - key, &pg, &idx);
+	FOLDFREE(fkey, key, buf);
+	if (!size) return (0);
+    }
+
     /* make space for a complete match -- we can reduce usage later */
-    kdst = *pkv = (sdb_keyvalue *) malloc(sizeof (sdb_keyvalue) * c->cachecount);
+    kdst = *pkv = (sdb_keyvalue *) malloc(sizeof (sdb_keyvalue) * size);
     if (kdst == NULL) {
 	return (-1);
     }
-    memset(kdst, '\0', (sizeof(sdb_keyvalue) * c->cachecount));
-    ksrc = c->kv;
 
     /* special case for full match */
     if (!key && !vpat) {
-	memcpy((void *) kdst, (void *) ksrc, c->cachecount * sizeof (sdb_keyvalue));
-	kdst += c->cachecount;
+	for (pg = 0; pg < c->pagecount; ++pg) {
+	    memcpy((void *) kdst, (void *) c->page[pg]->kv,
+		   c->page[pg]->count * sizeof (sdb_keyvalue));
+	    kdst += c->page[pg]->count;
+	}
     } else {
 	/* do globbing */
 	if (key && (g = glob_init(key, (flags & SDB_ICASE) ? GLOB_ICASE : 0L))
@@ -1040,22 +4525,12 @@ int sdb_match(db, key, flags, vpat, copy, pkv, count)
 	    free((char *) kdst);
 	    return (-1);
 	}
-	if (key && !vpat) {
-	    for (gcount = c->cachecount; gcount; --gcount, ++ksrc) {
-		if (GLOB_TEST(g, ksrc->key) >= 0) {
-		    *kdst++ = *ksrc;
-		}
-	    }
-	} else if (vpat && !key) {
-	    for (gcount = c->cachecount; gcount; --gcount, ++ksrc) {
-		if (GLOB_TEST(vg, ksrc->value) >= 0) {
-		    *kdst++ = *ksrc;
-		}
-	    }
-	} else {
-	    for (gcount = c->cachecount; gcount; --gcount, ++ksrc) {
-		if (GLOB_TEST(g, ksrc->key) >= 0
-		    && GLOB_TEST(vg, ksrc->value) >= 0) {
+	for (left = size; left; ++pg, idx = 0) {
+	    ksrc = c->page[pg]->kv + idx;
+	    for (gcount = c->page[pg]->count - idx; gcount && left;
+		 --gcount, --left, ++ksrc) {
+		if ((!key || GLOB_TEST(g, ksrc->key) >= 0)
+		    && (!vpat || GLOB_TEST(vg, ksrc->value) >= 0)) {
 		    *kdst++ = *ksrc;
 		}
 	    }
@@ -1076,7 +4551,7 @@ int sdb_match(db, key, flags, vpat, copy, pkv, count)
     *count = kdst - *pkv;
 
     /* adjust down amount of space used by the match array */
-    if (*count < c->cachecount) {
+    if (*count < size) {
 	*pkv = (sdb_keyvalue *) realloc((char *) *pkv, (*count * sizeof(sdb_keyvalue)));
     }
 
@@ -1109,38 +4584,227 @@ int sdb_match(db, key, flags, vpat, copy, pkv, count)
     return (*pkv == NULL ? -1 : 0);
 }
 
+/* match keys & values of a database by name
+ */
+int sdb_match(db, key, flags, vpat, copy, pkv, count)
+    char *db, *key;
+    int flags;
+    char *vpat;
+    int copy;
+    sdb_keyvalue **pkv;
+    int *count;
+{
+    return (sdb_dbmatch(findcache(db), key, flags, vpat, copy, pkv, count));
+}
+
 /*  */
 
-/* free keyvalue list returned by sdb_match
+/* free keyvalue list returned by sdb_match
+ */
+
+/* HISTORY
+ * IncrDev Feb 22, 1996 by sh: change interface contract 
+ * IncrDev Feb 22, 1996 by sh: modified to walk list to free elements
+ * END HISTORY */
+
+void sdb_freematch(kv, count, copy)
+    sdb_keyvalue *kv;
+    int count;
+    int copy;
+{
+    int i;				/* loop counter */
+
+    /* sanity checks */
+    if (kv == NULL) {
+	return;
+    }
+
+    /* if the list is a copy then walk the kv list freeing keys and values */
+    if (copy) {
+	for (i = 0; i < count; i++) {
+	    if (kv[i].key != NULL) free(kv[i].key);
+	    if (kv[i].value != NULL) free(kv[i].value);
+	}
+    }
+
+    /* free the keyvalue list */
+    free((char *) kv);
+}
+
+/*  */
+
+/* start a cursor over the keys & values that match a key wildcard and
+ * value pattern, as for sdb_match.  The cursor reads the database as it was
+ * when opened: a cache changed or reloaded meanwhile keeps the version of
+ * its index that open cursors share until the last one is closed.
+ * returns NULL on failure
+ */
+sdb_iter *sdb_dbiter_open(h, key, flags, vpat)
+    sdb_db *h;				/* I: database to match against */
+    char *key;				/* I: key to match against */
+    int flags;				/* I: case selection flag */
+    char *vpat;				/* I: match pattern */
+{
+    cache *c;
+    sdb_iter *it;
+    char *scan;
+    int gflags = (flags & SDB_ICASE) ? GLOB_ICASE : 0L;
+
+    /* get db in cache */
+    c = h;
+    if (c == NULL) return (NULL);
+    if (c->loaded == 0 && loadcache(c, flags) < 0) return (NULL);
+
+    it = (sdb_iter *) malloc(sizeof (sdb_iter));
+    if (it == NULL) return (NULL);
+    memset((char *) it, '\0', sizeof (sdb_iter));
+    it->c = c;
+    it->flags = flags;
+
+    /* compile the patterns, finding the key pattern's literal prefix.  A
+     * cache sorted by case has no range for a case insensitive prefix, so
+     * that cursor reads the whole index.
+     */
+    if ((it->pat = strdup(key)) == NULL) goto FAIL;
+    while ((c->icase || !(flags & SDB_ICASE)) && it->pat[it->plen]
+	   && it->pat[it->plen] != '*' && it->pat[it->plen] != '%'
+	   && it->pat[it->plen] != '?') {
+	++it->plen;
+    }
+    if (c->icase) {
+	for (scan = it->pat; *scan; ++scan) *scan = TOLOWER(*scan);
+    }
+    if (strcmp(key, "*") && (it->g = glob_init(key, gflags)) == NULL) {
+	goto FAIL;
+    }
+    if (vpat != NULL && strcmp(vpat, "*")
+	&& (it->vg = glob_init(vpat, gflags)) == NULL) {
+	goto FAIL;
+    }
+
+    /* read the current version of the index */
+    if (c->cur == NULL) {
+	c->cur = (version *) malloc(sizeof (version));
+	if (c->cur == NULL) goto FAIL;
+	memset((char *) c->cur, '\0', sizeof (version));
+    }
+    it->v = c->cur;
+    ++it->v->refs;
+
+    /* start at the range of keys sharing the prefix */
+    kvseek(c, it->pat, it->plen, &it->pg, &it->idx);
+    it->gen = c->gen;
+    ++c->pins;
+
+    return (it);
+
+ FAIL:
+    if (it->g) glob_free(&it->g);
+    if (it->vg) glob_free(&it->vg);
+    if (it->pat) free(it->pat);
+    free((char *) it);
+    return (NULL);
+}
+
+/* start a cursor over a database by name
  */
+sdb_iter *sdb_iter_open(db, key, flags, vpat)
+    char *db, *key;
+    int flags;
+    char *vpat;
+{
+    return (sdb_dbiter_open(findcache(db), key, flags, vpat));
+}
 
-/* HISTORY
- * IncrDev Feb 22, 1996 by sh: change interface contract 
- * IncrDev Feb 22, 1996 by sh: modified to walk list to free elements
- * END HISTORY */
-
-void sdb_freematch(kv, count, copy)
-    sdb_keyvalue *kv;
-    int count;
-    int copy;
+/* get the next match of a cursor.  key and value point into the version
+ * of the database being read, and stay valid until the cursor is closed.
+ * returns -1 on failure, 0 at the end of the matches, 1 for a match
+ */
+int sdb_iter_next(it, key, value)
+    sdb_iter *it;
+    char **key, **value;
 {
-    int i;				/* loop counter */
+    cache *c = it->c;
+    sdb_keyvalue *kv;
+    kvpage **pages;
+    unsigned long pagecount;
+    unsigned long len;
 
-    /* sanity checks */
-    if (kv == NULL) {
-	return;
+    if (it->done) return (0);
+
+    /* a retired version stays put.  The cache's own index only changes
+     * under a cursor when it couldn't be retired; then find the pair after
+     * the last match.
+     */
+    if (!it->v->retired && it->gen != c->gen) {
+	if (c->loaded == 0 && loadcache(c, it->flags) < 0) return (-1);
+	if (it->last == NULL) {
+	    kvseek(c, it->pat, it->plen, &it->pg, &it->idx);
+	} else if (kvlocate(c, it->last, &it->pg, &it->idx) == 0) {
+	    ++it->idx;
+	}
+	it->gen = c->gen;
+    }
+    if (it->v->retired) {
+	pages = it->v->page;
+	pagecount = it->v->pagecount;
+    } else {
+	pages = c->page;
+	pagecount = c->pagecount;
     }
 
-    /* if the list is a copy then walk the kv list freeing keys and values */
-    if (copy) {
-	for (i = 0; i < count; i++) {
-	    if (kv[i].key != NULL) free(kv[i].key);
-	    if (kv[i].value != NULL) free(kv[i].value);
+    for (;;) {
+	/* step to the next pair, stopping at the end of the prefix range */
+	while (it->pg < pagecount && it->idx >= pages[it->pg]->count) {
+	    ++it->pg;
+	    it->idx = 0;
+	}
+	if (it->pg >= pagecount) break;
+	if (it->plen
+	    && strncmp(it->pat, pages[it->pg]->fold[it->idx], it->plen)) {
+	    break;
 	}
+	kv = pages[it->pg]->kv + it->idx++;
+
+	/* check it against the patterns */
+	if (it->g && GLOB_TEST(it->g, kv->key) < 0) continue;
+	if (it->vg && (kv->value == NULL || GLOB_TEST(it->vg, kv->value) < 0)) {
+	    continue;
+	}
+
+	/* remember where we were in case the pairs move */
+	len = strlen(kv->key) + 1;
+	if (len > it->lastsize) {
+	    if (it->last) free(it->last);
+	    it->lastsize = len;
+	    if ((it->last = malloc(len)) == NULL) {
+		it->lastsize = 0;
+		return (-1);
+	    }
+	}
+	strcpy(it->last, kv->key);
+	*key = kv->key;
+	*value = kv->value;
+	return (1);
     }
+    it->done = 1;
 
-    /* free the keyvalue list */
-    free((char *) kv);
+    return (0);
+}
+
+/* finish with a cursor
+ */
+void sdb_iter_close(it)
+    sdb_iter *it;
+{
+    if (it == NULL) return;
+    --it->c->pins;
+    releaseversion(it->c, it->v);
+    if (it->g) glob_free(&it->g);
+    if (it->vg) glob_free(&it->vg);
+    if (it->last) free(it->last);
+    free(it->pat);
+    free((char *) it);
 }
 
 /*  */
@@ -1153,46 +4817,109 @@ void sdb_freematch(kv, count, copy)
  * IncrDev Feb 23, 1996 by sh: to check for under locking
  * END HISTORY */
 
-int sdb_unlock(db, key, flags)
-    char *db, *key;
-    int flags;
-{
+static int unlockcache(c)
     cache *c;
-
-    /* CLAIM - to unlock a cache, it *must* have been locked and therefore loaded.
-       If we look for the cache and it is not instantiated, then there is a big
-       problem. */
-    /* find the appropriate cache entry */
-    c = findcache(db);
-    if (c == NULL) return (-1);
+{
+    int rtval;
 
     /* if there are no locks then just return success */
     if (c->locks == 0) return (0);
 
-    /*XXX: should write the cache if it's been modified */
-    /* 11/6/97 - well, the problem is that if you do, performance
-     * really blows as say for option_set, you basically do a 
-     * lock, set, unlock for each option thereby causing the options db 
-     * to be written to disk each time -- probably the right behavior but
-     * it makes writes really bad.  So we don't do it. 
+    /* decrement the lock count on the cache and if 0, write any changes
+     * to the log and release the lock.  Appending to the log costs about
+     * as much as the change itself, so this is done on every unlock rather
+     * than saving the whole database for sdb_done.
      */
-
-    /* decrement the lock count on the cache and if 0, remove lock file */
+    rtval = 0;
     c->locks--;
-    if (c->locks == 0) {
+    if (c->locks == 0 && c->backend != NULL) {
+      rtval = commitbackend(c);
+    } else if (c->locks == 0) {
+      rtval = flushlog(c);
       lock_unlock(c->fd);
       close(c->fd);
       c->fd = -1;
+      c->whole = 0;
     }
     
-    /* return success */
-    return (0);
+    return (rtval);
+}
+
+int sdb_dbunlock(h, key, flags)
+    sdb_db *h;
+    char *key;
+    int flags;
+{
+    cache *c;
+
+    /* CLAIM - to unlock a cache, it *must* have been locked and therefore loaded.
+       If we look for the cache and it is not instantiated, then there is a big
+       problem. */
+    /* find the appropriate cache entry */
+    c = h;
+    if (c == NULL) return (-1);
+
+    return (unlockcache(c));
+}
+
+int sdb_unlock(db, key, flags)
+    char *db, *key;
+    int flags;
+{
+    return (sdb_dbunlock(findcache(db), key, flags));
 }
 
 /*  */
 
-/* lock a key to allow local modification -- this may lock a whole set of keys
- * or database as a side effect.  specific key need not exist.
+/* pick the byte of a database file locked for a key.  Keys differing only
+ * in case share a byte, so the lock holds for either key order.
+ */
+static unsigned long keyslot(key)
+    char *key;
+{
+    unsigned long hash = 0;
+
+    while (*key) hash = hash * 31 + TOLOWER(*key++);
+
+    return (KEYLOCK_LOG + 1 + hash % KEYLOCK_SLOTS);
+}
+
+/* lock the byte of a key on the cache's database file, reopening the file
+ * if it was replaced while we waited, as lock_reopen() does for the whole
+ * file
+ * returns -1 on error, 0 on success
+ */
+static int lockslot(c, key, sbuf)
+    cache *c;
+    char *key;
+    struct stat *sbuf;
+{
+    struct stat stbuf;
+    int fd;
+
+    for (;;) {
+	if (lock_range(c->fd, keyslot(key), 1L) < 0) return (-1);
+	if (fstat(c->fd, sbuf) < 0 || stat(c->db, &stbuf) < 0) {
+	    lock_unlock(c->fd);
+	    return (-1);
+	}
+	if (sbuf->st_ino == stbuf.st_ino) return (0);
+	if ((fd = open(c->db, O_RDWR)) < 0) {
+	    lock_unlock(c->fd);
+	    return (-1);
+	}
+	dup2(fd, c->fd);
+	close(fd);
+    }
+}
+
+/* lock a key to allow local modification, or the whole database for a NULL
+ * key.  Writers of keys in different lock slots of a database go ahead
+ * side by side, so this may lock other keys as a side effect.  specific key
+ * need not exist.  A process may hold several key locks on a database, and
+ * may go on to lock all of it.  Should processes taking such locks in
+ * different orders wait for each other, the lock that would close the
+ * cycle fails rather than waiting forever.
  * returns -1 on error, 0 on success
  */
 
@@ -1200,33 +4927,65 @@ int sdb_unlock(db, key, flags)
  * IncrDev Feb 23, 1996 by sh: to load cache only if not already loaded
  * END HISTORY */
 
-int sdb_writelock(db, key, flags)
-    char *db, *key;
+static int lockcache(c, flags, key)
+    cache *c;
     int flags;
+    char *key;
 {
-    cache *c;
-
-    /* find the appropriate cache entry */
-    c = findcache(db);
-    if (c == NULL) {
-      if (imspd_debug) {
-	fprintf(stderr,"failed to find cache\n");
-      }
-      return(-1);
-    }
+    struct stat stbuf;
 
-    /* if the cache is already locked then increment it and return success */
+    /* if the cache is already locked then add this key's lock, and return
+     * success.  Locking the whole of a database we hold keys of catches
+     * up on the other keys' changes, which can't have been compacted into
+     * the file meanwhile.
+     */
     if (c->locks) {
+	if (!c->whole && key != NULL
+	    && lock_range(c->fd, keyslot(key), 1L) < 0) {
+	    syslog(LOG_ERR, "IOERROR: locking %s: %m", c->db);
+	    return (-1);
+	}
+	if (!c->whole && key == NULL) {
+	    if (lock_blocking(c->fd) < 0) {
+		syslog(LOG_ERR, "IOERROR: locking %s: %m", c->db);
+		return (-1);
+	    }
+	    c->whole = 1;
+	    if (replaylog(c) != 0) return (-1);
+	}
 	++c->locks;
 	return (0);
     }
 
-    /* get exclusive lock on database file */
+    /* a storage engine locks the database file for a transaction.  The
+     * cache isn't needed to change the file, so a stale one is dropped
+     * rather than loaded.
+     */
+    if (checkformat(c) < 0) return (-1);
+    if (c->backend != NULL) {
+      switch (c->backend->fetchlock(c->bdb, "", 0, NULL, NULL, &c->tid)) {
+      case CYRUSDB_OK:
+      case CYRUSDB_NOTFOUND:
+	break;
+      default:
+	return (-1);
+      }
+      ++c->locks;
+      c->whole = 1;
+      if (c->loaded && (stat(c->db, &stbuf) < 0 || stbuf.st_ino != c->ino
+			|| stbuf.st_size != c->size)) {
+	freecache(c);
+      }
+      return (0);
+    }
+
+    /* get exclusive lock on the key's slot or the whole database file */
     if (c->fd == -1) {
       c->fd = open(c->db, O_RDWR);
       if (c->fd < 0) return (-1);
     } 
-    if (lock_reopen(c->fd, c->db, NULL, NULL) < 0) {
+    if ((key != NULL ? lockslot(c, key, &stbuf)
+	 : lock_reopen(c->fd, c->db, &stbuf, NULL)) < 0) {
       if (imspd_debug) {
 	fprintf(stderr,"failed to reopen\n");
       }
@@ -1234,97 +4993,167 @@ int sdb_writelock(db, key, flags)
       c->fd = -1;
       return (-1);
     }
-    /* load the cache if necessary */
-    if (c->loaded == 0) {
-	if (loadcache(c, flags) < 0) {
-	  if (imspd_debug) {
-	    fprintf(stderr,"failed to load cache\n");
-	  }
-	    return (-1);
-	}
+
+    /* if the file was converted to a storage engine while we waited,
+     * start over with the new file
+     */
+    if (stbuf.st_ino != c->fmtino) {
+      lock_unlock(c->fd);
+      close(c->fd);
+      c->fd = -1;
+      return (lockcache(c, flags, key));
     }
     ++c->locks;
+    c->whole = key == NULL;
+
+    /* bring the cache up to date, so changes made by other processes since
+     * it was loaded aren't lost when ours are written
+     */
+    if (loadcache(c, flags & ~SDB_QUICK) < 0) {
+      if (imspd_debug) {
+	fprintf(stderr,"failed to load cache\n");
+      }
+      c->locks = 0;
+      lock_unlock(c->fd);
+      close(c->fd);
+      c->fd = -1;
+      return (-1);
+    }
 
     /* return success */
     return (0);
 }
 
+int sdb_dbwritelock(h, key, flags)
+    sdb_db *h;
+    char *key;
+    int flags;
+{
+    cache *c;
+
+    /* find the appropriate cache entry */
+    c = h;
+    if (c == NULL) {
+      if (imspd_debug) {
+	fprintf(stderr,"failed to find cache\n");
+      }
+      return(-1);
+    }
+
+    return (lockcache(c, flags, key));
+}
+
+int sdb_writelock(db, key, flags)
+    char *db, *key;
+    int flags;
+{
+    return (sdb_dbwritelock(findcache(db), key, flags));
+}
+
 /*  */
 
+/* copy a key or value into the cache's string pool
+ */
+static char *poolstrdup(c, str)
+    cache *c;
+    char *str;
+{
+    if (str == NULL) return (NULL);
+    if (c->pool == NULL) {
+	c->pool = new_mpool(POOL_SIZE);
+    }
+    CHARGE(c, strlen(str) + 1);
+
+    return (mpool_strdup(c->pool, str));
+}
+
+/* copy a storage engine's key or value of len bytes into the cache's
+ * string pool
+ */
+static char *poolmemdup(c, data, len)
+    cache *c;
+    const char *data;
+    int len;
+{
+    char *str;
+
+    if (c->pool == NULL) {
+	c->pool = new_mpool(POOL_SIZE);
+    }
+    CHARGE(c, len + 1);
+    str = mpool_malloc(c->pool, len + 1);
+    memcpy(str, data, len);
+    str[len] = '\0';
+
+    return (str);
+}
+
 /* set the value for a key -- key must be locked
  * returns -1 on failure, 0 on success
  */
 
 /* HISTORY
  * Integ__ Feb 27, 1996 by sh: to handle 0 size cache case
- * IncrDev Feb 21, 1996 by sh: to grow cache by CACHE_INCREMENT
  * IncrDev Feb 18, 1996 by sh: removed cache rewriting - now done in sdb_done
  * END HISTORY */
 
-int sdb_set(db, key, flags, value)
-    char *db, *key, *value;
+static int cacheset(c, key, flags, value)
+    cache *c;
+    char *key, *value;
     int flags;
 {
-    cache *c;
-    long size;				/* allocation size in bytes */
-    int top, bot, mid, cmp;
-    sdb_keyvalue *kvtop, *kvmid;
-    int (*cmpf)() = (flags & SDB_ICASE) ? strcasecmp : strcmp;
-
-    /* find the appropriate cache entry & make sure it's locked */
-    if ((c = findcache(db)) == NULL || !c->locks) return (-1);
+    unsigned long pg, idx;		/* position of key in the index */
+    sdb_keyvalue *kv;
 
-    /* if db not empty, look for the key */
-    mid = 0;
-    if (c->cachecount) {
-	/* do binary search */
-	top = c->cachecount - 1;
-	bot = 0;
-	while (bot <= top
-	       && (cmp = (*cmpf)(key, c->kv[mid=(bot+top)>>1].key))) {
-	    if (cmp < 0) {
-		top = mid - 1;
-	    } else {
-		bot = mid + 1;
-	    }
-	}
+    /* look for the key.  If it's there, set the value in the cache.  The
+     * old value stays in the file data or pool until the cache is freed.
+     */
+    switch (kvlocate(c, key, &pg, &idx)) {
+    case 0:
+	if (c->cur != NULL) retire(c, 0);
+	c->page[pg]->kv[idx].value = poolstrdup(c, value);
+	return (0);
 
-	/* if we matched then set the value in the cache */
-	if (!cmp) {
-	    if (c->kv[mid].value != NULL) free(c->kv[mid].value);
-	    c->kv[mid].value = strdup(value);
-	    c->modified = 1;
-	    return(0);
-	}
-	if (cmp > 0) ++mid;
+    case -1:
+	freecache(c);
+	return (-1);
     }
 
-    /* grow the cache if necessary */
-    if ((c->cachecount + 1) > c->cachesize) {
-	size = ((c->cachesize + CACHE_INCREMENT) * sizeof(sdb_keyvalue));
-	if (c->kv == NULL) {
-	    c->kv = (sdb_keyvalue *) malloc(size);
-	}
-	else {
-	    c->kv = (sdb_keyvalue *) realloc((void *)c->kv, size);
-	}
-	if (c->kv == NULL) {
-	    freecache(c);
-	    return(-1);
-	}
-	c->cachesize += CACHE_INCREMENT;
+    /* instantiate the new keyvalue pair */
+    if ((kv = kvinsert(c, pg, idx, key)) == NULL) {
+	freecache(c);
+	return (-1);
     }
+    kv->value = poolstrdup(c, value);
 
-    /* instantiate the new keyvalue pair */
-    c->cachecount++;
-    kvtop = c->kv + (c->cachecount - 1);
-    kvmid = c->kv + mid;
-    while (kvtop > kvmid) {
-	*kvtop = *(kvtop - 1);
-	--kvtop;
+    /* return success */
+    return (0);
+}
+
+int sdb_dbset(h, key, flags, value)
+    sdb_db *h;
+    char *key, *value;
+    int flags;
+{
+    cache *c;
+
+    /* find the appropriate cache entry & make sure it's locked */
+    if ((c = h) == NULL || !c->locks) return (-1);
+
+    /* change the engine's file and any loaded cache, or change the cache
+     * and note the change for the log
+     */
+    if (c->backend != NULL) {
+	if (c->backend->store(c->bdb, key, strlen(key), value,
+			      value == NULL ? 0 : strlen(value),
+			      &c->tid) != CYRUSDB_OK
+	    || (c->loaded && cacheset(c, key, flags, value) < 0)) {
+	    return (-1);
+	}
+    } else if (cacheset(c, key, flags, value) < 0
+	       || logrecord(c, '+', key, value) < 0) {
+	return (-1);
     }
-    kvmid->key = strdup(key);
-    kvmid->value = strdup(value);
 
     /* mark the cache as modified */
     c->modified = 1;
@@ -1333,6 +5162,13 @@ int sdb_set(db, key, flags, value)
     return (0);
 }
 
+int sdb_set(db, key, flags, value)
+    char *db, *key, *value;
+    int flags;
+{
+    return (sdb_dbset(findcache(db), key, flags, value));
+}
+
 /* remove the entry for a key
  * returns -1 on failure, 0 on success
  */
@@ -1342,31 +5178,45 @@ int sdb_set(db, key, flags, value)
  * IncrDev Feb 18, 1996 by sh: removed cache rewriting - now done in sdb_done
  * END HISTORY */
 
-int sdb_remove(db, key, flags)
-    char *db, *key;
+static int cacheremove(c, key, flags)
+    cache *c;
+    char *key;
+    int flags;
+{
+    unsigned long pg, idx;		/* position of key in the index */
+
+    /* look for the key */
+    if (kvlocate(c, key, &pg, &idx)) return (-1);
+
+    /* remove the key pair from the cache */
+    kvdelete(c, pg, idx);
+
+    /* return success */
+    return (0);
+}
+
+int sdb_dbremove(h, key, flags)
+    sdb_db *h;
+    char *key;
     int flags;
 {
     cache *c;
-    sdb_keyvalue *kvtop, *kvmid;
 
     /* find the appropriate cache entry & make sure it's locked */
-    if ((c = findcache(db)) == NULL || !c->locks) return (-1);
-
-    /* if db not empty, look for the key */
-    if (!c->cachecount) return (-1);
-    
-    /* do binary search */
-    kvmid = kv_bsearch(key, c->kv, c->cachecount,
-		       (flags & SDB_ICASE) ? strcasecmp : strcmp);
-    if (!kvmid) return (-1);
-    if (kvmid->key != NULL) free(kvmid->key);
-    if (kvmid->value != NULL) free(kvmid->value);
+    if ((c = h) == NULL || !c->locks) return (-1);
 
-    /* remove the key pair from the cache */
-    kvtop = c->kv + --c->cachecount;
-    while (kvmid < kvtop) {
-	kvmid[0] = kvmid[1];
-	++kvmid;
+    /* change the engine's file and any loaded cache, or change the cache
+     * and note the change for the log
+     */
+    if (c->backend != NULL) {
+	if (c->backend->delete(c->bdb, key, strlen(key),
+			       &c->tid) != CYRUSDB_OK) {
+	    return (-1);
+	}
+	if (c->loaded) cacheremove(c, key, flags);
+    } else if (cacheremove(c, key, flags) < 0
+	       || logrecord(c, '-', key, NULL) < 0) {
+	return (-1);
     }
 
     /* mark the cache as modified */
@@ -1375,3 +5225,10 @@ int sdb_remove(db, key, flags)
     /* return success */
     return (0);
 }
+
+int sdb_remove(db, key, flags)
+    char *db, *key;
+    int flags;
+{
+    return (sdb_dbremove(findcache(db), key, flags));
+}
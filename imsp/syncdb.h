@@ -45,12 +45,36 @@
 #ifndef SYNCDB_H
 #define SYNCDB_H
 
+#include <stdio.h>
 #include "util.h"
 
 /* a key-value pair returned by a wildcard match
  */
 typedef keyvalue sdb_keyvalue;
 
+/* a cursor over the matches of a key wildcard, private to the sdb module
+ */
+typedef struct sdb_iter sdb_iter;
+
+/* an open database, private to the sdb module
+ */
+typedef struct sdb_db sdb_db;
+
+/* a batch of changes to apply together, private to the sdb module
+ */
+typedef struct sdb_batch sdb_batch;
+
+/* memory use and hit counts of the database caches of a process
+ */
+typedef struct sdb_cachestats {
+    unsigned long bytes;		/* memory used by all caches */
+    unsigned long caches;		/* databases holding memory */
+    unsigned long hits;			/* loads finding the cache current */
+    unsigned long misses;		/* loads reading a database file */
+    unsigned long evictions;		/* caches freed to keep to the limits */
+    unsigned long writebacks;		/* logs folded into files when freed */
+} sdb_cachestats;
+
 /* defines for flags (GLOB_* defines are also valid): */
 #define SDB_ICASE	0x01	/* case insensitive */
 #define SDB_QUICK	0x10	/* don't reread cache if cache available */
@@ -58,22 +82,70 @@ typedef keyvalue sdb_keyvalue;
 #define SDB_FLUSH_GLOBAL	0x100	/* flush out global dbs */
 #define SDB_FLUSH_PRIVATE	0x200	/* flush out private (user) dbs */
 
+/* number of shards of a sharded global database, named "<db>.<n>" for n
+ * from 0 to SDB_SHARDS - 1; "abooks" is sharded
+ */
+#define SDB_SHARDS		16
+
+/* parameters for sdb_config: */
+#define SDB_CONF_SLOTS		1	/* private dbs cached per type */
+#define SDB_CONF_MAXBYTES	2	/* memory for all caches, 0 = any */
+#define SDB_CONF_SYNC		3	/* durability mode, SDB_SYNC_* */
+#define SDB_CONF_SYNCWRITES	4	/* writes per group commit */
+#define SDB_CONF_SYNCDELAY	5	/* seconds a write waits for commit */
+
+/* durability modes for SDB_CONF_SYNC: */
+#define SDB_SYNC_NONE		0	/* leave writes to the kernel */
+#define SDB_SYNC_GROUP		1	/* fsync writes in groups (default) */
+#define SDB_SYNC_STRICT		2	/* fsync each write before unlocking */
+
 #ifdef __STDC__
 int sdb_init(void);
+int sdb_watch(void);
 void sdb_done(void);
 void sdb_flush(int);
+void sdb_refresh(int);
+int sdb_config(int, long);
+void sdb_stats(sdb_cachestats *);
+void sdb_trim(void);
+void sdb_sync(int);
 int sdb_check(char *);
 int sdb_create(char *);
 int sdb_delete(char *);
 int sdb_copy(char *, char *, int);
+int sdb_convert(char *, char *, int);
+int sdb_bulkload(char *, int, int (*)(void *, char **, char **), void *);
+int sdb_export(char *, int, int (*)(void *, FILE *, char *, char *), void *,
+	       long *, long *);
+int sdb_walk(int (*)(char *, void *), void *);
+int sdb_verify(char *, int);
 int sdb_get(char *, char *, int, char **);
 int sdb_count(char *, int);
 int sdb_match(char *, char *, int, char *, int, sdb_keyvalue **, int *);
 void sdb_freematch(sdb_keyvalue *, int, int);
+sdb_iter *sdb_iter_open(char *, char *, int, char *);
+int sdb_iter_next(sdb_iter *, char **, char **);
+void sdb_iter_close(sdb_iter *);
 int sdb_writelock(char *, char *, int);
 int sdb_unlock(char *, char *, int);
 int sdb_set(char *, char *, int, char *);
 int sdb_remove(char *, char *, int);
+sdb_db *sdb_open(char *);
+void sdb_close(sdb_db *);
+int sdb_dbget(sdb_db *, char *, int, char **);
+int sdb_dbcount(sdb_db *, int);
+int sdb_dbmatch(sdb_db *, char *, int, char *, int, sdb_keyvalue **, int *);
+sdb_iter *sdb_dbiter_open(sdb_db *, char *, int, char *);
+int sdb_dbwritelock(sdb_db *, char *, int);
+int sdb_dbunlock(sdb_db *, char *, int);
+int sdb_dbset(sdb_db *, char *, int, char *);
+int sdb_dbremove(sdb_db *, char *, int);
+sdb_batch *sdb_batch_open(void);
+int sdb_batch_set(sdb_batch *, char *, char *);
+int sdb_batch_remove(sdb_batch *, char *);
+int sdb_batch_apply(char *, sdb_batch *, int);
+int sdb_dbbatch_apply(sdb_db *, sdb_batch *, int);
+void sdb_batch_close(sdb_batch *);
 #else
 
 /* initialize sdb module (add to synchronization)
@@ -81,14 +153,47 @@ int sdb_remove(char *, char *, int);
  */
 int sdb_init( /* void */ );
 
+/* watch the database directories for changes made by other processes, so
+ * cached databases and database existence are checked without looking at
+ * the files each time.  Called by each server process after it forks.
+ * returns -1 if changes can't be watched here, 0 on success
+ */
+int sdb_watch( /* void */ );
+
 /* release any resources used by sdb module (remove from synchronization)
  */
 void sdb_done( /* void */ );
 
-/* flush global and/or private databases to disk
+/* flush global and/or private databases to disk, folding any
+ * pending log records into the database files
  */
 void sdb_flush( /* int */ );
 
+/* load or refresh the cached global databases, so that processes forked
+ * afterwards share one up to date copy.  flags are as for sdb_get.
+ */
+void sdb_refresh( /* int flags */ );
+
+/* set a tuning parameter (SDB_CONF_*) of the sdb module
+ *  returns -1 on failure, 0 on success
+ */
+int sdb_config( /* int param, long value */ );
+
+/* get the memory use and hit counts of the caches of this process
+ */
+void sdb_stats( /* sdb_cachestats *stats */ );
+
+/* free cached databases until their memory is back under the limit
+ * (SDB_CONF_MAXBYTES).  Values returned by sdb_get, and by sdb_match
+ * without copying, may become invalid, so call it between commands.
+ */
+void sdb_trim( /* void */ );
+
+/* make writes waiting for a group commit (SDB_SYNC_GROUP) durable.  If
+ * force is 0, only once the group is complete.
+ */
+void sdb_sync( /* int force */ );
+
 /* check if a database exists
  *  returns 0 if exists, -1 otherwise
  */
@@ -109,6 +214,53 @@ int sdb_delete( /* char *db */ );
  */
 int sdb_copy( /* char *dbsrc, char *dbdst, int flags */ );
 
+/* convert a database to another storage format: "flat" for the binary
+ * files of this module, or "skiplist".  A NULL format rewrites the
+ * database in its own format, folding in its log.  flags select the key
+ * order of the new file, as for sdb_get.
+ *  returns -1 on failure, 0 on success
+ */
+int sdb_convert( /* char *db, char *format, int flags */ );
+
+/* add a stream of pairs to a database in one pass, writing its file once.
+ * next(rock, &key, &value) returns 1 and the next pair, 0 at the end or
+ * -1 on failure; the pairs may come in any order, and the last value for a
+ * key wins.  The database must not be locked by this process.  next is
+ * called with the database locked and loaded, so it may read the database
+ * and see the values the stream replaces.
+ *  returns -1 on failure, leaving the database as it was, 0 on success
+ */
+int sdb_bulkload( /* char *db, int flags,
+		     int (*next)(void *rock, char **key, char **value),
+		     void *rock */ );
+
+/* get an export of a database, made by calling proc(rock, out, key,
+ * value) for each key in order to write it to the stdio stream out.  The
+ * export is kept in a file and made again only after the database
+ * changes.  proc returns -1 on failure.
+ *  returns -1 on failure, or a descriptor open on the export's file, which
+ *  the caller must close, with the export *len bytes long at *offset
+ */
+int sdb_export( /* char *db, int flags,
+		   int (*proc)(void *rock, FILE *out, char *key, char *value),
+		   void *rock, long *offset, long *len */ );
+
+/* call proc(db, rock) for each database, the global ones first and then
+ * each user's databases one after another.  The walk stops when proc
+ * returns non-zero.
+ *  returns -1 if the database directories can't be read, the non-zero
+ *  return of proc, or 0 at the end of the walk
+ */
+int sdb_walk( /* int (*proc)(char *db, void *rock), void *rock */ );
+
+/* check that a database's files are sorted the way flags ask (as for
+ * sdb_get), have no duplicate keys and are properly escaped.  Problems
+ * are logged.
+ *  returns -1 if the database can't be read, 1 if it has problems which
+ *  rewriting it with sdb_convert would fix, 0 if it's in order
+ */
+int sdb_verify( /* char *db, int flags */ );
+
 /* get value of a key
  * on return, value points to a string which shouldn't be modified and may
  * change on future sdb_* calls.
@@ -139,10 +291,37 @@ int sdb_match( /* char *db, char *key, int flags, char *vpat, int copy,
  */
 void sdb_freematch( /* sdb_keyvalue *kv, int count, int copy */ );
 
+/* start a cursor over the keys & values that match a key wildcard and
+ * value pattern, as for sdb_match, without building a list of them.
+ *  The cursor sees the database as it was when opened; changes made
+ *  meanwhile, by this process or others, show up in later cursors.
+ *  Caller must call sdb_iter_close when done.
+ * returns NULL on failure
+ */
+sdb_iter *sdb_iter_open( /* char *db, char *key, int flags, char *vpat */ );
+
+/* get the next match of a cursor, in key order
+ *  key and value point to strings which shouldn't be modified.  They stay
+ *  valid until the cursor is closed.
+ * returns -1 on failure, 0 at the end of the matches, 1 for a match
+ */
+int sdb_iter_next( /* sdb_iter *it, char **key, char **value */ );
+
+/* finish with a cursor
+ *  if it is NULL, no action is taken.
+ */
+void sdb_iter_close( /* sdb_iter *it */ );
+
 /* lock a key to allow local modification -- this may lock a whole set of keys
  * or database as a side effect.  specific key need not exist.
  * if key is NULL, this locks the entire database
- * returns -1 on error, 0 on success
+ * Writers holding locks on different keys of a database run side by side,
+ * so while a key is locked, sdb_get only sees other processes' changes to
+ * the keys this process has locked, and only the keys a held lock stands
+ * for may be changed (one key's lock may stand for a group of keys, if all
+ * their writers lock it).  A process's locks on a database are all released by the
+ * unlock which balances its first lock.
+ * returns -1 on error (including a lock which would deadlock), 0 on success
  */
 int sdb_writelock( /* char *db, char *key, int flags */ );
 
@@ -161,6 +340,60 @@ int sdb_set( /* char *db, char *key, int flags, char *value */ );
  */
 int sdb_remove( /* char *db, char *key, int flags */ ); 
 
+/* open a handle on a database, to use it without looking its name up on
+ * each call.  Database names are "<db>" for a global database and
+ * "user/<name>/<db>" for a private one; no part of a name may be empty or
+ * start or end with '.'.  The database need not exist yet, and the handle
+ * stays valid after it's deleted.  A database with an open handle is kept
+ * cached.
+ * returns NULL if the name isn't valid
+ */
+sdb_db *sdb_open( /* char *db */ );
+
+/* close a handle returned by sdb_open
+ *  if h is NULL, no action is taken.
+ */
+void sdb_close( /* sdb_db *h */ );
+
+/* sdb_get, sdb_count, sdb_match, sdb_iter_open, sdb_writelock,
+ * sdb_unlock, sdb_set and sdb_remove on a handle returned by sdb_open
+ */
+int sdb_dbget( /* sdb_db *h, char *key, int flags, char **value */ );
+int sdb_dbcount( /* sdb_db *h, int flags */ );
+int sdb_dbmatch( /* sdb_db *h, char *key, int flags, char *vpat, int copy,
+		    sdb_keyvalue **kv, int *count */ );
+sdb_iter *sdb_dbiter_open( /* sdb_db *h, char *key, int flags,
+			      char *vpat */ );
+int sdb_dbwritelock( /* sdb_db *h, char *key, int flags */ );
+int sdb_dbunlock( /* sdb_db *h, char *key, int flags */ );
+int sdb_dbset( /* sdb_db *h, char *key, int flags, char *value */ );
+int sdb_dbremove( /* sdb_db *h, char *key, int flags */ );
+
+/* start a batch of sets and removes, to be applied to a database together
+ * returns NULL on failure
+ */
+sdb_batch *sdb_batch_open( /* void */ );
+
+/* add a set or a remove of a key to a batch.  The key and value are
+ * copied.  A key changed more than once in a batch keeps its last change.
+ * returns -1 on failure, which makes the batch fail to apply, 0 on success
+ */
+int sdb_batch_set( /* sdb_batch *b, char *key, char *value */ );
+int sdb_batch_remove( /* sdb_batch *b, char *key */ );
+
+/* apply the changes of a batch to a database, sorted and with a single
+ * pass over its index.  The database must be locked for all of the keys,
+ * as for sdb_set.  Removes of keys that don't exist are ignored.
+ * returns -1 on failure, 0 on success
+ */
+int sdb_batch_apply( /* char *db, sdb_batch *b, int flags */ );
+int sdb_dbbatch_apply( /* sdb_db *h, sdb_batch *b, int flags */ );
+
+/* finish with a batch
+ *  if b is NULL, no action is taken.
+ */
+void sdb_batch_close( /* sdb_batch *b */ );
+
 #endif /* __STDC__ */
 
 #endif /* SYNCDB_H */
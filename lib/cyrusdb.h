@@ -0,0 +1,131 @@
+/* cyrusdb.h -- interface to pluggable key/value storage engines
+ *
+ * Copyright (c) 1998-2000 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any other legal
+ *    details, please contact
+ *      Office of Technology Transfer
+ *      Carnegie Mellon University
+ *      5000 Forbes Avenue
+ *      Pittsburgh, PA  15213-3890
+ *      (412) 268-4387, fax: (412) 268-7395
+ *      tech-transfer@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#ifndef INCLUDED_CYRUSDB_H
+#define INCLUDED_CYRUSDB_H
+
+struct db;
+struct txn;
+
+enum cyrusdb_ret {
+    CYRUSDB_OK = 0,
+    CYRUSDB_DONE = 1,
+    CYRUSDB_IOERROR = -1,
+    CYRUSDB_AGAIN = -2,
+    CYRUSDB_EXISTS = -3,
+    CYRUSDB_NOTFOUND = -4,
+    CYRUSDB_BADFORMAT = -5
+};
+
+/* flags for open */
+enum cyrusdb_openflags {
+    CYRUSDB_CREATE = 0x01,	/* create the file if it doesn't exist */
+    CYRUSDB_ICASE = 0x02,	/* compare keys case insensitively; only
+				   used when the file is created */
+    CYRUSDB_SYNC = 0x04		/* fsync the file at each commit */
+};
+
+/* called for each record of a foreach; a non-zero return stops the walk
+   and is returned by foreach */
+typedef int foreach_cb(void *rock,
+		       const char *key, int keylen,
+		       const char *data, int datalen);
+
+/* a storage engine.  Keys are strings of keylen bytes; data of NULL with
+ * a datalen of 0 is a record without a value.  Records returned by fetch
+ * and foreach point into the engine and stay valid only until the next
+ * call on the same db.
+ *
+ * Calls taking a struct txn ** run in that transaction, starting it when
+ * *tid is NULL; the transaction holds an exclusive lock on the file until
+ * commit or abort.  With a NULL tid, fetch and foreach take a shared lock
+ * for the call only, and store and delete commit at once.
+ */
+struct cyrusdb_backend {
+    const char *name;
+
+    /* leading bytes of every file in this format */
+    const char *magic;
+    int magiclen;
+
+    int (*open)(const char *fname, int flags, struct db **ret);
+    int (*close)(struct db *db);
+
+    /* flags the file was created with: CYRUSDB_ICASE */
+    int (*getflags)(struct db *db);
+
+    /* returns CYRUSDB_NOTFOUND if the key doesn't exist */
+    int (*fetch)(struct db *db,
+		 const char *key, int keylen,
+		 const char **data, int *datalen,
+		 struct txn **tid);
+
+    /* fetch, starting a transaction to change the record in */
+    int (*fetchlock)(struct db *db,
+		     const char *key, int keylen,
+		     const char **data, int *datalen,
+		     struct txn **tid);
+
+    /* calls cb for each record starting with prefix, in key order */
+    int (*foreach)(struct db *db,
+		   const char *prefix, int prefixlen,
+		   foreach_cb *cb, void *rock,
+		   struct txn **tid);
+
+    /* replaces any record for the key */
+    int (*store)(struct db *db,
+		 const char *key, int keylen,
+		 const char *data, int datalen,
+		 struct txn **tid);
+
+    /* returns CYRUSDB_NOTFOUND if the key doesn't exist */
+    int (*delete)(struct db *db,
+		  const char *key, int keylen,
+		  struct txn **tid);
+
+    int (*commit)(struct db *db, struct txn *tid);
+    int (*abort)(struct db *db, struct txn *tid);
+};
+
+extern struct cyrusdb_backend cyrusdb_skiplist;
+
+#endif /* INCLUDED_CYRUSDB_H */
@@ -0,0 +1,1160 @@
+/* cyrusdb_skiplist.c -- single file, log structured skiplist storage engine
+ *
+ * Copyright (c) 1998-2000 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any other legal
+ *    details, please contact
+ *      Office of Technology Transfer
+ *      Carnegie Mellon University
+ *      5000 Forbes Avenue
+ *      Pittsburgh, PA  15213-3890
+ *      (412) 268-4387, fax: (412) 268-7395
+ *      tech-transfer@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+/* The file is a header followed by records, in the order they were
+ * written:
+ *
+ *   header:  magic[16] version flags curlevel count committed dead 0 0
+ *   INSERT:  type level keylen datalen key NUL [data NUL] pad forward[level]
+ *   DELETE:  type offset
+ *
+ * Numbers are 32 bits in network byte order and records are padded to
+ * 4 byte boundaries.  A datalen of 0xffffffff is a record without data.
+ * The first record is a dummy INSERT with SKIPLIST_MAXLEVEL levels that
+ * heads every list; an INSERT's forward pointers are the offsets of the
+ * next INSERT on each of its levels, or 0 at the end of the list.
+ *
+ * A write appends its record and only then rewrites the forward pointers
+ * of the records before it in place, keeping their old values so abort
+ * can put them back and cut the file at the transaction's start.  commit
+ * writes the file length to the header's committed field, so a file
+ * longer than that was left by a writer that died in a transaction.  The
+ * next process to lock it recovers by replaying the records up to the
+ * committed length, which are all that's needed to relink every list,
+ * and cutting off the rest.
+ *
+ * Replaced and deleted records are dead space.  Once that's most of a
+ * large file, commit rewrites the live records to a new file and renames
+ * it over the old one.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "cyrusdb.h"
+#include "lock.h"
+#include "map.h"
+#include "retry.h"
+
+#define SKIPLIST_VERSION 1
+#define SKIPLIST_MAXLEVEL 20
+#define SKIPLIST_PROB 4		/* 1 in SKIPLIST_PROB records gains a level */
+
+static const char HEADER_MAGIC[] = "\241\002\213\015sdbskip\n\0\0\0\0";
+#define HEADER_MAGIC_SIZE 16
+
+/* header layout */
+#define OFFSET_VERSION 16
+#define OFFSET_FLAGS 20
+#define OFFSET_CURLEVEL 24
+#define OFFSET_COUNT 28
+#define OFFSET_COMMITTED 32
+#define OFFSET_DEAD 36
+#define HEADER_SIZE 48
+
+#define DUMMY_OFFSET HEADER_SIZE
+#define DUMMY_SIZE (16 + 4 + 4 * SKIPLIST_MAXLEVEL)
+
+/* record types */
+#define INSERT 1
+#define DELETE 2
+#define DELETE_SIZE 8
+
+#define NOVALUE 0xffffffffUL
+
+/* smallest file rewritten to drop its dead space */
+#define CHECKPOINT_MIN 65536
+
+#define ROUNDUP(n) (((n) + 3) & ~3UL)
+#define GET32(p) \
+    (((unsigned long) ((const unsigned char *) (p))[0] << 24) \
+     | ((unsigned long) ((const unsigned char *) (p))[1] << 16) \
+     | ((unsigned long) ((const unsigned char *) (p))[2] << 8) \
+     | (unsigned long) ((const unsigned char *) (p))[3])
+
+/* fields of a record at ptr */
+#define TYPE(ptr) GET32(ptr)
+#define LEVEL(ptr) GET32((ptr) + 4)
+#define KEYLEN(ptr) GET32((ptr) + 8)
+#define DATALEN(ptr) GET32((ptr) + 12)
+#define KEY(ptr) ((ptr) + 16)
+#define DATA(ptr) (KEY(ptr) + KEYLEN(ptr) + 1)
+#define FWDBASE(ptr) FWDSTART(KEYLEN(ptr), DATALEN(ptr))
+#define FWDSTART(klen, dlen) \
+    (16 + ROUNDUP((klen) + 1 + ((dlen) == NOVALUE ? 0 : (dlen) + 1)))
+#define FORWARD(ptr, i) GET32((ptr) + FWDBASE(ptr) + 4 * (i))
+#define RECSIZE(ptr) \
+    (TYPE(ptr) == DELETE ? DELETE_SIZE : FWDBASE(ptr) + 4 * LEVEL(ptr))
+
+/* a pointer rewritten by a transaction */
+struct undo {
+    unsigned long off;
+    unsigned long old;
+};
+
+struct txn {
+    unsigned long start;	/* file length when it began */
+    unsigned long curlevel;	/* header values when it began */
+    unsigned long count;
+    unsigned long dead;
+    int failed;			/* a write failed, so commit must abort */
+    struct undo *undo;
+    unsigned long nundo, undosize;
+};
+
+struct db {
+    char *fname;
+    int fd;
+    ino_t ino;			/* file mapped */
+    const char *map_base;
+    unsigned long map_len;	/* length mapped */
+    unsigned long map_size;	/* length of the file */
+    int flags;			/* flags the file was created with */
+    int openflags;		/* flags it was opened with */
+
+    /* header values */
+    unsigned long curlevel;
+    unsigned long count;
+    unsigned long committed;
+    unsigned long dead;
+
+    int locked;
+    struct txn *current;
+};
+
+/* buffered output to a new file */
+struct wbuf {
+    int fd;
+    int err;
+    unsigned long len;
+    char buf[8192];
+};
+
+static int mycommit(struct db *db, struct txn *tid);
+static int myabort(struct db *db, struct txn *tid);
+
+static void put32(char *p, unsigned long n)
+{
+    p[0] = (char) (n >> 24);
+    p[1] = (char) (n >> 16);
+    p[2] = (char) (n >> 8);
+    p[3] = (char) n;
+}
+
+/* keys compare byte by byte, folded to lower case in a case insensitive
+   file, so that the order is the one strcmp or strcasecmp gives */
+static int compare(struct db *db, const char *s1, unsigned long l1,
+		   const char *s2, unsigned long l2)
+{
+    unsigned long min = l1 < l2 ? l1 : l2;
+    int cmp;
+
+    if (db->flags & CYRUSDB_ICASE) {
+	for (; min; --min, ++s1, ++s2) {
+	    cmp = tolower(*(const unsigned char *) s1)
+		- tolower(*(const unsigned char *) s2);
+	    if (cmp) return cmp;
+	}
+    } else if (min && (cmp = memcmp(s1, s2, min)) != 0) {
+	return cmp;
+    }
+
+    return l1 < l2 ? -1 : l1 > l2;
+}
+
+static int randlvl(void)
+{
+    int lvl = 1;
+
+    while (lvl < SKIPLIST_MAXLEVEL && (rand() % SKIPLIST_PROB) == 0) {
+	lvl++;
+    }
+    return lvl;
+}
+
+static void wbuf_flush(struct wbuf *out)
+{
+    if (out->len && !out->err
+	&& retry_write(out->fd, out->buf, out->len) != out->len) {
+	out->err = 1;
+    }
+    out->len = 0;
+}
+
+static void wbuf_write(struct wbuf *out, const char *data, unsigned long len)
+{
+    unsigned long n;
+
+    while (len) {
+	if (out->len == sizeof(out->buf)) wbuf_flush(out);
+	n = sizeof(out->buf) - out->len;
+	if (n > len) n = len;
+	memcpy(out->buf + out->len, data, n);
+	out->len += n;
+	data += n;
+	len -= n;
+    }
+}
+
+static void wbuf_put32(struct wbuf *out, unsigned long n)
+{
+    char buf[4];
+
+    put32(buf, n);
+    wbuf_write(out, buf, 4);
+}
+
+/* write the header and an empty dummy record of a new file */
+static void writestart(struct wbuf *out, int flags, unsigned long curlevel,
+		       unsigned long count, unsigned long committed,
+		       unsigned long dead)
+{
+    wbuf_write(out, HEADER_MAGIC, HEADER_MAGIC_SIZE);
+    wbuf_put32(out, SKIPLIST_VERSION);
+    wbuf_put32(out, flags & CYRUSDB_ICASE);
+    wbuf_put32(out, curlevel);
+    wbuf_put32(out, count);
+    wbuf_put32(out, committed);
+    wbuf_put32(out, dead);
+    wbuf_put32(out, 0);
+    wbuf_put32(out, 0);
+
+    wbuf_put32(out, INSERT);
+    wbuf_put32(out, SKIPLIST_MAXLEVEL);
+    wbuf_put32(out, 0);
+    wbuf_put32(out, NOVALUE);
+    wbuf_write(out, "\0\0\0\0", 4);
+}
+
+/* write at an offset in the file, without moving the file offset, which
+   processes forked with the file open share */
+static int writeat(int fd, const char *buf, unsigned long len,
+		   unsigned long off)
+{
+    int n;
+
+    while (len) {
+	n = pwrite(fd, buf, len, (off_t) off);
+	if (n < 0) {
+	    if (errno == EINTR) continue;
+	    return -1;
+	}
+	buf += n;
+	len -= n;
+	off += n;
+    }
+    return 0;
+}
+
+/* write a 32 bit value at an offset in the file */
+static int write32(struct db *db, unsigned long off, unsigned long val)
+{
+    char buf[4];
+
+    put32(buf, val);
+    if (writeat(db->fd, buf, 4, off) < 0) {
+	syslog(LOG_ERR, "IOERROR: writing %s: %m", db->fname);
+	return CYRUSDB_IOERROR;
+    }
+    return CYRUSDB_OK;
+}
+
+/* write the changing header fields */
+static int writeheader(struct db *db)
+{
+    char buf[16];
+
+    put32(buf, db->curlevel);
+    put32(buf + 4, db->count);
+    put32(buf + 8, db->committed);
+    put32(buf + 12, db->dead);
+    if (writeat(db->fd, buf, 16, OFFSET_CURLEVEL) < 0) {
+	syslog(LOG_ERR, "IOERROR: writing header of %s: %m", db->fname);
+	return CYRUSDB_IOERROR;
+    }
+    return CYRUSDB_OK;
+}
+
+/* map the file and read its header -- the file must be locked */
+static int readheader(struct db *db)
+{
+    struct stat sbuf;
+    const char *dummy;
+
+    if (fstat(db->fd, &sbuf) < 0) {
+	syslog(LOG_ERR, "IOERROR: fstating %s: %m", db->fname);
+	return CYRUSDB_IOERROR;
+    }
+    if (sbuf.st_ino != db->ino) {
+	map_free(&db->map_base, &db->map_len);
+	db->ino = sbuf.st_ino;
+    }
+    db->map_size = sbuf.st_size;
+    if (db->map_size < HEADER_SIZE + DUMMY_SIZE) {
+	return CYRUSDB_BADFORMAT;
+    }
+    map_refresh(db->fd, 0, &db->map_base, &db->map_len, db->map_size,
+		db->fname, 0);
+
+    if (memcmp(db->map_base, HEADER_MAGIC, HEADER_MAGIC_SIZE)
+	|| GET32(db->map_base + OFFSET_VERSION) != SKIPLIST_VERSION) {
+	return CYRUSDB_BADFORMAT;
+    }
+    db->flags = GET32(db->map_base + OFFSET_FLAGS) & CYRUSDB_ICASE;
+    db->curlevel = GET32(db->map_base + OFFSET_CURLEVEL);
+    db->count = GET32(db->map_base + OFFSET_COUNT);
+    db->committed = GET32(db->map_base + OFFSET_COMMITTED);
+    db->dead = GET32(db->map_base + OFFSET_DEAD);
+
+    dummy = db->map_base + DUMMY_OFFSET;
+    if (db->curlevel < 1 || db->curlevel > SKIPLIST_MAXLEVEL
+	|| db->committed < HEADER_SIZE + DUMMY_SIZE
+	|| db->committed > db->map_size
+	|| TYPE(dummy) != INSERT || LEVEL(dummy) != SKIPLIST_MAXLEVEL) {
+	syslog(LOG_ERR, "DBERROR: %s: bad skiplist header", db->fname);
+	return CYRUSDB_BADFORMAT;
+    }
+
+    return CYRUSDB_OK;
+}
+
+static void unlock(struct db *db)
+{
+    lock_unlock(db->fd);
+    db->locked = 0;
+}
+
+static int recovery(struct db *db);
+
+/* lock the file exclusively, recovering it if a writer died */
+static int write_lock(struct db *db)
+{
+    const char *action;
+    int r;
+
+    if (lock_reopen(db->fd, db->fname, NULL, &action) < 0) {
+	syslog(LOG_ERR, "IOERROR: %s %s: %m", action, db->fname);
+	return CYRUSDB_IOERROR;
+    }
+    db->locked = 1;
+
+    r = readheader(db);
+    if (r == CYRUSDB_OK && db->map_size > db->committed) {
+	r = recovery(db);
+    }
+    if (r != CYRUSDB_OK) unlock(db);
+
+    return r;
+}
+
+/* lock the file for reading, following it if it was replaced */
+static int read_lock(struct db *db)
+{
+    struct stat sbuf, sfile;
+    int newfd;
+    int r;
+
+    for (;;) {
+	if (lock_shared(db->fd) < 0) {
+	    syslog(LOG_ERR, "IOERROR: locking %s: %m", db->fname);
+	    return CYRUSDB_IOERROR;
+	}
+	if (fstat(db->fd, &sbuf) < 0 || stat(db->fname, &sfile) < 0) {
+	    syslog(LOG_ERR, "IOERROR: stating %s: %m", db->fname);
+	    lock_unlock(db->fd);
+	    return CYRUSDB_IOERROR;
+	}
+	if (sbuf.st_ino == sfile.st_ino) break;
+
+	newfd = open(db->fname, O_RDWR);
+	if (newfd < 0) {
+	    syslog(LOG_ERR, "IOERROR: opening %s: %m", db->fname);
+	    lock_unlock(db->fd);
+	    return CYRUSDB_IOERROR;
+	}
+	dup2(newfd, db->fd);
+	close(newfd);
+    }
+    db->locked = 1;
+
+    r = readheader(db);
+    if (r == CYRUSDB_OK && db->map_size > db->committed) {
+	/* a writer died; the exclusive lock recovery takes serves as well */
+	unlock(db);
+	return write_lock(db);
+    }
+    if (r != CYRUSDB_OK) unlock(db);
+
+    return r;
+}
+
+/* find the first record not less than key, filling update with the last
+   record before it on each level */
+static unsigned long find(struct db *db, const char *key, unsigned long keylen,
+			  unsigned long *update)
+{
+    const char *ptr;
+    unsigned long off, next;
+    int i;
+
+    off = DUMMY_OFFSET;
+    for (i = db->curlevel - 1; i >= 0; i--) {
+	while ((next = FORWARD(db->map_base + off, i)) != 0) {
+	    ptr = db->map_base + next;
+	    if (compare(db, KEY(ptr), KEYLEN(ptr), key, keylen) >= 0) break;
+	    off = next;
+	}
+	if (update) update[i] = off;
+    }
+
+    return FORWARD(db->map_base + off, 0);
+}
+
+/* the offset of the pointer to level i in the record at off */
+static unsigned long fwdptr(struct db *db, unsigned long off, int i)
+{
+    return off + FWDBASE(db->map_base + off) + 4 * i;
+}
+
+/* rewrite a pointer in a transaction, remembering its old value */
+static int setptr(struct db *db, unsigned long off, unsigned long val)
+{
+    struct txn *tid = db->current;
+    struct undo *undo;
+
+    if (tid->nundo == tid->undosize) {
+	tid->undosize = tid->undosize ? 2 * tid->undosize : 64;
+	undo = (struct undo *) realloc(tid->undo,
+				       tid->undosize * sizeof(struct undo));
+	if (undo == NULL) return CYRUSDB_IOERROR;
+	tid->undo = undo;
+    }
+    tid->undo[tid->nundo].off = off;
+    tid->undo[tid->nundo].old = GET32(db->map_base + off);
+    tid->nundo++;
+
+    return write32(db, off, val);
+}
+
+/* append a record to the file in a transaction */
+static int append(struct db *db, const char *buf, unsigned long len,
+		  unsigned long *off)
+{
+    if (writeat(db->fd, buf, len, db->map_size) < 0) {
+	syslog(LOG_ERR, "IOERROR: appending to %s: %m", db->fname);
+	ftruncate(db->fd, (off_t) db->map_size);
+	return CYRUSDB_IOERROR;
+    }
+    *off = db->map_size;
+    db->map_size += len;
+    map_refresh(db->fd, 0, &db->map_base, &db->map_len, db->map_size,
+		db->fname, 0);
+
+    return CYRUSDB_OK;
+}
+
+/* join the transaction in *tidptr, or start one */
+static int begin(struct db *db, struct txn **tidptr)
+{
+    struct txn *tid;
+    int r;
+
+    if (*tidptr) {
+	return *tidptr == db->current ? CYRUSDB_OK : CYRUSDB_IOERROR;
+    }
+    if (db->current) return CYRUSDB_IOERROR;
+
+    r = write_lock(db);
+    if (r != CYRUSDB_OK) return r;
+
+    tid = (struct txn *) malloc(sizeof(struct txn));
+    if (tid == NULL) {
+	unlock(db);
+	return CYRUSDB_IOERROR;
+    }
+    memset(tid, 0, sizeof(struct txn));
+    tid->start = db->map_size;
+    tid->curlevel = db->curlevel;
+    tid->count = db->count;
+    tid->dead = db->dead;
+    db->current = *tidptr = tid;
+
+    return CYRUSDB_OK;
+}
+
+/* lock for a read, unless a transaction already holds the file */
+static int readbegin(struct db *db, struct txn **tid, int *locked)
+{
+    *locked = 0;
+    if (tid) return begin(db, tid);
+    if (db->current) return CYRUSDB_OK;
+    *locked = 1;
+    return read_lock(db);
+}
+
+static int myopen(const char *fname, int flags, struct db **ret)
+{
+    struct db *db;
+    struct stat sbuf;
+    struct wbuf out;
+    const char *action;
+    int i;
+    int r;
+
+    db = (struct db *) malloc(sizeof(struct db));
+    if (db == NULL) return CYRUSDB_IOERROR;
+    memset(db, 0, sizeof(struct db));
+    db->fname = strdup(fname);
+    db->openflags = flags;
+    db->fd = open(fname, O_RDWR | ((flags & CYRUSDB_CREATE) ? O_CREAT : 0),
+		  0600);
+    if (db->fname == NULL || db->fd < 0) {
+	r = (db->fd < 0 && errno == ENOENT) ? CYRUSDB_NOTFOUND
+	    : CYRUSDB_IOERROR;
+	if (db->fd >= 0) close(db->fd);
+	free(db->fname);
+	free(db);
+	return r;
+    }
+
+    /* : lay out a new file, unless someone beat us to it */
+    if ((flags & CYRUSDB_CREATE) && fstat(db->fd, &sbuf) == 0
+	&& sbuf.st_size == 0) {
+	if (lock_reopen(db->fd, fname, &sbuf, &action) < 0) {
+	    syslog(LOG_ERR, "IOERROR: %s %s: %m", action, fname);
+	} else {
+	    if (sbuf.st_size == 0) {
+		out.fd = db->fd;
+		out.err = 0;
+		out.len = 0;
+		writestart(&out, flags, 1, 0, HEADER_SIZE + DUMMY_SIZE, 0);
+		for (i = 0; i < SKIPLIST_MAXLEVEL; i++) {
+		    wbuf_put32(&out, 0);
+		}
+		wbuf_flush(&out);
+		if (out.err || fsync(db->fd) < 0) {
+		    syslog(LOG_ERR, "IOERROR: creating %s: %m", fname);
+		    ftruncate(db->fd, 0);
+		}
+	    }
+	    lock_unlock(db->fd);
+	}
+    }
+
+    r = read_lock(db);
+    if (r != CYRUSDB_OK) {
+	map_free(&db->map_base, &db->map_len);
+	close(db->fd);
+	free(db->fname);
+	free(db);
+	return r;
+    }
+    unlock(db);
+
+    *ret = db;
+    return CYRUSDB_OK;
+}
+
+static int myclose(struct db *db)
+{
+    if (db->current) myabort(db, db->current);
+    map_free(&db->map_base, &db->map_len);
+    close(db->fd);
+    free(db->fname);
+    free(db);
+
+    return CYRUSDB_OK;
+}
+
+static int mygetflags(struct db *db)
+{
+    return db->flags;
+}
+
+static int myfetch(struct db *db,
+		   const char *key, int keylen,
+		   const char **data, int *datalen,
+		   struct txn **tid)
+{
+    const char *ptr;
+    unsigned long off;
+    int locked;
+    int r;
+
+    r = readbegin(db, tid, &locked);
+    if (r != CYRUSDB_OK) return r;
+
+    off = find(db, key, keylen, NULL);
+    ptr = db->map_base + off;
+    if (off && !compare(db, KEY(ptr), KEYLEN(ptr), key, keylen)) {
+	if (data) {
+	    *data = DATALEN(ptr) == NOVALUE ? NULL : DATA(ptr);
+	    *datalen = DATALEN(ptr) == NOVALUE ? 0 : DATALEN(ptr);
+	}
+    } else {
+	r = CYRUSDB_NOTFOUND;
+    }
+
+    if (locked) unlock(db);
+
+    return r;
+}
+
+static int myfetchlock(struct db *db,
+		       const char *key, int keylen,
+		       const char **data, int *datalen,
+		       struct txn **tid)
+{
+    struct txn *ignore = NULL;
+
+    return myfetch(db, key, keylen, data, datalen, tid ? tid : &ignore);
+}
+
+/* the callback must not change the db */
+static int myforeach(struct db *db,
+		     const char *prefix, int prefixlen,
+		     foreach_cb *cb, void *rock,
+		     struct txn **tid)
+{
+    const char *ptr;
+    unsigned long off;
+    int locked;
+    int r;
+
+    r = readbegin(db, tid, &locked);
+    if (r != CYRUSDB_OK) return r;
+
+    for (off = find(db, prefix, prefixlen, NULL); off;
+	 off = FORWARD(ptr, 0)) {
+	ptr = db->map_base + off;
+	if (KEYLEN(ptr) < (unsigned long) prefixlen
+	    || compare(db, KEY(ptr), prefixlen, prefix, prefixlen)) {
+	    break;
+	}
+	r = cb(rock, KEY(ptr), KEYLEN(ptr),
+	       DATALEN(ptr) == NOVALUE ? NULL : DATA(ptr),
+	       DATALEN(ptr) == NOVALUE ? 0 : DATALEN(ptr));
+	if (r) break;
+    }
+
+    if (locked) unlock(db);
+
+    return r;
+}
+
+/* finish a write: commit a transaction of its own, or note a failure in
+   the caller's */
+static int endwrite(struct db *db, struct txn *localtid, int r)
+{
+    if (localtid) {
+	if (r == CYRUSDB_OK) return mycommit(db, localtid);
+	myabort(db, localtid);
+    } else if (r != CYRUSDB_OK && r != CYRUSDB_NOTFOUND) {
+	db->current->failed = 1;
+    }
+    return r;
+}
+
+static int mystore(struct db *db,
+		   const char *key, int keylen,
+		   const char *data, int datalen,
+		   struct txn **tid)
+{
+    struct txn *localtid = NULL;
+    unsigned long update[SKIPLIST_MAXLEVEL];
+    unsigned long off, newoff, dlen, size, next;
+    const char *old;
+    int oldlvl, lvl, i;
+    char *buf;
+    int r;
+
+    if (tid == NULL) tid = &localtid;
+    r = begin(db, tid);
+    if (r != CYRUSDB_OK) return r;
+
+    /* : look for the record to replace */
+    off = find(db, key, keylen, update);
+    old = db->map_base + off;
+    oldlvl = 0;
+    if (off && !compare(db, KEY(old), KEYLEN(old), key, keylen)) {
+	oldlvl = LEVEL(old);
+    }
+
+    lvl = randlvl();
+    if (lvl > db->curlevel) {
+	for (i = db->curlevel; i < lvl; i++) {
+	    update[i] = DUMMY_OFFSET;
+	}
+	db->curlevel = lvl;
+    }
+
+    /* : build the record, pointing past any record it replaces */
+    dlen = data ? (unsigned long) datalen : NOVALUE;
+    size = FWDSTART(keylen, dlen) + 4 * lvl;
+    buf = (char *) malloc(size);
+    if (buf == NULL) return endwrite(db, localtid, CYRUSDB_IOERROR);
+    memset(buf, 0, size);
+    put32(buf, INSERT);
+    put32(buf + 4, lvl);
+    put32(buf + 8, keylen);
+    put32(buf + 12, dlen);
+    memcpy(buf + 16, key, keylen);
+    if (data) memcpy(buf + 16 + keylen + 1, data, datalen);
+    for (i = 0; i < lvl; i++) {
+	next = FORWARD(db->map_base + update[i], i);
+	if (i < oldlvl) next = FORWARD(old, i);
+	put32(buf + FWDSTART(keylen, dlen) + 4 * i, next);
+    }
+
+    /* : append it before linking it in, so a crash leaves a file longer
+       than its committed length */
+    r = append(db, buf, size, &newoff);
+    free(buf);
+    if (r != CYRUSDB_OK) return endwrite(db, localtid, r);
+    if (oldlvl) old = db->map_base + off;
+
+    for (i = 0; r == CYRUSDB_OK && i < (lvl > oldlvl ? lvl : oldlvl); i++) {
+	next = i < lvl ? newoff : FORWARD(old, i);
+	r = setptr(db, fwdptr(db, update[i], i), next);
+    }
+
+    if (oldlvl) {
+	db->dead += RECSIZE(old);
+    } else {
+	db->count++;
+    }
+
+    return endwrite(db, localtid, r);
+}
+
+static int mydelete(struct db *db,
+		    const char *key, int keylen,
+		    struct txn **tid)
+{
+    struct txn *localtid = NULL;
+    unsigned long update[SKIPLIST_MAXLEVEL];
+    unsigned long off, newoff;
+    const char *old;
+    char buf[DELETE_SIZE];
+    int i;
+    int r;
+
+    if (tid == NULL) tid = &localtid;
+    r = begin(db, tid);
+    if (r != CYRUSDB_OK) return r;
+
+    off = find(db, key, keylen, update);
+    old = db->map_base + off;
+    if (!off || compare(db, KEY(old), KEYLEN(old), key, keylen)) {
+	return endwrite(db, localtid, CYRUSDB_NOTFOUND);
+    }
+
+    /* : note the delete before unlinking the record */
+    put32(buf, DELETE);
+    put32(buf + 4, off);
+    r = append(db, buf, DELETE_SIZE, &newoff);
+    if (r != CYRUSDB_OK) return endwrite(db, localtid, r);
+    old = db->map_base + off;
+
+    for (i = 0; r == CYRUSDB_OK && i < LEVEL(old); i++) {
+	r = setptr(db, fwdptr(db, update[i], i), FORWARD(old, i));
+    }
+    db->dead += RECSIZE(old) + DELETE_SIZE;
+    db->count--;
+
+    return endwrite(db, localtid, r);
+}
+
+/* order offsets of INSERT records by key, then by offset */
+static struct db *sortdb;
+
+static int sortcmp(const void *a, const void *b)
+{
+    const char *pa = sortdb->map_base + *(const unsigned long *) a;
+    const char *pb = sortdb->map_base + *(const unsigned long *) b;
+    int cmp;
+
+    cmp = compare(sortdb, KEY(pa), KEYLEN(pa), KEY(pb), KEYLEN(pb));
+    if (cmp) return cmp;
+    return pa < pb ? -1 : pa > pb;
+}
+
+static int offcmp(const void *a, const void *b)
+{
+    unsigned long oa = *(const unsigned long *) a;
+    unsigned long ob = *(const unsigned long *) b;
+
+    return oa < ob ? -1 : oa > ob;
+}
+
+/* check the record at off, before end */
+static int goodrecord(struct db *db, unsigned long off, unsigned long end)
+{
+    const char *ptr = db->map_base + off;
+    unsigned long left = end - off;
+
+    if (left < DELETE_SIZE) return 0;
+    if (TYPE(ptr) == DELETE) return 1;
+    if (TYPE(ptr) != INSERT || left < 16
+	|| LEVEL(ptr) < 1 || LEVEL(ptr) > SKIPLIST_MAXLEVEL
+	|| KEYLEN(ptr) >= left
+	|| (DATALEN(ptr) != NOVALUE && DATALEN(ptr) >= left)
+	|| RECSIZE(ptr) > left
+	|| KEY(ptr)[KEYLEN(ptr)] != '\0'
+	|| (DATALEN(ptr) != NOVALUE && DATA(ptr)[DATALEN(ptr)] != '\0')) {
+	return 0;
+    }
+    return 1;
+}
+
+/* relink the committed records of a file a writer died with, and cut off
+   the rest -- the file must be locked exclusively */
+static int recovery(struct db *db)
+{
+    unsigned long *live = NULL, nlive = 0;
+    unsigned long *gone = NULL, ngone = 0;
+    unsigned long off, end, prev, used, i, j;
+    unsigned long maxlvl;
+    int lvl;
+    int r = CYRUSDB_OK;
+
+    /* : collect the records up to the committed length */
+    end = db->committed;
+    off = DUMMY_OFFSET + DUMMY_SIZE;
+    live = (unsigned long *) malloc((end - off) / 24 * sizeof(unsigned long)
+				    + sizeof(unsigned long));
+    gone = (unsigned long *) malloc((end - off) / DELETE_SIZE
+				    * sizeof(unsigned long)
+				    + sizeof(unsigned long));
+    if (live == NULL || gone == NULL) {
+	r = CYRUSDB_IOERROR;
+	goto done;
+    }
+    while (off < end && goodrecord(db, off, end)) {
+	if (TYPE(db->map_base + off) == DELETE) {
+	    gone[ngone++] = GET32(db->map_base + off + 4);
+	} else {
+	    live[nlive++] = off;
+	}
+	off += RECSIZE(db->map_base + off);
+    }
+    if (off < end) {
+	syslog(LOG_ERR, "DBERROR: %s: bad record at %lu, dropping the rest",
+	       db->fname, off);
+	end = off;
+    }
+
+    /* : keep the last record for each key, unless it was deleted */
+    sortdb = db;
+    qsort(live, nlive, sizeof(unsigned long), sortcmp);
+    qsort(gone, ngone, sizeof(unsigned long), offcmp);
+    for (i = j = 0; i < nlive; i++) {
+	if (i + 1 < nlive && !compare(db,
+		KEY(db->map_base + live[i]), KEYLEN(db->map_base + live[i]),
+		KEY(db->map_base + live[i + 1]),
+		KEYLEN(db->map_base + live[i + 1]))) {
+	    continue;
+	}
+	if (bsearch(&live[i], gone, ngone, sizeof(unsigned long), offcmp)) {
+	    continue;
+	}
+	live[j++] = live[i];
+    }
+    nlive = j;
+
+    /* : relink every level in key order */
+    maxlvl = 1;
+    used = 0;
+    for (i = 0; i < nlive; i++) {
+	if (LEVEL(db->map_base + live[i]) > maxlvl) {
+	    maxlvl = LEVEL(db->map_base + live[i]);
+	}
+	used += RECSIZE(db->map_base + live[i]);
+    }
+    for (lvl = 0; r == CYRUSDB_OK && lvl < SKIPLIST_MAXLEVEL; lvl++) {
+	prev = DUMMY_OFFSET;
+	for (i = 0; r == CYRUSDB_OK && i < nlive; i++) {
+	    if (LEVEL(db->map_base + live[i]) > lvl) {
+		r = write32(db, fwdptr(db, prev, lvl), live[i]);
+		prev = live[i];
+	    }
+	}
+	if (r == CYRUSDB_OK) r = write32(db, fwdptr(db, prev, lvl), 0);
+    }
+    if (r != CYRUSDB_OK) goto done;
+
+    /* : cut off the uncommitted records and commit the result */
+    if (ftruncate(db->fd, (off_t) end) < 0) {
+	syslog(LOG_ERR, "IOERROR: truncating %s: %m", db->fname);
+	r = CYRUSDB_IOERROR;
+	goto done;
+    }
+    db->map_size = db->committed = end;
+    db->curlevel = maxlvl;
+    db->count = nlive;
+    db->dead = end - DUMMY_OFFSET - DUMMY_SIZE - used;
+    r = writeheader(db);
+    if (r == CYRUSDB_OK && fsync(db->fd) < 0) {
+	syslog(LOG_ERR, "IOERROR: syncing %s: %m", db->fname);
+	r = CYRUSDB_IOERROR;
+    }
+    if (r == CYRUSDB_OK) {
+	syslog(LOG_NOTICE, "skiplist: recovered %s (%lu records)",
+	       db->fname, nlive);
+    }
+
+ done:
+    free(live);
+    free(gone);
+    return r;
+}
+
+/* rewrite the live records to a new file and rename it over the old one
+   -- the file must be locked exclusively, with no transaction */
+static int checkpoint(struct db *db)
+{
+    unsigned long *offs = NULL, *fwd = NULL, *fwdpos = NULL;
+    unsigned char *lvls = NULL;
+    unsigned long nextat[SKIPLIST_MAXLEVEL];
+    unsigned long n, i, pos, nfwd, off, dlen;
+    unsigned long maxlvl;
+    const char *ptr;
+    struct wbuf out;
+    struct stat sbuf;
+    char *newname = NULL;
+    int fd = -1;
+    int lvl;
+    int r = CYRUSDB_IOERROR;
+
+    /* : collect the live records in key order and give them new levels */
+    offs = (unsigned long *) malloc((db->count + 1) * sizeof(unsigned long));
+    fwdpos = (unsigned long *) malloc((db->count + 1) * sizeof(unsigned long));
+    lvls = (unsigned char *) malloc(db->count + 1);
+    if (offs == NULL || fwdpos == NULL || lvls == NULL) goto done;
+    n = 0;
+    nfwd = 0;
+    maxlvl = 1;
+    for (off = FORWARD(db->map_base + DUMMY_OFFSET, 0); off;
+	 off = FORWARD(db->map_base + off, 0)) {
+	if (n == db->count) goto done;
+	offs[n] = off;
+	lvls[n] = lvl = randlvl();
+	if (lvl > maxlvl) maxlvl = lvl;
+	fwdpos[n] = nfwd;
+	nfwd += lvl;
+	n++;
+    }
+
+    /* : work out where they go, and so their forward pointers */
+    fwd = (unsigned long *) malloc((nfwd + 1) * sizeof(unsigned long));
+    if (fwd == NULL) goto done;
+    pos = HEADER_SIZE + DUMMY_SIZE;
+    for (i = 0; i < n; i++) {
+	ptr = db->map_base + offs[i];
+	dlen = DATALEN(ptr);
+	fwd[fwdpos[i]] = pos;
+	pos += FWDSTART(KEYLEN(ptr), dlen) + 4 * lvls[i];
+    }
+    memset(nextat, 0, sizeof(nextat));
+    for (i = n; i-- > 0; ) {
+	off = fwd[fwdpos[i]];
+	for (lvl = 0; lvl < lvls[i]; lvl++) {
+	    fwd[fwdpos[i] + lvl] = nextat[lvl];
+	}
+	for (lvl = 0; lvl < lvls[i]; lvl++) {
+	    nextat[lvl] = off;
+	}
+    }
+
+    /* : write the new file */
+    newname = (char *) malloc(strlen(db->fname) + 5);
+    if (newname == NULL) goto done;
+    sprintf(newname, "%s.NEW", db->fname);
+    fd = open(newname, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0 || lock_blocking(fd) < 0) {
+	syslog(LOG_ERR, "IOERROR: creating %s: %m", newname);
+	goto done;
+    }
+    out.fd = fd;
+    out.err = 0;
+    out.len = 0;
+    writestart(&out, db->flags, maxlvl, n, pos, 0);
+    for (lvl = 0; lvl < SKIPLIST_MAXLEVEL; lvl++) {
+	wbuf_put32(&out, nextat[lvl]);
+    }
+    for (i = 0; i < n; i++) {
+	ptr = db->map_base + offs[i];
+	dlen = DATALEN(ptr);
+	wbuf_put32(&out, INSERT);
+	wbuf_put32(&out, lvls[i]);
+	wbuf_put32(&out, KEYLEN(ptr));
+	wbuf_put32(&out, dlen);
+	wbuf_write(&out, KEY(ptr), FWDSTART(KEYLEN(ptr), dlen) - 16);
+	for (lvl = 0; lvl < lvls[i]; lvl++) {
+	    wbuf_put32(&out, fwd[fwdpos[i] + lvl]);
+	}
+    }
+    wbuf_flush(&out);
+    if (out.err || fsync(fd) < 0 || fstat(fd, &sbuf) < 0
+	|| rename(newname, db->fname) < 0) {
+	syslog(LOG_ERR, "IOERROR: writing %s: %m", newname);
+	unlink(newname);
+	goto done;
+    }
+
+    /* : carry on with the new file, still locked */
+    close(db->fd);
+    db->fd = fd;
+    fd = -1;
+    r = readheader(db);
+
+ done:
+    if (fd >= 0) close(fd);
+    free(newname);
+    free(offs);
+    free(fwdpos);
+    free(lvls);
+    free(fwd);
+    return r;
+}
+
+static int mycommit(struct db *db, struct txn *tid)
+{
+    int r = CYRUSDB_OK;
+
+    if (tid != db->current) return CYRUSDB_IOERROR;
+    if (tid->failed) {
+	myabort(db, tid);
+	return CYRUSDB_IOERROR;
+    }
+
+    /* : make the records durable before the header points past them */
+    if (db->map_size != tid->start) {
+	if ((db->openflags & CYRUSDB_SYNC) && fsync(db->fd) < 0) {
+	    syslog(LOG_ERR, "IOERROR: syncing %s: %m", db->fname);
+	    r = CYRUSDB_IOERROR;
+	}
+	if (r == CYRUSDB_OK) {
+	    db->committed = db->map_size;
+	    r = writeheader(db);
+	}
+	if (r == CYRUSDB_OK && (db->openflags & CYRUSDB_SYNC)
+	    && fsync(db->fd) < 0) {
+	    syslog(LOG_ERR, "IOERROR: syncing %s: %m", db->fname);
+	    r = CYRUSDB_IOERROR;
+	}
+	if (r != CYRUSDB_OK) {
+	    db->committed = tid->start;
+	    myabort(db, tid);
+	    return r;
+	}
+    }
+    free(tid->undo);
+    free(tid);
+    db->current = NULL;
+
+    /* : drop the dead space once it's most of the file */
+    if (db->map_size > CHECKPOINT_MIN && db->dead > db->map_size / 2) {
+	checkpoint(db);
+    }
+    unlock(db);
+
+    return CYRUSDB_OK;
+}
+
+static int myabort(struct db *db, struct txn *tid)
+{
+    int r = CYRUSDB_OK;
+
+    if (tid != db->current) return CYRUSDB_IOERROR;
+
+    /* : put the pointers back, newest first, then cut off the records.
+       If that fails, the file is left for recovery. */
+    while (r == CYRUSDB_OK && tid->nundo) {
+	tid->nundo--;
+	r = write32(db, tid->undo[tid->nundo].off, tid->undo[tid->nundo].old);
+    }
+    if (r == CYRUSDB_OK && ftruncate(db->fd, (off_t) tid->start) < 0) {
+	syslog(LOG_ERR, "IOERROR: truncating %s: %m", db->fname);
+	r = CYRUSDB_IOERROR;
+    }
+    db->map_size = tid->start;
+    db->curlevel = tid->curlevel;
+    db->count = tid->count;
+    db->dead = tid->dead;
+
+    free(tid->undo);
+    free(tid);
+    db->current = NULL;
+    unlock(db);
+
+    return r;
+}
+
+struct cyrusdb_backend cyrusdb_skiplist =
+{
+    "skiplist",
+    HEADER_MAGIC,
+    HEADER_MAGIC_SIZE,
+
+    &myopen,
+    &myclose,
+    &mygetflags,
+    &myfetch,
+    &myfetchlock,
+    &myforeach,
+    &mystore,
+    &mydelete,
+    &mycommit,
+    &myabort
+};
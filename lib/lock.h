@@ -59,6 +59,7 @@ extern int lock_reopen P((int fd, const char *filename,
 extern int lock_blocking P((int fd));
 extern int lock_shared P((int fd));
 extern int lock_nonblocking P((int fd));
+extern int lock_range P((int fd, unsigned long start, unsigned long len));
 extern int lock_unlock P((int fd));
 
 #endif /* INCLUDED_LOCK_H */
@@ -189,6 +189,34 @@ int fd;
     }
 }
 
+/*
+ * Block until we obtain an exclusive lock on the 'len' bytes of 'fd'
+ * starting at offset 'start', which need not lie within the file.
+ * Processes holding locks on different bytes of a file don't wait for
+ * each other.  Released by lock_unlock() with the rest of the file.
+ * Returns 0 for success, -1 for failure, with errno set to an
+ * appropriate error code -- EDEADLK if waiting would deadlock.
+ */
+int lock_range(fd, start, len)
+int fd;
+unsigned long start;
+unsigned long len;
+{
+    int r;
+    struct flock fl;
+
+    for (;;) {
+	fl.l_type= F_WRLCK;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = start;
+	fl.l_len = len;
+	r = fcntl(fd, F_SETLKW, &fl);
+	if (r != -1) return 0;
+	if (errno == EINTR) continue;
+	return -1;
+    }
+}
+
 /*
  * Release any lock on 'fd'.  Always returns success.
  */
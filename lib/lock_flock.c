@@ -163,6 +163,19 @@ int fd;
     }
 }
 
+/*
+ * flock() can't lock part of a file, so lock all of 'fd'.
+ * Returns 0 for success, -1 for failure, with errno set to an
+ * appropriate error code.
+ */
+int lock_range(fd, start, len)
+int fd;
+unsigned long start;
+unsigned long len;
+{
+    return lock_blocking(fd);
+}
+
 /*
  * Release any lock on 'fd'.  Always returns success.
  */